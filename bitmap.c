@@ -0,0 +1,245 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "bitmap.h"
+
+#define WORD_BITS 64
+#define ALL_USED  (~(uint64_t)0)
+
+int bitmap_init( struct bitmap *map, int nbits )
+{
+	map->nbits = nbits;
+	map->nwords = (nbits + WORD_BITS-1) / WORD_BITS;
+	map->hint = 0;
+	map->scanned = 0;
+	map->used = 0;
+	map->reserved = 0;
+
+	// pad to a multiple of four words so the SIMD scan never reads off the end
+	int padded = (map->nwords + 3) & ~3;
+	map->words = calloc(padded > 0 ? padded : 4,sizeof(uint64_t));
+	if(!map->words) return 0;
+
+	// bits past the end of the disk look used so they are never handed out
+	int i;
+	for(i = nbits; i < padded*WORD_BITS; i++){
+		map->words[i/WORD_BITS] |= (uint64_t)1 << (i%WORD_BITS);
+	}
+
+	return 1;
+}
+
+void bitmap_free( struct bitmap *map )
+{
+	free(map->words);
+	map->words = 0;
+	map->nbits = 0;
+	map->nwords = 0;
+	map->hint = 0;
+	map->used = 0;
+	map->reserved = 0;
+}
+
+void bitmap_set( struct bitmap *map, int bit )
+{
+	if(bit < 0 || bit >= map->nbits) return;
+	uint64_t mask = (uint64_t)1 << (bit%WORD_BITS);
+	if(!(map->words[bit/WORD_BITS] & mask)) map->used++;
+	map->words[bit/WORD_BITS] |= mask;
+}
+
+void bitmap_clear( struct bitmap *map, int bit )
+{
+	if(bit < 0 || bit >= map->nbits) return;
+	uint64_t mask = (uint64_t)1 << (bit%WORD_BITS);
+	if(map->words[bit/WORD_BITS] & mask) map->used--;
+	map->words[bit/WORD_BITS] &= ~mask;
+}
+
+int bitmap_test( const struct bitmap *map, int bit )
+{
+	if(bit < 0 || bit >= map->nbits) return 1;
+	return (map->words[bit/WORD_BITS] >> (bit%WORD_BITS)) & 1;
+}
+
+// number of bits set, not counting the padding past the end
+int bitmap_count( const struct bitmap *map )
+{
+	return map->used;
+}
+
+// counts the bits set again, for after the words were written directly
+void bitmap_recount( struct bitmap *map )
+{
+	int i, n = 0;
+	for(i = 0; i < map->nwords; i++){
+		n += __builtin_popcountll(map->words[i]);
+	}
+	map->used = n - (map->nwords*WORD_BITS - map->nbits);
+}
+
+// returns the first word in [from,to) with a free bit in it, or -1
+static int find_free_word( const struct bitmap *map, int from, int to )
+{
+	int w = from;
+
+#ifdef __AVX2__
+	// step to a four word boundary, then skip full 256 bit chunks at a time
+	while(w < to && (w & 3)) {
+		if(map->words[w] != ALL_USED) return w;
+		w++;
+	}
+	const __m256i ones = _mm256_set1_epi64x(-1);
+	while(w+4 <= to) {
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)&map->words[w]);
+		if(!_mm256_testc_si256(chunk,ones)) break;
+		w += 4;
+	}
+#endif
+
+	for(; w < to; w++){
+		if(map->words[w] != ALL_USED) return w;
+	}
+	return -1;
+}
+
+// claims the first free bit at or after the hint, wrapping around once
+int bitmap_alloc( struct bitmap *map )
+{
+	map->scanned = map->nbits;
+	if(map->nwords == 0 || map->nbits-map->used <= map->reserved) return -1;
+
+	int start = map->hint / WORD_BITS;
+	uint64_t first = map->words[start] | (((uint64_t)1 << (map->hint%WORD_BITS)) - 1);
+	int w;
+
+	if(first != ALL_USED) {
+		w = start;
+	} else {
+		w = find_free_word(map,start+1,map->nwords);
+		if(w == -1) w = find_free_word(map,0,start+1);
+		if(w == -1) return -1;
+		first = map->words[w];
+	}
+
+	int bit = w*WORD_BITS + __builtin_ctzll(~first);
+	map->words[w] |= (uint64_t)1 << (bit%WORD_BITS);
+	map->used++;
+	map->scanned = (bit >= map->hint) ? bit-map->hint+1 : map->nbits-map->hint+bit+1;
+	map->hint = (bit+1 < map->nbits) ? bit+1 : 0;
+
+	return bit;
+}
+
+// marks every block used in other as used in map too
+void bitmap_merge( struct bitmap *map, const struct bitmap *other )
+{
+	int w;
+	for(w = 0; w < map->nwords && w < other->nwords; w++){
+		map->words[w] |= other->words[w];
+	}
+	bitmap_recount(map);
+}
+
+// first free bit at or after from, or -1
+static int next_free( const struct bitmap *map, int from )
+{
+	if(from >= map->nbits) return -1;
+
+	int w = from / WORD_BITS;
+	uint64_t free_bits = ~map->words[w] & ~(((uint64_t)1 << (from%WORD_BITS)) - 1);
+	if(!free_bits) {
+		w = find_free_word(map,w+1,map->nwords);
+		if(w == -1) return -1;
+		free_bits = ~map->words[w];
+	}
+
+	int bit = w*WORD_BITS + __builtin_ctzll(free_bits);
+	return (bit < map->nbits) ? bit : -1;
+}
+
+// length of the run of free bits starting at from, stopping at limit
+static int free_run( const struct bitmap *map, int from, int limit )
+{
+	int bit = from;
+
+	while(bit < from+limit && bit < map->nbits){
+		uint64_t used = map->words[bit/WORD_BITS] >> (bit%WORD_BITS);
+		int avail = WORD_BITS - bit%WORD_BITS;
+		if(used) {
+			int gap = __builtin_ctzll(used);
+			if(gap < avail) {
+				bit += gap;
+				break;
+			}
+		}
+		bit += avail;
+	}
+
+	if(bit > map->nbits) bit = map->nbits;
+	return (bit-from < limit) ? bit-from : limit;
+}
+
+// Claims a run of contiguous free bits: the first run of at least want
+// bits found from the hint onwards, or failing that the longest run on
+// the whole map. Returns the first bit and sets *got to the run length,
+// or returns -1 if nothing is free. The reserved bits are never counted
+// in, so the run may come out shorter than one that is free.
+int bitmap_alloc_run( struct bitmap *map, int want, int *got )
+{
+	int best = -1, bestlen = 0;
+	int pos = map->hint;
+	int wrapped = 0;
+
+	*got = 0;
+	map->scanned = 0;
+	if(want > map->nbits-map->used-map->reserved) want = map->nbits-map->used-map->reserved;
+	if(want <= 0) return -1;
+
+	while(1) {
+		int start = next_free(map,pos);
+		if(start == -1 || (wrapped && start >= map->hint)) {
+			int end = wrapped ? map->hint : map->nbits;
+			if(end > pos) map->scanned += end-pos;
+			if(wrapped || map->hint == 0) break;
+			wrapped = 1;
+			pos = 0;
+			continue;
+		}
+
+		int len = free_run(map,start,want);
+		map->scanned += start-pos + len;
+		if(len > bestlen) {
+			best = start;
+			bestlen = len;
+			if(len >= want) break;
+		}
+		pos = start+len;
+	}
+
+	if(best == -1) return -1;
+
+	int i;
+	for(i = best; i < best+bestlen; i++){
+		map->words[i/WORD_BITS] |= (uint64_t)1 << (i%WORD_BITS);
+	}
+	map->used += bestlen;
+	map->hint = (best+bestlen < map->nbits) ? best+bestlen : 0;
+	*got = bestlen;
+
+	return best;
+}
+
+void bitmap_clear_range( struct bitmap *map, int first, int count )
+{
+	int i;
+	for(i = first; i < first+count; i++){
+		bitmap_clear(map,i);
+	}
+}
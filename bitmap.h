@@ -0,0 +1,32 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+
+// Packed free-block map, one bit per block, 1 if used 0 if free.
+
+struct bitmap {
+	uint64_t *words;
+	int nbits;
+	int nwords;
+	int hint;       // next-fit cursor, where the next search starts
+	int scanned;    // bits the last bitmap_alloc or bitmap_alloc_run went past
+	int used;       // bits set, see bitmap_recount
+	int reserved;   // free bits bitmap_alloc and bitmap_alloc_run leave alone
+};
+
+int  bitmap_init( struct bitmap *map, int nbits );
+void bitmap_free( struct bitmap *map );
+
+void bitmap_set( struct bitmap *map, int bit );
+void bitmap_clear( struct bitmap *map, int bit );
+int  bitmap_test( const struct bitmap *map, int bit );
+int  bitmap_count( const struct bitmap *map );
+void bitmap_recount( struct bitmap *map );
+
+int  bitmap_alloc( struct bitmap *map );
+int  bitmap_alloc_run( struct bitmap *map, int want, int *got );
+void bitmap_clear_range( struct bitmap *map, int first, int count );
+void bitmap_merge( struct bitmap *map, const struct bitmap *other );
+
+#endif
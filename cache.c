@@ -0,0 +1,727 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "disk.h"
+
+// Write-back LRU buffer cache that sits between fs.c and disk.c.
+// Entries are kept on a doubly linked list ordered from most recently
+// used (head) to least recently used (tail), and found through a chained
+// hash table keyed by block number. Dirty blocks only reach the disk when
+// they are evicted or when cache_flush() is called.
+//
+// Every function may be called from several threads at once. One mutex
+// covers the table, the LRU list and the counters, and is never held
+// across a disk transfer. An entry being filled from the disk, or written
+// back before it is reused, is marked busy and anyone who looks it up
+// waits on idle until it is done; one being written back by cache_flush
+// goes out from a copy, so it stays usable but is pinned where it is
+// until the write has landed. Uncached runs move straight between the
+// disk and the caller's buffers, which relies on the filesystem never
+// having two threads transfer the same block at the same time, as its
+// per-inode locks already guarantee.
+
+struct cache_entry {
+	int blocknum;   // -1 if the entry holds nothing
+	int dirty;
+	int busy;       // moving to or from the disk, hands off until it's done
+	int pinned;     // being written back from a copy, mustn't be evicted or dropped
+	int hnext;      // next entry in the same hash chain
+	int prev;       // LRU list, towards the head
+	int next;       // LRU list, towards the tail
+	char *data;
+};
+
+// one cache, sitting in front of one disk
+struct cache {
+	disk_t *disk;
+	struct cache_entry *entries;
+	char *blockdata;
+	int *buckets;
+	int nentries;   // 0 for a pass-through cache
+	int nbuckets;
+	int lru_head;
+	int lru_tail;
+
+	int nhits;
+	int nmisses;
+	int nwritebacks;
+	int nprefetched;
+
+	pthread_mutex_t lock;
+	pthread_cond_t idle;         // an entry stopped being busy or pinned
+	pthread_mutex_t flush_lock;  // one cache_flush at a time
+};
+
+// the cache behind the cache_* calls that don't take one
+static cache_t *default_cache = 0;
+
+cache_t *cache_open( disk_t *d, int n )
+{
+	int i;
+	cache_t *c = calloc(1,sizeof(cache_t));
+	if(!c) return 0;
+
+	c->disk = d;
+	c->lru_head = -1;
+	c->lru_tail = -1;
+	pthread_mutex_init(&c->lock,0);
+	pthread_cond_init(&c->idle,0);
+	pthread_mutex_init(&c->flush_lock,0);
+
+	if(n <= 0) { // a zero sized cache passes everything straight to disk
+		return c;
+	}
+
+	c->nentries = n;
+	c->nbuckets = 1;
+	while(c->nbuckets < n*2) c->nbuckets *= 2;
+
+	c->entries = malloc(sizeof(struct cache_entry)*n);
+	c->blockdata = malloc((size_t)n*DISK_BLOCK_SIZE);
+	c->buckets = malloc(sizeof(int)*c->nbuckets);
+	if(!c->entries || !c->blockdata || !c->buckets) {
+		free(c->entries);
+		free(c->blockdata);
+		free(c->buckets);
+		pthread_mutex_destroy(&c->lock);
+		pthread_cond_destroy(&c->idle);
+		pthread_mutex_destroy(&c->flush_lock);
+		free(c);
+		return 0;
+	}
+
+	for(i = 0; i < c->nbuckets; i++){
+		c->buckets[i] = -1;
+	}
+
+	// every entry starts out free and chained onto the LRU list
+	for(i = 0; i < n; i++){
+		c->entries[i].blocknum = -1;
+		c->entries[i].dirty = 0;
+		c->entries[i].busy = 0;
+		c->entries[i].pinned = 0;
+		c->entries[i].hnext = -1;
+		c->entries[i].data = c->blockdata + (size_t)i*DISK_BLOCK_SIZE;
+		c->entries[i].prev = i-1;
+		c->entries[i].next = (i+1 < n) ? i+1 : -1;
+	}
+	c->lru_head = 0;
+	c->lru_tail = n-1;
+
+	return c;
+}
+
+disk_t *cache_disk( cache_t *c )
+{
+	return c->disk;
+}
+
+void cache_stats_r( cache_t *c, struct cache_stats *s )
+{
+	pthread_mutex_lock(&c->lock);
+	s->hits = c->nhits;
+	s->misses = c->nmisses;
+	s->writebacks = c->nwritebacks;
+	s->prefetched = c->nprefetched;
+	pthread_mutex_unlock(&c->lock);
+}
+
+void cache_stats_reset_r( cache_t *c )
+{
+	pthread_mutex_lock(&c->lock);
+	c->nhits = 0;
+	c->nmisses = 0;
+	c->nwritebacks = 0;
+	c->nprefetched = 0;
+	pthread_mutex_unlock(&c->lock);
+}
+
+static int hash( cache_t *c, int blocknum )
+{
+	return blocknum & (c->nbuckets-1);
+}
+
+static int lookup( cache_t *c, int blocknum )
+{
+	int e;
+	for(e = c->buckets[hash(c,blocknum)]; e != -1; e = c->entries[e].hnext){
+		if(c->entries[e].blocknum == blocknum) return e;
+	}
+	return -1;
+}
+
+// lookup, but waits out a transfer into or out of the entry first
+static int lookup_idle( cache_t *c, int blocknum )
+{
+	int e;
+	while((e = lookup(c,blocknum)) != -1 && c->entries[e].busy){
+		pthread_cond_wait(&c->idle,&c->lock);
+	}
+	return e;
+}
+
+// lets the others at an entry again
+static void release( cache_t *c, int e )
+{
+	c->entries[e].busy = 0;
+	pthread_cond_broadcast(&c->idle);
+}
+
+static void hash_remove( cache_t *c, int e )
+{
+	int *p = &c->buckets[hash(c,c->entries[e].blocknum)];
+	while(*p != e) p = &c->entries[*p].hnext;
+	*p = c->entries[e].hnext;
+	c->entries[e].hnext = -1;
+}
+
+static void hash_insert( cache_t *c, int e )
+{
+	int h = hash(c,c->entries[e].blocknum);
+	c->entries[e].hnext = c->buckets[h];
+	c->buckets[h] = e;
+}
+
+// moves an entry to the most recently used end of the list
+static void touch( cache_t *c, int e )
+{
+	struct cache_entry *entries = c->entries;
+
+	if(e == c->lru_head) return;
+
+	entries[entries[e].prev].next = entries[e].next;
+	if(e == c->lru_tail) {
+		c->lru_tail = entries[e].prev;
+	} else {
+		entries[entries[e].next].prev = entries[e].prev;
+	}
+
+	entries[e].prev = -1;
+	entries[e].next = c->lru_head;
+	entries[c->lru_head].prev = e;
+	c->lru_head = e;
+}
+
+// Takes over the least recently used entry nobody is using for a new
+// block and hands it back busy, for the caller to fill and release. If
+// the entry held a dirty block that is written back first, with the lock
+// dropped. Returns -1 if blocknum turned up in the cache meanwhile, or if
+// every entry is in use and wait isn't set.
+static int evict( cache_t *c, int blocknum, int wait )
+{
+	struct cache_entry *entries = c->entries;
+	int e;
+
+	while(1) {
+		if(lookup(c,blocknum) != -1) return -1;
+
+		e = c->lru_tail;
+		while(e != -1 && (entries[e].busy || entries[e].pinned)) e = entries[e].prev;
+		if(e == -1) {
+			if(!wait) return -1;
+			pthread_cond_wait(&c->idle,&c->lock);
+			continue;
+		}
+		if(!entries[e].dirty) break;
+
+		entries[e].busy = 1;
+		pthread_mutex_unlock(&c->lock);
+		disk_write_r(c->disk,entries[e].blocknum,entries[e].data);
+		pthread_mutex_lock(&c->lock);
+		entries[e].dirty = 0;
+		c->nwritebacks++;
+		release(c,e);
+	}
+
+	if(entries[e].blocknum != -1) hash_remove(c,e);
+	entries[e].blocknum = blocknum;
+	entries[e].dirty = 0;
+	entries[e].busy = 1;
+	hash_insert(c,e);
+	touch(c,e);
+
+	return e;
+}
+
+void cache_read_r( cache_t *c, int blocknum, char *data )
+{
+	disk_trace_r(c->disk,DISK_TRACE_CACHE_READ,blocknum,1);
+	disk_trace_cached(1);
+	if(c->nentries == 0) {
+		disk_read_r(c->disk,blocknum,data);
+		disk_trace_cached(0);
+		return;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	int e;
+	while((e = lookup_idle(c,blocknum)) == -1 && (e = evict(c,blocknum,1)) == -1);
+	if(c->entries[e].busy) {
+		// a fresh entry of our own, filled with the lock dropped
+		c->nmisses++;
+		pthread_mutex_unlock(&c->lock);
+		disk_read_r(c->disk,blocknum,c->entries[e].data);
+		pthread_mutex_lock(&c->lock);
+		release(c,e);
+	} else {
+		c->nhits++;
+		touch(c,e);
+	}
+
+	memcpy(data,c->entries[e].data,DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&c->lock);
+	disk_trace_cached(0);
+}
+
+void cache_write_r( cache_t *c, int blocknum, const char *data )
+{
+	disk_trace_r(c->disk,DISK_TRACE_CACHE_WRITE,blocknum,1);
+	disk_trace_cached(1);
+	if(c->nentries == 0) {
+		disk_write_r(c->disk,blocknum,data);
+		disk_trace_cached(0);
+		return;
+	}
+
+	// a whole block is being replaced, so a miss never has to read it first
+	pthread_mutex_lock(&c->lock);
+	int e;
+	while((e = lookup_idle(c,blocknum)) == -1 && (e = evict(c,blocknum,1)) == -1);
+	if(c->entries[e].busy) {
+		c->nmisses++;
+	} else {
+		c->nhits++;
+		touch(c,e);
+	}
+
+	memcpy(c->entries[e].data,data,DISK_BLOCK_SIZE);
+	c->entries[e].dirty = 1;
+	if(c->entries[e].busy) release(c,e);
+	pthread_mutex_unlock(&c->lock);
+	disk_trace_cached(0);
+}
+
+// Range reads and writes serve whatever is already cached from the cache
+// and move every run of uncached blocks straight between the caller's
+// buffers and the disk in one vectored call. Bulk file data therefore
+// doesn't push metadata out of the cache, and a block is always either
+// current in the cache or current on disk.
+
+void cache_read_range_r( cache_t *c, int blocknum, int count, char **data )
+{
+	int i = 0;
+
+	disk_trace_r(c->disk,DISK_TRACE_CACHE_READ_RANGE,blocknum,count);
+	disk_trace_cached(1);
+	pthread_mutex_lock(&c->lock);
+	while(i < count){
+		int e = (c->nentries > 0) ? lookup_idle(c,blocknum+i) : -1;
+		if(e != -1) {
+			c->nhits++;
+			touch(c,e);
+			memcpy(data[i],c->entries[e].data,DISK_BLOCK_SIZE);
+			i++;
+			continue;
+		}
+
+		int run = 1;
+		while(i+run < count && (c->nentries == 0 || lookup(c,blocknum+i+run) == -1)) run++;
+		if(c->nentries > 0) c->nmisses += run;
+
+		pthread_mutex_unlock(&c->lock);
+		disk_read_range_r(c->disk,blocknum+i,run,data+i);
+		pthread_mutex_lock(&c->lock);
+		i += run;
+	}
+	pthread_mutex_unlock(&c->lock);
+	disk_trace_cached(0);
+}
+
+void cache_write_range_r( cache_t *c, int blocknum, int count, const char **data )
+{
+	int i = 0;
+
+	disk_trace_r(c->disk,DISK_TRACE_CACHE_WRITE_RANGE,blocknum,count);
+	disk_trace_cached(1);
+	pthread_mutex_lock(&c->lock);
+	while(i < count){
+		int e = (c->nentries > 0) ? lookup_idle(c,blocknum+i) : -1;
+		if(e != -1) {
+			c->nhits++;
+			touch(c,e);
+			memcpy(c->entries[e].data,data[i],DISK_BLOCK_SIZE);
+			c->entries[e].dirty = 1;
+			i++;
+			continue;
+		}
+
+		int run = 1;
+		while(i+run < count && (c->nentries == 0 || lookup(c,blocknum+i+run) == -1)) run++;
+		if(c->nentries > 0) c->nmisses += run;
+
+		pthread_mutex_unlock(&c->lock);
+		disk_write_range_r(c->disk,blocknum+i,run,data+i);
+		pthread_mutex_lock(&c->lock);
+		i += run;
+	}
+	pthread_mutex_unlock(&c->lock);
+	disk_trace_cached(0);
+}
+
+// Reads several runs at once. Cached blocks are copied out as usual, and
+// every uncached stretch becomes one asynchronous disk request, so the
+// whole batch is in flight on the device together instead of one run
+// after another.
+void cache_read_batch_r( cache_t *c, struct disk_request *reqs, int n )
+{
+	int i, j, total = 0, nasync = 0;
+
+	for(i = 0; i < n; i++){
+		total += reqs[i].count;
+		disk_trace_r(c->disk,DISK_TRACE_CACHE_READ_RANGE,reqs[i].blocknum,reqs[i].count);
+	}
+
+	struct disk_request *async = malloc(sizeof(struct disk_request)*(total > 0 ? total : 1));
+	if(!async) {
+		printf("ERROR: couldn't allocate memory for a batched read\n");
+		abort();
+	}
+
+	pthread_mutex_lock(&c->lock);
+	for(i = 0; i < n; i++){
+		j = 0;
+		while(j < reqs[i].count){
+			int blocknum = reqs[i].blocknum+j;
+			int e = (c->nentries > 0) ? lookup_idle(c,blocknum) : -1;
+			if(e != -1) {
+				c->nhits++;
+				touch(c,e);
+				memcpy(reqs[i].data[j],c->entries[e].data,DISK_BLOCK_SIZE);
+				j++;
+				continue;
+			}
+
+			int run = 1;
+			while(j+run < reqs[i].count && (c->nentries == 0 || lookup(c,blocknum+run) == -1)) run++;
+			if(c->nentries > 0) c->nmisses += run;
+
+			async[nasync].op = DISK_OP_READ;
+			async[nasync].blocknum = blocknum;
+			async[nasync].count = run;
+			async[nasync].data = reqs[i].data+j;
+			nasync++;
+			j += run;
+		}
+		reqs[i].result = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if(nasync > 0) {
+		disk_trace_cached(1);
+		disk_submit_r(c->disk,async,nasync);
+		disk_trace_cached(0);
+		if(disk_reap_r(c->disk,async,nasync) != nasync) {
+			printf("ERROR: couldn't read from simulated disk\n");
+			abort();
+		}
+	}
+
+	free(async);
+}
+
+// Pulls blocks into the cache ahead of need. Blocks that are already cached
+// are left alone, the rest get fresh entries and are read straight into
+// them as one asynchronous batch, one request per contiguous run.
+void cache_prefetch_r( cache_t *c, const int *blocknums, int n )
+{
+	int i, nruns = 0, nfetch = 0;
+
+	// traced as asked for, one record per run of neighbouring blocks
+	for(i = 0; i < n; i += nruns) {
+		nruns = 1;
+		while(i+nruns < n && blocknums[i+nruns] == blocknums[i]+nruns) nruns++;
+		if(blocknums[i] > 0) disk_trace_r(c->disk,DISK_TRACE_CACHE_PREFETCH,blocknums[i],nruns);
+	}
+	nruns = 0;
+
+	if(c->nentries == 0 || n <= 0) return;
+	if(n > c->nentries/2) n = c->nentries/2; // never push out what is being fetched
+
+	char **bufs = malloc(sizeof(char *)*(n > 0 ? n : 1));
+	struct disk_request *runs = malloc(sizeof(struct disk_request)*(n > 0 ? n : 1));
+	int *fetched = malloc(sizeof(int)*(n > 0 ? n : 1));
+	if(!bufs || !runs || !fetched) {
+		free(bufs);
+		free(runs);
+		free(fetched);
+		return; // readahead is only a hint
+	}
+
+	// the new entries hold nothing until the reads land, so they stay busy
+	// until then, and readahead never waits for an entry to come free
+	pthread_mutex_lock(&c->lock);
+	for(i = 0; i < n; i++){
+		if(blocknums[i] <= 0 || lookup(c,blocknums[i]) != -1) continue;
+
+		int e = evict(c,blocknums[i],0);
+		if(e == -1) continue;
+		fetched[nfetch] = e;
+		bufs[nfetch] = c->entries[e].data;
+		if(nruns > 0 && runs[nruns-1].blocknum+runs[nruns-1].count == blocknums[i]
+		   && runs[nruns-1].data+runs[nruns-1].count == bufs+nfetch) {
+			runs[nruns-1].count++;
+		} else {
+			runs[nruns].op = DISK_OP_READ;
+			runs[nruns].blocknum = blocknums[i];
+			runs[nruns].count = 1;
+			runs[nruns].data = bufs+nfetch;
+			nruns++;
+		}
+		nfetch++;
+		c->nprefetched++;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+
+	if(nruns > 0) {
+		disk_trace_cached(1);
+		disk_submit_r(c->disk,runs,nruns);
+		if(disk_reap_r(c->disk,runs,nruns) != nruns) {
+			printf("ERROR: couldn't read from simulated disk\n");
+			abort();
+		}
+		disk_trace_cached(0);
+	}
+
+	pthread_mutex_lock(&c->lock);
+	for(i = 0; i < nfetch; i++){
+		release(c,fetched[i]);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	free(bufs);
+	free(runs);
+	free(fetched);
+}
+
+static int compare_entries( const void *a, const void *b )
+{
+	int x = (*(struct cache_entry *const *)a)->blocknum;
+	int y = (*(struct cache_entry *const *)b)->blocknum;
+	return (x > y) - (x < y);
+}
+
+// Forgets count blocks from blocknum, dirty or not, and discards them on
+// the disk. For blocks the filesystem has freed: nothing in them is ever
+// read again, so nothing needs writing back. Returns what disk_discard did.
+int cache_discard_r( cache_t *c, int blocknum, int count )
+{
+	int i;
+
+	// whatever is on its way to or from the disk has to get there first
+	pthread_mutex_lock(&c->lock);
+	if(count > c->nentries) {
+		for(i = 0; i < c->nentries; i++){
+			int b = c->entries[i].blocknum;
+			if(b != -1 && b >= blocknum && b < blocknum+count) {
+				if(c->entries[i].busy || c->entries[i].pinned) {
+					pthread_cond_wait(&c->idle,&c->lock);
+					i--;
+					continue;
+				}
+				hash_remove(c,i);
+				c->entries[i].blocknum = -1;
+				c->entries[i].dirty = 0;
+			}
+		}
+	} else {
+		for(i = 0; i < count; i++){
+			int e;
+			while((e = lookup(c,blocknum+i)) != -1 && (c->entries[e].busy || c->entries[e].pinned)) {
+				pthread_cond_wait(&c->idle,&c->lock);
+			}
+			if(e != -1) {
+				hash_remove(c,e);
+				c->entries[e].blocknum = -1;
+				c->entries[e].dirty = 0;
+			}
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	disk_trace_cached(1);
+	int result = disk_discard_r(c->disk,blocknum,count);
+	disk_trace_cached(0);
+	return result;
+}
+
+// Writes every dirty block back. The blocks are copied out under the lock
+// and written from the copies without it, pinned until they have landed so
+// that nothing reads an older version from the disk meanwhile. Flushes
+// take turns, so when one returns everything dirty before it is written.
+void cache_flush_r( cache_t *c )
+{
+	int i, ndirty = 0;
+	struct cache_entry **dirty;
+	const char **run;
+	char *copies;
+	int *blocknums;
+
+	disk_trace_r(c->disk,DISK_TRACE_CACHE_FLUSH,0,0);
+	if(c->nentries == 0) return;
+
+	dirty = malloc(sizeof(struct cache_entry *)*c->nentries);
+	run = malloc(sizeof(char *)*c->nentries);
+	blocknums = malloc(sizeof(int)*c->nentries);
+	if(!dirty || !run || !blocknums) {
+		printf("ERROR: couldn't allocate memory to flush the cache\n");
+		abort();
+	}
+
+	pthread_mutex_lock(&c->flush_lock);
+	pthread_mutex_lock(&c->lock);
+	for(i = 0; i < c->nentries; i++){
+		if(c->entries[i].blocknum != -1 && c->entries[i].dirty) {
+			if(c->entries[i].busy) {
+				// on its way out through evict, which has to finish first
+				pthread_cond_wait(&c->idle,&c->lock);
+				ndirty = 0;
+				i = -1;
+				continue;
+			}
+			dirty[ndirty++] = &c->entries[i];
+		}
+	}
+
+	// write back in block order so the disk sees one sequential sweep
+	qsort(dirty,ndirty,sizeof(struct cache_entry *),compare_entries);
+
+	copies = malloc((size_t)(ndirty > 0 ? ndirty : 1)*DISK_BLOCK_SIZE);
+	if(!copies) {
+		printf("ERROR: couldn't allocate memory to flush the cache\n");
+		abort();
+	}
+	for(i = 0; i < ndirty; i++){
+		memcpy(copies + (size_t)i*DISK_BLOCK_SIZE,dirty[i]->data,DISK_BLOCK_SIZE);
+		blocknums[i] = dirty[i]->blocknum;
+		dirty[i]->dirty = 0;
+		dirty[i]->pinned = 1;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	// and hand every run of neighbouring blocks to the disk as a single write
+	i = 0;
+	while(i < ndirty){
+		int first = blocknums[i];
+		int n = 0;
+		while(i+n < ndirty && blocknums[i+n] == first+n){
+			run[n] = copies + (size_t)(i+n)*DISK_BLOCK_SIZE;
+			n++;
+		}
+		disk_trace_cached(1);
+		disk_write_range_r(c->disk,first,n,run);
+		disk_trace_cached(0);
+		i += n;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	for(i = 0; i < ndirty; i++){
+		dirty[i]->pinned = 0;
+	}
+	c->nwritebacks += ndirty;
+	pthread_cond_broadcast(&c->idle);
+	pthread_mutex_unlock(&c->lock);
+	pthread_mutex_unlock(&c->flush_lock);
+
+	free(copies);
+	free(dirty);
+	free(run);
+	free(blocknums);
+}
+
+void cache_close_r( cache_t *c )
+{
+	if(c->nentries > 0) {
+		cache_flush_r(c);
+		printf("%d cache hits\n",c->nhits);
+		printf("%d cache misses\n",c->nmisses);
+		printf("%d cache write-backs\n",c->nwritebacks);
+		printf("%d blocks read ahead\n",c->nprefetched);
+	}
+
+	free(c->entries);
+	free(c->blockdata);
+	free(c->buckets);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->idle);
+	pthread_mutex_destroy(&c->flush_lock);
+	free(c);
+}
+
+// The original single-cache interface, working on a cache in front of the
+// default disk.
+
+int cache_init( int n )
+{
+	if(default_cache) cache_close();
+
+	default_cache = cache_open(disk_default(),n);
+	return default_cache != 0;
+}
+
+cache_t *cache_default()
+{
+	return default_cache;
+}
+
+void cache_read( int blocknum, char *data )
+{
+	cache_read_r(default_cache,blocknum,data);
+}
+
+void cache_write( int blocknum, const char *data )
+{
+	cache_write_r(default_cache,blocknum,data);
+}
+
+void cache_read_range( int blocknum, int count, char **data )
+{
+	cache_read_range_r(default_cache,blocknum,count,data);
+}
+
+void cache_write_range( int blocknum, int count, const char **data )
+{
+	cache_write_range_r(default_cache,blocknum,count,data);
+}
+
+void cache_read_batch( struct disk_request *reqs, int n )
+{
+	cache_read_batch_r(default_cache,reqs,n);
+}
+
+void cache_prefetch( const int *blocknums, int n )
+{
+	cache_prefetch_r(default_cache,blocknums,n);
+}
+
+int cache_discard( int blocknum, int count )
+{
+	return default_cache ? cache_discard_r(default_cache,blocknum,count) : 0;
+}
+
+void cache_flush()
+{
+	if(default_cache) cache_flush_r(default_cache);
+}
+
+void cache_close()
+{
+	if(default_cache) {
+		cache_close_r(default_cache);
+		default_cache = 0;
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#define CACHE_DEFAULT_BLOCKS 256
+
+struct disk_request;
+struct disk;
+
+// per-cache counters, as printed by cache_close
+struct cache_stats {
+	int hits;
+	int misses;
+	int writebacks;
+	int prefetched; // blocks read ahead
+};
+
+typedef struct cache cache_t;
+
+// A cache opened with cache_open sits in front of one disk and has its
+// own blocks, lock and counters. The *_r calls are the same as the ones
+// below without the suffix.
+cache_t *cache_open( struct disk *d, int nblocks );
+struct disk *cache_disk( cache_t *c );
+void cache_stats_r( cache_t *c, struct cache_stats *s );
+void cache_stats_reset_r( cache_t *c );
+void cache_read_r( cache_t *c, int blocknum, char *data );
+void cache_write_r( cache_t *c, int blocknum, const char *data );
+void cache_read_range_r( cache_t *c, int blocknum, int count, char **data );
+void cache_write_range_r( cache_t *c, int blocknum, int count, const char **data );
+void cache_read_batch_r( cache_t *c, struct disk_request *reqs, int n );
+void cache_prefetch_r( cache_t *c, const int *blocknums, int n );
+int  cache_discard_r( cache_t *c, int blocknum, int count );
+void cache_flush_r( cache_t *c );
+void cache_close_r( cache_t *c );
+
+// The default cache, set up by cache_init in front of the default disk.
+cache_t *cache_default();
+
+int  cache_init( int nblocks );
+void cache_read( int blocknum, char *data );
+void cache_write( int blocknum, const char *data );
+void cache_read_range( int blocknum, int count, char **data );
+void cache_write_range( int blocknum, int count, const char **data );
+void cache_read_batch( struct disk_request *reqs, int n );
+void cache_prefetch( const int *blocknums, int n );
+int  cache_discard( int blocknum, int count );
+void cache_flush();
+void cache_close();
+
+#endif
@@ -1,47 +1,308 @@
 
+#define _GNU_SOURCE // fallocate
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
 
 #include "disk.h"
+#include "stats.h"
 
 #define DISK_MAGIC 0xdeadbeef
+#define DISK_MAX_IOV 1024 // most iovecs the kernel takes in one call
+#define TRACE_BUFFER 4096 // trace records held before they are written out
 
-static FILE *diskfile;
-static int nblocks=0;
-static int nreads=0;
-static int nwrites=0;
+// Two backends are available. The default sends everything through
+// positional reads and writes on a raw file descriptor, so there is no
+// stdio buffer to copy through, no seek per block, and several threads can
+// use the disk at once. The mmap backend maps the whole image and turns
+// every block transfer into a memcpy with no system call at all; it is
+// meant for images that fit in memory and is synced back at disk_close.
+
+#define ASYNC_THREADS 8 // workers in the fallback pool
+
+// one latency histogram per kind of call
+enum {
+	DISK_STAT_READ,
+	DISK_STAT_WRITE,
+	DISK_STAT_READ_RANGE,
+	DISK_STAT_WRITE_RANGE,
+	DISK_STAT_DISCARD,
+	DISK_STAT_SYNC,
+	DISK_STAT_SUBMIT,
+	DISK_STAT_REAP,
+	DISK_STAT_ASYNC,
+	DISK_STATS
+};
+
+static const char *stat_names[DISK_STATS] = {
+	"disk.read", "disk.write", "disk.read_range", "disk.write_range",
+	"disk.discard", "disk.sync", "disk.submit", "disk.reap", "disk.async",
+};
+
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	int inflight;
+	int reaping; // someone is waiting in the kernel, see uring_wait
+};
+
+// Everything belonging to one open image. Nothing is shared between two
+// of them, so any number can be open in one process at once.
+struct disk {
+	int fd;
+	int backend;
+	char *map;
+	int nblocks;
+	int nreads;     // blocks read
+	int nwrites;    // blocks written
+	int nreadcalls; // read system calls issued
+	int nwritecalls;
+	int ndiscards;  // blocks discarded
+	int nodiscard;  // set once the image turns out not to support it
+	struct histogram stats[DISK_STATS];
+
+	// block trace, see disk_trace_start_r; trace is only set while one is
+	// open and everything else is covered by trace_lock
+	struct disk_trace_record *trace;
+	int tracefd;
+	int tracelen;
+	uint64_t tracestart;
+	pthread_mutex_t trace_lock;
+
+	int async_mode;
+	int queuedepth;
+	pthread_mutex_t async_lock;
+	pthread_cond_t async_done;
+	struct uring ring;
+
+	// fallback pool, pending requests wait on a singly linked queue
+	pthread_t pool[ASYNC_THREADS];
+	pthread_cond_t pool_work;
+	struct disk_request *pool_head;
+	struct disk_request *pool_tail;
+	int pool_stop;
+};
+
+// the disk behind the disk_* calls that don't take one
+static disk_t *default_disk = 0;
+
+// what this thread is doing, for trace records
+static __thread int trace_tag = 0;
+static __thread int trace_cached = 0;
+
+disk_t *disk_open( const char *filename, int n, int which )
+{
+	disk_t *d = calloc(1,sizeof(disk_t));
+	if(!d) return 0;
+
+	d->fd = open(filename,O_RDWR|O_CREAT,0666);
+	if(d->fd<0) {
+		free(d);
+		return 0;
+	}
+
+	ftruncate(d->fd,(off_t)n*DISK_BLOCK_SIZE);
+
+	d->backend = DISK_BACKEND_PREAD;
+	if(which==DISK_BACKEND_MMAP && n>0) {
+		void *map = mmap(0,(size_t)n*DISK_BLOCK_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,d->fd,0);
+		if(map==MAP_FAILED) {
+			printf("couldn't map disk image (%s), using pread/pwrite instead\n",strerror(errno));
+		} else {
+			d->map = map;
+			d->backend = DISK_BACKEND_MMAP;
+		}
+	}
+
+	d->nblocks = n;
+	d->async_mode = DISK_ASYNC_OFF;
+	d->ring.fd = -1;
+	d->tracefd = -1;
+	pthread_mutex_init(&d->trace_lock,0);
+	pthread_mutex_init(&d->async_lock,0);
+	pthread_cond_init(&d->async_done,0);
+	pthread_cond_init(&d->pool_work,0);
+
+	return d;
+}
+
+disk_t *disk_default()
+{
+	return default_disk;
+}
 
 int disk_init( const char *filename, int n )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	return disk_init_backend(filename,n,DISK_BACKEND_PREAD);
+}
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+int disk_init_backend( const char *filename, int n, int which )
+{
+	disk_t *d = disk_open(filename,n,which);
+	if(!d) return 0;
 
-	nblocks = n;
-	nreads = 0;
-	nwrites = 0;
+	if(default_disk) disk_close_r(default_disk);
+	default_disk = d;
 
 	return 1;
 }
 
-int disk_size()
+int disk_size_r( disk_t *d )
+{
+	return d->nblocks;
+}
+
+int disk_backend_r( disk_t *d )
 {
-	return nblocks;
+	return d->backend;
+}
+
+void disk_stats_r( disk_t *d, struct disk_stats *s )
+{
+	s->reads = __atomic_load_n(&d->nreads,__ATOMIC_RELAXED);
+	s->writes = __atomic_load_n(&d->nwrites,__ATOMIC_RELAXED);
+	s->readcalls = __atomic_load_n(&d->nreadcalls,__ATOMIC_RELAXED);
+	s->writecalls = __atomic_load_n(&d->nwritecalls,__ATOMIC_RELAXED);
+	s->discards = __atomic_load_n(&d->ndiscards,__ATOMIC_RELAXED);
+}
+
+int disk_histograms_r( disk_t *d, struct stats_entry *entries, int max )
+{
+	int i;
+	for(i = 0; i < DISK_STATS && i < max; i++) {
+		entries[i].name = stat_names[i];
+		entries[i].unit = "ns";
+		entries[i].h = &d->stats[i];
+	}
+	return i;
+}
+
+void disk_stats_reset_r( disk_t *d )
+{
+	int i;
+
+	__atomic_store_n(&d->nreads,0,__ATOMIC_RELAXED);
+	__atomic_store_n(&d->nwrites,0,__ATOMIC_RELAXED);
+	__atomic_store_n(&d->nreadcalls,0,__ATOMIC_RELAXED);
+	__atomic_store_n(&d->nwritecalls,0,__ATOMIC_RELAXED);
+	__atomic_store_n(&d->ndiscards,0,__ATOMIC_RELAXED);
+	for(i = 0; i < DISK_STATS; i++) {
+		histogram_reset(&d->stats[i]);
+	}
+}
+
+// writes out the records held so far, d->trace_lock held
+static void trace_drain( disk_t *d )
+{
+	size_t length = (size_t)d->tracelen*sizeof(struct disk_trace_record);
+	if(length>0 && write(d->tracefd,d->trace,length)!=(ssize_t)length) {
+		printf("ERROR: couldn't write the disk trace: %s\n",strerror(errno));
+	}
+	d->tracelen = 0;
+}
+
+int disk_trace_start_r( disk_t *d, const char *filename )
+{
+	struct disk_trace_header header;
+
+	disk_trace_stop_r(d);
+
+	int fd = open(filename,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	if(fd<0) return 0;
+
+	header.magic = DISK_TRACE_MAGIC;
+	header.version = DISK_TRACE_VERSION;
+	header.nblocks = d->nblocks;
+	header.blocksize = DISK_BLOCK_SIZE;
+	struct disk_trace_record *buffer = malloc(sizeof(struct disk_trace_record)*TRACE_BUFFER);
+	if(!buffer || write(fd,&header,sizeof(header))!=sizeof(header)) {
+		free(buffer);
+		close(fd);
+		return 0;
+	}
+
+	pthread_mutex_lock(&d->trace_lock);
+	d->tracefd = fd;
+	d->tracelen = 0;
+	d->tracestart = stats_clock();
+	__atomic_store_n(&d->trace,buffer,__ATOMIC_RELEASE);
+	pthread_mutex_unlock(&d->trace_lock);
+
+	return 1;
+}
+
+void disk_trace_stop_r( disk_t *d )
+{
+	pthread_mutex_lock(&d->trace_lock);
+	if(d->trace) {
+		trace_drain(d);
+		close(d->tracefd);
+		free(d->trace);
+		d->tracefd = -1;
+		__atomic_store_n(&d->trace,0,__ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&d->trace_lock);
+}
+
+void disk_trace_r( disk_t *d, int op, int blocknum, int count )
+{
+	if(!__atomic_load_n(&d->trace,__ATOMIC_ACQUIRE)) return;
+
+	uint64_t now = stats_clock();
+	int origin = trace_tag | (trace_cached ? DISK_TRACE_CACHED : 0);
+
+	pthread_mutex_lock(&d->trace_lock);
+	if(d->trace) {
+		do {
+			int n = count>UINT16_MAX ? UINT16_MAX : count;
+			struct disk_trace_record *r = &d->trace[d->tracelen++];
+			r->time = now - d->tracestart;
+			r->blocknum = blocknum;
+			r->count = n;
+			r->op = op;
+			r->origin = origin;
+			if(d->tracelen==TRACE_BUFFER) trace_drain(d);
+			blocknum += n;
+			count -= n;
+		} while(count>0);
+	}
+	pthread_mutex_unlock(&d->trace_lock);
 }
 
-static void sanity_check( int blocknum, const void *data )
+int disk_trace_tag( int tag )
+{
+	int old = trace_tag;
+	trace_tag = tag & ~DISK_TRACE_CACHED;
+	return old;
+}
+
+void disk_trace_cached( int on )
+{
+	trace_cached = on;
+}
+
+static void sanity_check( disk_t *d, int blocknum, const void *data )
 {
 	if(blocknum<0) {
 		printf("ERROR: blocknum (%d) is negative!\n",blocknum);
 		abort();
 	}
 
-	if(blocknum>=nblocks) {
+	if(blocknum>=d->nblocks) {
 		printf("ERROR: blocknum (%d) is too big!\n",blocknum);
 		abort();
 	}
@@ -52,41 +313,623 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
-void disk_read( int blocknum, char *data )
+static void range_check( disk_t *d, int blocknum, int count, void *const *data )
+{
+	int i;
+
+	if(count<=0) {
+		printf("ERROR: block count (%d) is not positive!\n",count);
+		abort();
+	}
+
+	sanity_check(d,blocknum,data);
+	sanity_check(d,blocknum+count-1,data);
+	for(i=0;i<count;i++) {
+		if(!data[i]) {
+			printf("ERROR: null data pointer!\n");
+			abort();
+		}
+	}
+}
+
+// Returns the block itself inside the mapped image, so callers can read or
+// modify it in place. Only the mmap backend can do this, the pread backend
+// returns 0 and the caller has to fall back to disk_read/disk_write.
+// Each call counts as one block read.
+char *disk_block_ptr_r( disk_t *d, int blocknum )
 {
-	sanity_check(blocknum,data);
+	if(!d->map) return 0;
+	sanity_check(d,blocknum,d->map);
+	disk_trace_r(d,DISK_TRACE_READ,blocknum,1);
+	__sync_fetch_and_add(&d->nreads,1);
+	return d->map + (size_t)blocknum*DISK_BLOCK_SIZE;
+}
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+void disk_read_r( disk_t *d, int blocknum, char *data )
+{
+	uint64_t start = stats_start();
+	sanity_check(d,blocknum,data);
+	disk_trace_r(d,DISK_TRACE_READ,blocknum,1);
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	if(d->map) {
+		memcpy(data,d->map+(size_t)blocknum*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+		__sync_fetch_and_add(&d->nreads,1);
+	} else if(pread(d->fd,data,DISK_BLOCK_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE)==DISK_BLOCK_SIZE) {
+		__sync_fetch_and_add(&d->nreads,1);
+		__sync_fetch_and_add(&d->nreadcalls,1);
 	} else {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
+	stats_end(&d->stats[DISK_STAT_READ],start,DISK_BLOCK_SIZE);
 }
 
-void disk_write( int blocknum, const char *data )
+void disk_write_r( disk_t *d, int blocknum, const char *data )
 {
-	sanity_check(blocknum,data);
+	uint64_t start = stats_start();
+	sanity_check(d,blocknum,data);
+	disk_trace_r(d,DISK_TRACE_WRITE,blocknum,1);
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
-
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	if(d->map) {
+		memcpy(d->map+(size_t)blocknum*DISK_BLOCK_SIZE,data,DISK_BLOCK_SIZE);
+		__sync_fetch_and_add(&d->nwrites,1);
+	} else if(pwrite(d->fd,data,DISK_BLOCK_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE)==DISK_BLOCK_SIZE) {
+		__sync_fetch_and_add(&d->nwrites,1);
+		__sync_fetch_and_add(&d->nwritecalls,1);
 	} else {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
+	stats_end(&d->stats[DISK_STAT_WRITE],start,DISK_BLOCK_SIZE);
 }
 
-void disk_close()
+// Moves count contiguous blocks starting at blocknum in as few system
+// calls as possible. data[i] is the buffer for block blocknum+i, so the
+// buffers themselves don't need to be contiguous.
+
+static void disk_range( disk_t *d, int blocknum, int count, void *const *data, int writing )
+{
+	struct iovec iov[DISK_MAX_IOV];
+	int done = 0;
+
+	range_check(d,blocknum,count,data);
+
+	if(d->map) {
+		for(done=0;done<count;done++) {
+			char *block = d->map + (size_t)(blocknum+done)*DISK_BLOCK_SIZE;
+			if(writing) {
+				memcpy(block,data[done],DISK_BLOCK_SIZE);
+			} else {
+				memcpy(data[done],block,DISK_BLOCK_SIZE);
+			}
+		}
+		__sync_fetch_and_add(writing ? &d->nwrites : &d->nreads,count);
+		return;
+	}
+
+	while(done<count) {
+		int n = count-done;
+		int i;
+		ssize_t result;
+
+		if(n>DISK_MAX_IOV) n = DISK_MAX_IOV;
+		for(i=0;i<n;i++) {
+			iov[i].iov_base = data[done+i];
+			iov[i].iov_len = DISK_BLOCK_SIZE;
+		}
+
+		off_t offset = (off_t)(blocknum+done)*DISK_BLOCK_SIZE;
+		if(writing) {
+			result = pwritev(d->fd,iov,n,offset);
+			__sync_fetch_and_add(&d->nwritecalls,1);
+		} else {
+			result = preadv(d->fd,iov,n,offset);
+			__sync_fetch_and_add(&d->nreadcalls,1);
+		}
+
+		if(result!=(ssize_t)n*DISK_BLOCK_SIZE) {
+			printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+			abort();
+		}
+
+		if(writing) {
+			__sync_fetch_and_add(&d->nwrites,n);
+		} else {
+			__sync_fetch_and_add(&d->nreads,n);
+		}
+		done += n;
+	}
+}
+
+void disk_read_range_r( disk_t *d, int blocknum, int count, char **data )
+{
+	uint64_t start = stats_start();
+	disk_trace_r(d,DISK_TRACE_READ,blocknum,count);
+	disk_range(d,blocknum,count,(void *const *)data,0);
+	stats_end(&d->stats[DISK_STAT_READ_RANGE],start,(uint64_t)count*DISK_BLOCK_SIZE);
+}
+
+void disk_write_range_r( disk_t *d, int blocknum, int count, const char **data )
+{
+	uint64_t start = stats_start();
+	disk_trace_r(d,DISK_TRACE_WRITE,blocknum,count);
+	disk_range(d,blocknum,count,(void *const *)data,1);
+	stats_end(&d->stats[DISK_STAT_WRITE_RANGE],start,(uint64_t)count*DISK_BLOCK_SIZE);
+}
+
+// Tells the image that count blocks from blocknum hold nothing worth
+// keeping, by punching a hole in the file so the host gets the space back.
+// The blocks read back as zeros afterwards. Returns 0 if the image can't
+// do it, in which case the blocks are left as they were and later calls
+// don't try again.
+int disk_discard_r( disk_t *d, int blocknum, int count )
+{
+	if(count<=0) return 1;
+	sanity_check(d,blocknum,d);
+	sanity_check(d,blocknum+count-1,d);
+
+	disk_trace_r(d,DISK_TRACE_DISCARD,blocknum,count);
+	if(__atomic_load_n(&d->nodiscard,__ATOMIC_RELAXED)) return 0;
+
+	uint64_t start = stats_start();
+	if(fallocate(d->fd,FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE,(off_t)count*DISK_BLOCK_SIZE)!=0) {
+		if(errno!=EOPNOTSUPP && errno!=ENOSYS) {
+			printf("ERROR: couldn't discard blocks of simulated disk: %s\n",strerror(errno));
+		}
+		__atomic_store_n(&d->nodiscard,1,__ATOMIC_RELAXED);
+		return 0;
+	}
+	__sync_fetch_and_add(&d->ndiscards,count);
+	stats_end(&d->stats[DISK_STAT_DISCARD],start,0);
+	return 1;
+}
+
+// Waits until everything written so far is on stable storage. This is the
+// only ordering point the disk offers; writes issued after it returns may
+// reach the platter in any order relative to each other.
+int disk_sync_r( disk_t *d )
+{
+	uint64_t start = stats_start();
+	int result;
+	disk_trace_r(d,DISK_TRACE_SYNC,0,0);
+	if(d->map) {
+		result = msync(d->map,(size_t)d->nblocks*DISK_BLOCK_SIZE,MS_SYNC);
+	} else {
+		result = fdatasync(d->fd);
+	}
+	if(result!=0) {
+		printf("ERROR: couldn't sync simulated disk: %s\n",strerror(errno));
+		return 0;
+	}
+	stats_end(&d->stats[DISK_STAT_SYNC],start,0);
+	return 1;
+}
+
+// Asynchronous interface. Callers fill in a batch of disk_requests, hand
+// them to disk_submit, and later call disk_reap to wait for them. On Linux
+// the requests go to the kernel through an io_uring, so up to queuedepth
+// of them are in flight on the device at once. Where io_uring isn't
+// available a small pool of threads runs them with preadv/pwritev instead.
+// Without disk_async_init (or with the mmap backend) requests simply run
+// synchronously inside disk_submit.
+
+static void request_finish( disk_t *d, struct disk_request *req, int ok )
+{
+	stats_end(&d->stats[DISK_STAT_ASYNC],req->started,ok ? (uint64_t)req->count*DISK_BLOCK_SIZE : 0);
+	free(req->iov);
+	req->iov = 0;
+	__atomic_store_n(&req->result,ok,__ATOMIC_RELEASE);
+}
+
+static int uring_setup( disk_t *d, int depth )
+{
+	struct io_uring_params p;
+
+	memset(&p,0,sizeof(p));
+	d->ring.fd = syscall(__NR_io_uring_setup,depth,&p);
+	if(d->ring.fd<0) return 0;
+
+	d->ring.sq_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	d->ring.cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(d->ring.cq_len>d->ring.sq_len) d->ring.sq_len = d->ring.cq_len;
+		d->ring.cq_len = d->ring.sq_len;
+	}
+
+	d->ring.sq_ptr = mmap(0,d->ring.sq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,d->ring.fd,IORING_OFF_SQ_RING);
+	if(d->ring.sq_ptr==MAP_FAILED) goto fail;
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		d->ring.cq_ptr = d->ring.sq_ptr;
+	} else {
+		d->ring.cq_ptr = mmap(0,d->ring.cq_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,d->ring.fd,IORING_OFF_CQ_RING);
+		if(d->ring.cq_ptr==MAP_FAILED) goto fail;
+	}
+	d->ring.sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+	d->ring.sqes = mmap(0,d->ring.sqes_len,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,d->ring.fd,IORING_OFF_SQES);
+	if(d->ring.sqes==MAP_FAILED) goto fail;
+
+	d->ring.sq_head = (unsigned *)((char *)d->ring.sq_ptr + p.sq_off.head);
+	d->ring.sq_tail = (unsigned *)((char *)d->ring.sq_ptr + p.sq_off.tail);
+	d->ring.sq_mask = (unsigned *)((char *)d->ring.sq_ptr + p.sq_off.ring_mask);
+	d->ring.sq_array = (unsigned *)((char *)d->ring.sq_ptr + p.sq_off.array);
+	d->ring.cq_head = (unsigned *)((char *)d->ring.cq_ptr + p.cq_off.head);
+	d->ring.cq_tail = (unsigned *)((char *)d->ring.cq_ptr + p.cq_off.tail);
+	d->ring.cq_mask = (unsigned *)((char *)d->ring.cq_ptr + p.cq_off.ring_mask);
+	d->ring.cqes = (struct io_uring_cqe *)((char *)d->ring.cq_ptr + p.cq_off.cqes);
+	d->ring.inflight = 0;
+	d->ring.reaping = 0;
+	d->queuedepth = p.sq_entries;
+
+	return 1;
+
+fail:
+	close(d->ring.fd);
+	d->ring.fd = -1;
+	return 0;
+}
+
+static void uring_teardown( disk_t *d )
+{
+	if(d->ring.fd<0) return;
+	munmap(d->ring.sqes,d->ring.sqes_len);
+	if(d->ring.cq_ptr!=d->ring.sq_ptr) munmap(d->ring.cq_ptr,d->ring.cq_len);
+	munmap(d->ring.sq_ptr,d->ring.sq_len);
+	close(d->ring.fd);
+	d->ring.fd = -1;
+}
+
+// retires everything sitting in the completion queue, d->async_lock held
+// and nobody in uring_wait
+static void uring_complete( disk_t *d )
 {
-	if(diskfile) {
-		printf("%d disk block reads\n",nreads);
-		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+	unsigned head = *d->ring.cq_head;
+	unsigned tail = __atomic_load_n(d->ring.cq_tail,__ATOMIC_ACQUIRE);
+
+	while(head!=tail) {
+		struct io_uring_cqe *cqe = &d->ring.cqes[head & *d->ring.cq_mask];
+		struct disk_request *req = (struct disk_request *)(uintptr_t)cqe->user_data;
+		int ok = cqe->res==req->count*DISK_BLOCK_SIZE;
+
+		if(ok) {
+			__sync_fetch_and_add(req->op==DISK_OP_WRITE ? &d->nwrites : &d->nreads,req->count);
+		} else {
+			printf("ERROR: async disk access failed: %s\n",strerror(cqe->res<0 ? -cqe->res : EIO));
+		}
+		request_finish(d,req,ok);
+		d->ring.inflight--;
+		head++;
 	}
+
+	__atomic_store_n(d->ring.cq_head,head,__ATOMIC_RELEASE);
+}
+
+// puts one request on the submission queue, d->async_lock held
+static void uring_queue( disk_t *d, struct disk_request *req )
+{
+	unsigned tail = *d->ring.sq_tail;
+	unsigned index = tail & *d->ring.sq_mask;
+	struct io_uring_sqe *sqe = &d->ring.sqes[index];
+
+	memset(sqe,0,sizeof(*sqe));
+	sqe->opcode = (req->op==DISK_OP_WRITE) ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = d->fd;
+	sqe->addr = (uintptr_t)req->iov;
+	sqe->len = req->count;
+	sqe->off = (off_t)req->blocknum*DISK_BLOCK_SIZE;
+	sqe->user_data = (uintptr_t)req;
+
+	d->ring.sq_array[index] = index;
+	__atomic_store_n(d->ring.sq_tail,tail+1,__ATOMIC_RELEASE);
+	d->ring.inflight++;
 }
 
+// hands the kernel everything queued so far, optionally waiting for wait
+// completions as well
+static int uring_enter( disk_t *d, unsigned wait )
+{
+	unsigned submit = __atomic_load_n(d->ring.sq_tail,__ATOMIC_ACQUIRE) - __atomic_load_n(d->ring.sq_head,__ATOMIC_ACQUIRE);
+	return syscall(__NR_io_uring_enter,d->ring.fd,submit,wait,wait ? IORING_ENTER_GETEVENTS : 0,0,0);
+}
+
+// waits for at least one request to finish, d->async_lock held. One
+// thread at a time waits in the kernel, with the lock dropped so others
+// can keep submitting; the rest sleep on async_done until it has retired
+// what came in. Only that thread touches the completion queue meanwhile,
+// so what it waits for can't be taken from under it.
+static void uring_wait( disk_t *d )
+{
+	if(d->ring.reaping) {
+		pthread_cond_wait(&d->async_done,&d->async_lock);
+		return;
+	}
+	d->ring.reaping = 1;
+	pthread_mutex_unlock(&d->async_lock);
+	uring_enter(d,1);
+	pthread_mutex_lock(&d->async_lock);
+	uring_complete(d);
+	d->ring.reaping = 0;
+	pthread_cond_broadcast(&d->async_done);
+}
+
+static void *pool_worker( void *arg )
+{
+	disk_t *d = arg;
+
+	while(1) {
+		pthread_mutex_lock(&d->async_lock);
+		while(!d->pool_head && !d->pool_stop) pthread_cond_wait(&d->pool_work,&d->async_lock);
+		if(!d->pool_head) {
+			pthread_mutex_unlock(&d->async_lock);
+			return 0;
+		}
+		struct disk_request *req = d->pool_head;
+		d->pool_head = req->next;
+		if(!d->pool_head) d->pool_tail = 0;
+		pthread_mutex_unlock(&d->async_lock);
+
+		disk_range(d,req->blocknum,req->count,(void *const *)req->data,req->op==DISK_OP_WRITE);
+
+		pthread_mutex_lock(&d->async_lock);
+		request_finish(d,req,1);
+		pthread_cond_broadcast(&d->async_done);
+		pthread_mutex_unlock(&d->async_lock);
+	}
+}
+
+int disk_async_init_r( disk_t *d, int depth, int mode )
+{
+	int i;
+
+	disk_async_close_r(d);
+
+	if(depth<=0 || mode==DISK_ASYNC_OFF) return 1;
+
+	if(mode==DISK_ASYNC_AUTO && uring_setup(d,depth)) {
+		d->async_mode = DISK_ASYNC_URING;
+		return 1;
+	}
+
+	d->pool_stop = 0;
+	for(i=0;i<ASYNC_THREADS;i++) {
+		if(pthread_create(&d->pool[i],0,pool_worker,d)!=0) {
+			d->pool_stop = 1;
+			pthread_cond_broadcast(&d->pool_work);
+			while(i-->0) pthread_join(d->pool[i],0);
+			return 0;
+		}
+	}
+	d->queuedepth = depth;
+	d->async_mode = DISK_ASYNC_THREADS;
+
+	return 1;
+}
+
+int disk_async_mode_r( disk_t *d )
+{
+	return d->async_mode;
+}
+
+void disk_async_close_r( disk_t *d )
+{
+	int i;
+
+	if(d->async_mode==DISK_ASYNC_URING) {
+		pthread_mutex_lock(&d->async_lock);
+		while(d->ring.inflight>0) uring_wait(d);
+		pthread_mutex_unlock(&d->async_lock);
+		uring_teardown(d);
+	} else if(d->async_mode==DISK_ASYNC_THREADS) {
+		pthread_mutex_lock(&d->async_lock);
+		d->pool_stop = 1;
+		pthread_cond_broadcast(&d->pool_work);
+		pthread_mutex_unlock(&d->async_lock);
+		for(i=0;i<ASYNC_THREADS;i++) pthread_join(d->pool[i],0);
+	}
+
+	d->async_mode = DISK_ASYNC_OFF;
+}
+
+void disk_submit_r( disk_t *d, struct disk_request *reqs, int n )
+{
+	uint64_t start = stats_start();
+	uint64_t bytes = 0;
+	int i, j;
+
+	for(i=0;i<n;i++) {
+		struct disk_request *req = &reqs[i];
+
+		range_check(d,req->blocknum,req->count,(void *const *)req->data);
+		req->result = -1;
+		req->iov = 0;
+		req->next = 0;
+		req->started = start;
+		bytes += (uint64_t)req->count*DISK_BLOCK_SIZE;
+		disk_trace_r(d,req->op==DISK_OP_WRITE ? DISK_TRACE_WRITE : DISK_TRACE_READ,req->blocknum,req->count);
+
+		// run it right here when there is nothing to hand it to
+		if(d->async_mode==DISK_ASYNC_OFF || d->map || req->count>DISK_MAX_IOV) {
+			disk_range(d,req->blocknum,req->count,(void *const *)req->data,req->op==DISK_OP_WRITE);
+			stats_end(&d->stats[DISK_STAT_ASYNC],req->started,(uint64_t)req->count*DISK_BLOCK_SIZE);
+			req->result = 1;
+			continue;
+		}
+
+		req->iov = malloc(sizeof(struct iovec)*req->count);
+		if(!req->iov) {
+			printf("ERROR: out of memory for async disk request\n");
+			abort();
+		}
+		for(j=0;j<req->count;j++) {
+			req->iov[j].iov_base = req->data[j];
+			req->iov[j].iov_len = DISK_BLOCK_SIZE;
+		}
+		__sync_fetch_and_add(req->op==DISK_OP_WRITE ? &d->nwritecalls : &d->nreadcalls,1);
+
+		pthread_mutex_lock(&d->async_lock);
+		if(d->async_mode==DISK_ASYNC_URING) {
+			// a full queue has to drain a little before taking more
+			while(d->ring.inflight>=d->queuedepth) uring_wait(d);
+			uring_queue(d,req);
+		} else {
+			if(d->pool_tail) {
+				d->pool_tail->next = req;
+			} else {
+				d->pool_head = req;
+			}
+			d->pool_tail = req;
+			pthread_cond_signal(&d->pool_work);
+		}
+		pthread_mutex_unlock(&d->async_lock);
+	}
+
+	// one system call hands the kernel the whole batch
+	if(d->async_mode==DISK_ASYNC_URING) {
+		pthread_mutex_lock(&d->async_lock);
+		if(uring_enter(d,0)<0) {
+			printf("ERROR: couldn't submit async disk requests: %s\n",strerror(errno));
+			abort();
+		}
+		pthread_mutex_unlock(&d->async_lock);
+	}
+	stats_end(&d->stats[DISK_STAT_SUBMIT],start,bytes);
+}
+
+// waits until every one of the n requests has finished, returns how many
+// of them succeeded
+int disk_reap_r( disk_t *d, struct disk_request *reqs, int n )
+{
+	uint64_t start = stats_start();
+	int i, ok = 0;
+
+	for(i=0;i<n;i++) {
+		while(__atomic_load_n(&reqs[i].result,__ATOMIC_ACQUIRE)<0) {
+			pthread_mutex_lock(&d->async_lock);
+			if(d->async_mode==DISK_ASYNC_URING) {
+				if(!d->ring.reaping) uring_complete(d);
+				if(reqs[i].result<0) uring_wait(d);
+			} else if(reqs[i].result<0) {
+				pthread_cond_wait(&d->async_done,&d->async_lock);
+			}
+			pthread_mutex_unlock(&d->async_lock);
+		}
+		if(reqs[i].result>0) ok++;
+	}
+
+	stats_end(&d->stats[DISK_STAT_REAP],start,0);
+	return ok;
+}
+
+void disk_close_r( disk_t *d )
+{
+	disk_async_close_r(d);
+	disk_trace_stop_r(d);
+
+	printf("%d disk block reads\n",d->nreads);
+	printf("%d disk block writes\n",d->nwrites);
+	printf("%d disk read calls\n",d->nreadcalls);
+	printf("%d disk write calls\n",d->nwritecalls);
+	printf("%d disk blocks discarded\n",d->ndiscards);
+	if(d->map) {
+		if(msync(d->map,(size_t)d->nblocks*DISK_BLOCK_SIZE,MS_SYNC)!=0) {
+			printf("ERROR: couldn't sync simulated disk: %s\n",strerror(errno));
+		}
+		munmap(d->map,(size_t)d->nblocks*DISK_BLOCK_SIZE);
+	}
+	close(d->fd);
+	pthread_mutex_destroy(&d->async_lock);
+	pthread_cond_destroy(&d->async_done);
+	pthread_cond_destroy(&d->pool_work);
+	pthread_mutex_destroy(&d->trace_lock);
+	free(d);
+}
+
+// The original single-disk interface, working on the disk opened by
+// disk_init.
+
+int disk_size()
+{
+	return default_disk ? disk_size_r(default_disk) : 0;
+}
+
+int disk_backend()
+{
+	return default_disk ? disk_backend_r(default_disk) : DISK_BACKEND_PREAD;
+}
+
+char *disk_block_ptr( int blocknum )
+{
+	return disk_block_ptr_r(default_disk,blocknum);
+}
+
+void disk_read( int blocknum, char *data )
+{
+	disk_read_r(default_disk,blocknum,data);
+}
+
+void disk_write( int blocknum, const char *data )
+{
+	disk_write_r(default_disk,blocknum,data);
+}
+
+void disk_read_range( int blocknum, int count, char **data )
+{
+	disk_read_range_r(default_disk,blocknum,count,data);
+}
+
+void disk_write_range( int blocknum, int count, const char **data )
+{
+	disk_write_range_r(default_disk,blocknum,count,data);
+}
+
+int disk_discard( int blocknum, int count )
+{
+	return default_disk ? disk_discard_r(default_disk,blocknum,count) : 0;
+}
+
+int disk_sync()
+{
+	return default_disk ? disk_sync_r(default_disk) : 0;
+}
+
+int disk_trace_start( const char *filename )
+{
+	return default_disk ? disk_trace_start_r(default_disk,filename) : 0;
+}
+
+void disk_trace_stop()
+{
+	if(default_disk) disk_trace_stop_r(default_disk);
+}
+
+int disk_async_init( int queuedepth, int mode )
+{
+	return default_disk ? disk_async_init_r(default_disk,queuedepth,mode) : 0;
+}
+
+int disk_async_mode()
+{
+	return default_disk ? disk_async_mode_r(default_disk) : DISK_ASYNC_OFF;
+}
+
+void disk_submit( struct disk_request *reqs, int n )
+{
+	disk_submit_r(default_disk,reqs,n);
+}
+
+int disk_reap( struct disk_request *reqs, int n )
+{
+	return disk_reap_r(default_disk,reqs,n);
+}
+
+void disk_async_close()
+{
+	if(default_disk) disk_async_close_r(default_disk);
+}
+
+void disk_close()
+{
+	if(default_disk) {
+		disk_close_r(default_disk);
+		default_disk = 0;
+	}
+}
@@ -1,12 +1,150 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <stdint.h>
+
 #define DISK_BLOCK_SIZE 4096
 
+#define DISK_BACKEND_PREAD 0 // pread/pwrite on the image file
+#define DISK_BACKEND_MMAP  1 // the whole image mapped into memory
+
+#define DISK_ASYNC_OFF     0 // requests run synchronously in disk_submit
+#define DISK_ASYNC_AUTO    1 // io_uring if the kernel allows it, else threads
+#define DISK_ASYNC_THREADS 2 // always use the thread pool
+#define DISK_ASYNC_URING   3 // reported by disk_async_mode when io_uring is in use
+
+#define DISK_OP_READ  0
+#define DISK_OP_WRITE 1
+
+#define DISK_DEFAULT_QUEUE_DEPTH 32
+
+// what a trace record stands for
+#define DISK_TRACE_READ              0 // blocks read from the image
+#define DISK_TRACE_WRITE             1 // blocks written to it
+#define DISK_TRACE_DISCARD           2
+#define DISK_TRACE_SYNC              3
+#define DISK_TRACE_CACHE_READ        4 // a block asked of the cache with cache_read
+#define DISK_TRACE_CACHE_WRITE       5
+#define DISK_TRACE_CACHE_READ_RANGE  6 // blocks asked of it by the range and batch calls
+#define DISK_TRACE_CACHE_WRITE_RANGE 7
+#define DISK_TRACE_CACHE_PREFETCH    8
+#define DISK_TRACE_CACHE_FLUSH       9
+
+#define DISK_TRACE_CACHED  0x80 // origin bit: the cache made this transfer
+#define DISK_TRACE_MAGIC   0x53465452
+#define DISK_TRACE_VERSION 1
+
+struct iovec;
+struct stats_entry;
+
+// one asynchronous transfer of count contiguous blocks
+struct disk_request {
+	int op;          // DISK_OP_READ or DISK_OP_WRITE
+	int blocknum;    // first block
+	int count;       // number of blocks
+	char **data;     // one buffer per block
+	int result;      // -1 while in flight, then 1 if it worked, 0 if not
+
+	struct iovec *iov;            // private to disk.c
+	uint64_t started;
+	struct disk_request *next;
+};
+
+// per-disk counters, as printed by disk_close
+struct disk_stats {
+	int reads;      // blocks read
+	int writes;     // blocks written
+	int readcalls;  // read system calls issued
+	int writecalls;
+	int discards;   // blocks given back to the host with disk_discard
+};
+
+// A trace file is a disk_trace_header followed by disk_trace_records
+// until the end of the file, in the order they happened.
+struct disk_trace_header {
+	uint32_t magic;     // DISK_TRACE_MAGIC
+	uint32_t version;   // DISK_TRACE_VERSION
+	int32_t nblocks;    // size of the traced disk
+	int32_t blocksize;
+};
+
+struct disk_trace_record {
+	uint64_t time;      // nanoseconds since the trace was started
+	int32_t blocknum;   // first block, or 0 for a sync or flush
+	uint16_t count;     // blocks; longer transfers take several records
+	uint8_t op;         // DISK_TRACE_*
+	uint8_t origin;     // the tag from disk_trace_tag, plus DISK_TRACE_CACHED
+};
+
+typedef struct disk disk_t;
+
+// Every disk opened with disk_open is a separate image with its own file,
+// asynchronous queue and counters, so one process can work on many at
+// once. The *_r calls are the same as the ones below without the suffix.
+disk_t *disk_open( const char *filename, int nblocks, int backend );
+int  disk_size_r( disk_t *d );
+int  disk_backend_r( disk_t *d );
+void disk_stats_r( disk_t *d, struct disk_stats *s );
+char *disk_block_ptr_r( disk_t *d, int blocknum );
+void disk_read_r( disk_t *d, int blocknum, char *data );
+void disk_write_r( disk_t *d, int blocknum, const char *data );
+void disk_read_range_r( disk_t *d, int blocknum, int count, char **data );
+void disk_write_range_r( disk_t *d, int blocknum, int count, const char **data );
+int  disk_discard_r( disk_t *d, int blocknum, int count );
+int  disk_sync_r( disk_t *d );
+int  disk_async_init_r( disk_t *d, int queuedepth, int mode );
+int  disk_async_mode_r( disk_t *d );
+void disk_submit_r( disk_t *d, struct disk_request *reqs, int n );
+int  disk_reap_r( disk_t *d, struct disk_request *reqs, int n );
+void disk_async_close_r( disk_t *d );
+void disk_close_r( disk_t *d );
+
+// Each disk also keeps a latency histogram per kind of call while
+// stats_enable has them on: disk.read, disk.write, disk.read_range,
+// disk.write_range, disk.discard, disk.sync, disk.submit, disk.reap, and
+// disk.async for each request from disk_submit until it finishes.
+// disk_histograms_r hands out up to max of them and returns how many;
+// disk_stats_reset_r zeroes them along with the counters.
+int  disk_histograms_r( disk_t *d, struct stats_entry *entries, int max );
+void disk_stats_reset_r( disk_t *d );
+
+// Block traces. Between disk_trace_start_r and disk_trace_stop_r every
+// transfer, discard and sync on the disk is appended to a trace file, and
+// so is every request the cache in front of it is asked to serve (the
+// cache logs those with disk_trace_r). Each record carries the tag the
+// calling thread last set with disk_trace_tag, which the filesystem sets
+// to the call it is working on, so a trace shows what caused what.
+// Transfers the cache makes are marked while disk_trace_cached is on in
+// that thread. Tracing costs a test of one pointer when it is off.
+int  disk_trace_start_r( disk_t *d, const char *filename );
+void disk_trace_stop_r( disk_t *d );
+void disk_trace_r( disk_t *d, int op, int blocknum, int count );
+int  disk_trace_tag( int tag );
+void disk_trace_cached( int on );
+
+// The default disk, set up by disk_init and used by everything below.
+disk_t *disk_default();
+
 int  disk_init( const char *filename, int nblocks );
+int  disk_init_backend( const char *filename, int nblocks, int backend );
 int  disk_size();
+int  disk_backend();
+char *disk_block_ptr( int blocknum );
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_read_range( int blocknum, int count, char **data );
+void disk_write_range( int blocknum, int count, const char **data );
+int  disk_discard( int blocknum, int count );
+int  disk_sync();
+int  disk_trace_start( const char *filename );
+void disk_trace_stop();
+
+int  disk_async_init( int queuedepth, int mode );
+int  disk_async_mode();
+void disk_submit( struct disk_request *reqs, int n );
+int  disk_reap( struct disk_request *reqs, int n );
+void disk_async_close();
+
 void disk_close();
 
 
@@ -1,6 +1,10 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "bitmap.h"
+#include "journal.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -9,52 +13,391 @@
 #include <unistd.h>
 #include <math.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <limits.h>
 
-#define FS_MAGIC           0xf0f03410
+#define FS_MAGIC           0xf0f03411 // superblock with an on-disk free block bitmap
+#define FS_MAGIC_V1        0xf0f03410 // original layout, bitmap rebuilt by scanning
 #define INODES_PER_BLOCK   128
 #define POINTERS_PER_INODE 5
+#define LARGE_DIRECT       2 // direct pointers in a FS_FEATURE_LARGEFILE inode
 #define POINTERS_PER_BLOCK 1024
+#define BITS_PER_BLOCK     (DISK_BLOCK_SIZE*8)
+#define EXTENTS_PER_INODE  2
+#define EXTENTS_PER_BLOCK  (DISK_BLOCK_SIZE/8)
+#define MAX_EXTENTS        (EXTENTS_PER_INODE+EXTENTS_PER_BLOCK)
+
+#define FS_STATE_CLEAN     1 // unmounted cleanly, the on-disk bitmap can be trusted
+#define FS_STATE_DIRTY     2 // mounted or crashed, the bitmap has to be rebuilt (unless journaled)
+
+#define INODE_LOCKS        1024 // reader/writer locks shared out among the inodes
+
+// one histogram per call, timed while stats_enable has them on, and two
+// for how many bits the allocator looked at to find what it handed out
+enum {
+	FS_STAT_MOUNT,
+	FS_STAT_UNMOUNT,
+	FS_STAT_CREATE,
+	FS_STAT_DELETE,
+	FS_STAT_GETSIZE,
+	FS_STAT_READ,
+	FS_STAT_WRITE,
+	FS_STAT_TRUNCATE,
+	FS_STAT_SYNC,
+	FS_STAT_LOOKUP,
+	FS_STAT_LINK,
+	FS_STAT_UNLINK,
+	FS_STAT_BLOCK_SCAN,
+	FS_STAT_INODE_SCAN,
+	FS_STATS
+};
 
-bool ISMOUNT = false;
-
-int NUM_BLOCKS;
-
-// FREE BLOCK BITMAP
-int *bitmap; // ARRAY OF INTS, 1 if used 0 if unused
-// Everytime a system reboots, it needs to scan through and recreate the bitmap
+static const char *stat_names[FS_STATS] = {
+	"fs.mount", "fs.unmount", "fs.create", "fs.delete", "fs.getsize",
+	"fs.read", "fs.write", "fs.truncate", "fs.sync",
+	"fs.lookup", "fs.link", "fs.unlink",
+	"fs.block_scan", "fs.inode_scan",
+};
 
 struct fs_superblock {
 	int magic;
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	int bitmapstart;   // first block of the free block bitmap (0 on V1 disks)
+	int nbitmapblocks;
+	int state;         // FS_STATE_CLEAN or FS_STATE_DIRTY
+	int features;      // FS_FEATURE_* flags chosen by fs_format
+	int inodebitmapstart;   // first block of the free inode bitmap
+	int ninodebitmapblocks; // 0 on disks formatted before it existed
+	int journalstart;       // first block of the metadata journal
+	int njournalblocks;     // 0 on disks without one
+	int dirinode;           // the directory holding the names, 0 until there are any
 };
 
+// a run of length blocks on disk starting at start
+struct fs_extent {
+	int start;
+	int length;
+};
+
+// On a disk formatted with FS_FEATURE_EXTENTS every inode maps its data
+// with extents instead of block pointers. The extents are kept in file
+// order, so the first one holds the file's first blocks, and any beyond
+// the two in the inode spill into a separate extent block.
+//
+// FS_FEATURE_LARGEFILE inodes trade three direct pointers for a double
+// and a triple indirect block and the top half of a 64-bit size, which
+// takes files from about 4 MB to about 4 TB. Extent inodes keep the top 16
+// bits of theirs next to the extent count, which never needs more than 16.
+// Use inode_size and inode_set_size rather than size itself.
 struct fs_inode {
-	int isvalid;
+	short isvalid;
+	unsigned short nlinks; // names it has, see NAMES; 0 on disks from before names
+	int size;          // the low 32 bits, on FS_FEATURE_LARGEFILE and extent disks
+	union {
+		struct {
+			int direct[POINTERS_PER_INODE];
+			int indirect;
+		};
+		struct {
+			int sizehigh;
+			int ldirect[LARGE_DIRECT];
+			int lindirect;
+			int dindirect;
+			int tindirect;
+		};
+		struct {
+			struct fs_extent extent[EXTENTS_PER_INODE];
+			unsigned short nextents;
+			unsigned short extsizehigh;
+			int extentblock;
+		};
+	};
+};
+
+_Static_assert(sizeof(struct fs_inode)*INODES_PER_BLOCK == DISK_BLOCK_SIZE,"inodes must fill a block exactly");
+
+// On a FS_FEATURE_INLINE disk every inode takes INLINE_INODE_SIZE bytes: an
+// ordinary inode, more room after it and a flags word at the very end. A
+// file flagged INODE_INLINE has no blocks at all. Its data sits in the
+// inode itself, from where the block pointers would start, and its size is
+// just size. New files start out inline and move out to blocks the first
+// time they grow past INLINE_MAX bytes, see inline_spill, so reading a
+// small file costs nothing past its inode block and it takes no data block.
+#define INLINE_INODE_SIZE 128
+#define INLINE_MAX        (INLINE_INODE_SIZE - 3*(int)sizeof(int))
+#define INODE_INLINE      1
+
+struct fs_inline_inode {
+	struct fs_inode inode;
+	char more[INLINE_INODE_SIZE - sizeof(struct fs_inode) - sizeof(int)];
+	int flags;         // INODE_INLINE or 0
+};
+
+_Static_assert(sizeof(struct fs_inline_inode) == INLINE_INODE_SIZE,"inline inodes must not be padded");
+_Static_assert(DISK_BLOCK_SIZE % INLINE_INODE_SIZE == 0,"inline inodes must fill a block exactly");
+
+// The names directory, see NAMES next to fs_lookup_r. Block 0 is this
+// header, bucket b is block 1+b, and overflow blocks come down from the
+// top of what the file can map.
+struct fs_dirheader {
+	int magic;         // DIR_MAGIC
+	int level;         // buckets below split use level+1 bits of the hash, the rest level
+	int split;         // next bucket to be split in two
+	int nentries;
+	int buckets;       // blocks allocated for buckets so far, in use or not
+	int overflow;      // lowest block handed out for overflow so far
+	int overflowlow;   // lowest one allocated, the ones in between are spare
+	int freeoverflow;  // an overflow block no longer in use, chained through next; 0 if none
+};
+
+struct fs_dirent {
+	int inumber;       // 0 if the slot is free
+	unsigned hash;
+	char name[FS_NAME_MAX+1];
+};
+
+#define DIRENTS_PER_BLOCK  (DISK_BLOCK_SIZE/sizeof(struct fs_dirent) - 1)
+
+struct fs_dirblock {
+	int next;          // the bucket's next overflow block, 0 if this is the last
+	int count;         // entries in use
+	char unused[sizeof(struct fs_dirent) - 2*sizeof(int)];
+	struct fs_dirent entries[DIRENTS_PER_BLOCK];
+};
+
+_Static_assert(sizeof(struct fs_dirblock) == DISK_BLOCK_SIZE,"directory blocks must fill a block exactly");
+
+// blocks waiting for a transaction to commit before they are free, see
+// free_blocks
+struct fs_freed {
+	int start;
+	int length;
+	int delay;   // further commits to wait after that one
+};
+
+struct fs_freed_list {
+	struct fs_freed *extents;
+	int count;
 	int size;
-	int direct[POINTERS_PER_INODE];
-	int indirect;
 };
 
 union fs_block {
 	struct fs_superblock super;
 	struct fs_inode inode[INODES_PER_BLOCK];
 	int pointers[POINTERS_PER_BLOCK];
+	struct fs_extent extents[EXTENTS_PER_BLOCK];
+	struct fs_dirheader dirheader;
+	struct fs_dirblock dir;
 	char data[DISK_BLOCK_SIZE];
 };
 
 
+#define READAHEAD_SLOTS 64
+
+// where one inode's sequential reader is, see readahead()
+struct readahead {
+	int inumber;
+	int64_t next_offset; // where a sequential reader would read next
+	int window;       // blocks to keep fetched ahead, 0 if not streaming
+	int fetched;      // logical blocks below this are already prefetched
+};
+
+#define DELALLOC_SLOTS  16
+#define DELALLOC_BLOCKS 1024 // most one file holds back before it is flushed
+#define DELALLOC_META   8    // indirect or extent blocks one flush may add
+
+// appends to one file held back in memory, see delalloc_write()
+struct delalloc {
+	int inumber;      // 0 if the slot is free
+	int64_t offset;   // where data goes in the file
+	int length;
+	int reserved;     // blocks set aside for it, see delalloc_reserve()
+	char *data;       // DELALLOC_BLOCKS blocks, kept for the next file
+};
+
+// Everything one mounted filesystem needs. Each fs_t works through its
+// own cache and disk, so any number of images can be served from one
+// process; the fs_* calls without a handle use a default one on top of the
+// default cache.
+struct fs {
+	cache_t *cache;
+	disk_t *disk;
+	bool owned;       // opened by fs_open, which also opened the cache and disk
+
+	bool mounted;
+	struct fs_superblock super; // in-memory copy while mounted
+
+	// FREE BLOCK BITMAP
+	struct bitmap bitmap; // ONE BIT PER BLOCK, 1 if used 0 if unused
+	// Loaded from disk on a clean mount, rebuilt by scanning the inodes otherwise
+
+	// FREE INODE BITMAP
+	struct bitmap inodemap; // ONE BIT PER INODE, 1 if valid, inode 0 is never handed out
+
+	// IN-MEMORY INODE TABLE
+	// Each inode block is copied in here the first time one of its inodes is
+	// needed and stays for as long as the disk is mounted, so finding an inode
+	// costs no disk access after that. Changes are written straight through to
+	// the inode block in the cache with inode_put.
+	char *inodes;        // the inode blocks back to back, see inode_at
+	bool *inodes_loaded; // one flag per inode block
+
+	// LOCKING
+	// fs_create, fs_delete, fs_getsize, fs_read and fs_write may be called
+	// from any number of threads while the disk is mounted; formatting,
+	// mounting, unmounting and fs_debug must not overlap anything else.
+	// Every inode hashes onto one of INODE_LOCKS reader/writer locks, taken
+	// shared to look at the inode and its blocks and exclusive to change them.
+	// The two bitmaps have a mutex of their own that is held only for the
+	// moment it takes to claim or release bits, and the inode table one that
+	// is held while an inode block is first copied in.
+	pthread_rwlock_t inode_locks[INODE_LOCKS];
+	pthread_mutex_t alloc_lock;
+	pthread_mutex_t table_lock;
+
+	struct readahead readahead[READAHEAD_SLOTS];
+	pthread_mutex_t readahead_lock; // covers readahead
+
+	// Which file each slot belongs to is covered by delalloc_lock, what it
+	// holds by that file's inode lock. delalloc_used counts the slots
+	// taken and is read without the lock as a hint.
+	struct delalloc delalloc[DELALLOC_SLOTS];
+	int delalloc_used;
+	pthread_mutex_t delalloc_lock;
+
+	// JOURNAL
+	// On a disk formatted with one, the metadata blocks an operation changes
+	// are logged to the journal instead of written in place, see meta_write,
+	// and a crash costs a replay instead of a scan. The bitmaps are logged
+	// from memory when a transaction is committed: bitmapdirty has one bit
+	// per on-disk bitmap block (the block bitmap's, then the inode bitmap's)
+	// changed since the last commit. Freed blocks stay taken in memory until
+	// the transaction that frees them is durable, or they could be written
+	// over while a crash would still bring back the file they belonged to.
+	// All three are covered by alloc_lock.
+	journal_t *journal;
+	struct bitmap bitmapdirty;
+	struct fs_freed_list freeing; // freed by the running transaction
+	struct fs_freed_list freed;   // freed by committed ones, still waiting
+
+	// NAMES
+	// Taken shared to look names up and exclusive to change them, before
+	// the directory inode's own lock.
+	pthread_rwlock_t dir_lock;
+
+	struct histogram stats[FS_STATS];
+};
+
+// the filesystem behind the fs_* calls that don't take one
+static fs_t *default_fs = 0;
+
+static pthread_rwlock_t *inode_lock( fs_t *fs, int inumber )
+{
+	return &fs->inode_locks[(unsigned)inumber % INODE_LOCKS];
+}
+
+// see DELAYED ALLOCATION, next to fs_write_r
+static void delalloc_flush_all( fs_t *fs );
+static void delalloc_drop( fs_t *fs, int inumber );
+static int64_t delalloc_end( fs_t *fs, int inumber );
+
+// see NAMES, next to fs_lookup_r
+static void dir_forget( fs_t *fs, int inumber );
+
 //////////// FUNCTIONS /////////////
 
-int fs_format()
+// how many bytes each inode takes on a disk with these features
+static int inode_bytes( int features )
+{
+	return (features & FS_FEATURE_INLINE) ? INLINE_INODE_SIZE : (int)sizeof(struct fs_inode);
+}
+
+static int inodes_per_block( int features )
+{
+	return DISK_BLOCK_SIZE / inode_bytes(features);
+}
+
+// the i-th inode of a run of them, such as an inode block or the table
+static struct fs_inode *inode_at( int features, void *inodes, int i )
+{
+	return (struct fs_inode *)((char *)inodes + (size_t)i*inode_bytes(features));
+}
+
+// whether an inode keeps its data in itself, see FS_FEATURE_INLINE
+static bool is_inline( int features, const struct fs_inode *inode )
+{
+	return (features & FS_FEATURE_INLINE) && (((const struct fs_inline_inode *)inode)->flags & INODE_INLINE);
+}
+
+static void set_inline( struct fs_inode *inode, bool on )
+{
+	((struct fs_inline_inode *)inode)->flags = on ? INODE_INLINE : 0;
+}
+
+// where an inline file's data starts, INLINE_MAX bytes of it
+static char *inline_data( struct fs_inode *inode )
+{
+	return (char *)inode->direct;
+}
+
+static int64_t size_with( int features, const struct fs_inode *inode )
+{
+	if(is_inline(features,inode)){
+		return inode->size;
+	}
+	if(features & FS_FEATURE_EXTENTS){
+		return (uint32_t)inode->size | (int64_t)inode->extsizehigh << 32;
+	}
+	if(features & FS_FEATURE_LARGEFILE){
+		return (uint32_t)inode->size | (int64_t)inode->sizehigh << 32;
+	}
+	return inode->size;
+}
+
+static int64_t inode_size( fs_t *fs, const struct fs_inode *inode )
+{
+	return size_with(fs->super.features,inode);
+}
+
+static void inode_set_size( fs_t *fs, struct fs_inode *inode, int64_t size )
+{
+	inode->size = (int)size;
+	if(is_inline(fs->super.features,inode)){
+		return; // the rest is data
+	}
+	if(fs->super.features & FS_FEATURE_EXTENTS){
+		inode->extsizehigh = size >> 32;
+	} else if(fs->super.features & FS_FEATURE_LARGEFILE){
+		inode->sizehigh = size >> 32;
+	}
+}
+
+// the k-th extent of an inode, past the first two it lives in the extent
+// block, which the caller has already read into extents
+static struct fs_extent *extent_ref( struct fs_inode *inode, union fs_block *extents, int k )
+{
+	if(k < EXTENTS_PER_INODE){
+		return &inode->extent[k];
+	}
+	return &extents->extents[k-EXTENTS_PER_INODE];
+}
+
+int fs_format_r( fs_t *fs )
+{
+	return fs_format_with_r(fs,FS_FEATURE_LARGEFILE);
+}
+
+int fs_format_with_r( fs_t *fs, int features )
 {
-	if(ISMOUNT){
+	disk_trace_tag(FS_CALL_FORMAT);
+	if(fs->mounted){
 		printf("Disk already mounted. Please de-mount before attempting to format.\n");
 		return 0;
 	}
 
-	int nblocks = disk_size();
+	int nblocks = disk_size_r(fs->disk);
 	/*if((nblocks % 10) != 0){
 		ninodeblocks = (nblocks/10)+1;
 	} else{
@@ -62,443 +405,3487 @@ int fs_format()
 	}*/
 	
 	int ninodeblocks = ceil(nblocks/10);
+	int ninodes = ninodeblocks*inodes_per_block(features);
+	int nbitmapblocks = (nblocks + BITS_PER_BLOCK-1) / BITS_PER_BLOCK;
+	int ninodebitmapblocks = (ninodes + BITS_PER_BLOCK-1) / BITS_PER_BLOCK;
+	int journalstart = 1 + ninodeblocks + nbitmapblocks + ninodebitmapblocks;
+
+	// disks too small to spare an eighth of themselves go without a journal
+	int njournalblocks = journal_size(nbitmapblocks+ninodebitmapblocks);
+	if(njournalblocks > nblocks/8){
+		njournalblocks = 0;
+	}
+	int firstdata = journalstart + njournalblocks;
 
-	union fs_block block;
+	if(firstdata >= nblocks){
+		printf("Error: disk too small to format\n");
+		return 0;
+	}
 
-	int nodesToZero;
-	disk_read(0,block.data);
-	nodesToZero = block.super.ninodeblocks;
+	union fs_block block;
 
+	memset(block.data,0,DISK_BLOCK_SIZE);
 	block.super.magic = FS_MAGIC;
 	block.super.nblocks = nblocks;
 	block.super.ninodeblocks = ninodeblocks;
-	block.super.ninodes = ninodeblocks*INODES_PER_BLOCK;
-
-	disk_write(0,block.data);
-
-	int i,j,k; // sets all the inode valid bits to 0
-	for(i = 1; i <= nodesToZero; i++){
-		for(j = 0; j < INODES_PER_BLOCK; j++){
-			if(i > 1 || (j !=0 && i == 1)){
-				block.inode[j].isvalid = 0;
-				block.inode[j].size = 0;
-				for(k = 0; k < POINTERS_PER_INODE; k++){
-					block.inode[j].direct[k] = 0;
-				}
-				block.inode[j].indirect = 0;
-			}
+	block.super.ninodes = ninodes;
+	block.super.bitmapstart = 1 + ninodeblocks;
+	block.super.nbitmapblocks = nbitmapblocks;
+	block.super.state = FS_STATE_CLEAN;
+	block.super.features = features;
+	block.super.inodebitmapstart = 1 + ninodeblocks + nbitmapblocks;
+	block.super.ninodebitmapblocks = ninodebitmapblocks;
+	block.super.journalstart = njournalblocks ? journalstart : 0;
+	block.super.njournalblocks = njournalblocks;
+
+	cache_write_r(fs->cache,0,block.data);
+
+	// sets all the inode valid bits to 0, by punching the table out of the
+	// image where it can be, and everything past the metadata goes too
+	int i,j;
+	memset(block.data,0,DISK_BLOCK_SIZE);
+	if(!cache_discard_r(fs->cache,1,ninodeblocks)){
+		for(i = 1; i <= ninodeblocks; i++){
+			cache_write_r(fs->cache,i,block.data);
+		}
+	}
+	cache_discard_r(fs->cache,firstdata,nblocks-firstdata);
+
+	// the superblock, inode table and bitmaps themselves are the only used blocks
+	for(i = 0; i < nbitmapblocks; i++){
+		memset(block.data,0,DISK_BLOCK_SIZE);
+		for(j = i*BITS_PER_BLOCK; j < (i+1)*BITS_PER_BLOCK && j < firstdata; j++){
+			block.data[(j%BITS_PER_BLOCK)/8] |= 1 << (j%8);
 		}
-		disk_write(i,block.data);
+		cache_write_r(fs->cache,1+ninodeblocks+i,block.data);
+	}
+
+	// and inode 0, which is never handed out
+	memset(block.data,0,DISK_BLOCK_SIZE);
+	block.data[0] = 1;
+	for(i = 0; i < ninodebitmapblocks; i++){
+		cache_write_r(fs->cache,1+ninodeblocks+nbitmapblocks+i,block.data);
+		block.data[0] = 0;
+	}
+
+	if(njournalblocks > 0){
+		journal_format(fs->cache,journalstart,njournalblocks);
 	}
 
 	return 1;
 }
 
-void fs_debug()
+// Full scans of the inode table are split across a pool of threads. Each
+// worker owns a contiguous range of inode blocks, reads them straight from
+// the disk with positional reads, and collects its findings privately: a
+// partial bitmap of the blocks its inodes use and/or the fs_debug text for
+// them. The caller merges the results in order once everyone is done.
+
+static int SCAN_THREADS = 0; // 0 means one per online CPU
+
+struct scan_range {
+	pthread_t thread;
+	disk_t *disk;         // read directly, scan_inodes flushes the cache first
+	int first;            // first inode block owned by this worker
+	int last;             // last one, inclusive
+	int features;         // how the inodes map their data
+	bool use_bitmap;
+	struct bitmap used;   // blocks referenced from this range
+	struct bitmap valid;  // inodes in use in this range
+	FILE *out;            // fs_debug output for this range, if wanted
+	char *text;
+	size_t textlen;
+	int tag;              // the call the scan is for, for disk traces
+};
+
+void fs_set_scan_threads( int n )
 {
-	union fs_block block;
-	
-	disk_read(0,block.data);
-	printf("superblock:\n");
+	SCAN_THREADS = n;
+}
 
-	if(block.super.magic == FS_MAGIC){
-		printf("    magic number is valid\n");
-	} else{
-		printf("    magic number is not valid\n");
-		return;
+// the extent-mapped half of scan_worker
+static void scan_extents( struct scan_range *r, struct fs_inode *inode, union fs_block *tmp_block )
+{
+	int k, b;
+	int n = inode->nextents;
+	if(n > MAX_EXTENTS){
+		n = MAX_EXTENTS;
 	}
 
-	printf("    %d blocks\n",block.super.nblocks);
-	printf("    %d blocks for inodes\n",block.super.ninodeblocks);
-	printf("    %d inodes total\n",block.super.ninodes);
-
-	int i = 0;
-	int j = 0;
-	int k = 0;
-	union fs_block it_block;
-	union fs_block tmp_block;
+	if(n > EXTENTS_PER_INODE && inode->extentblock > 0){
+		disk_read_r(r->disk,inode->extentblock,tmp_block->data);
+	}
 
-	// INODE HANDLER //
-	for(i = 1; i <= block.super.ninodeblocks; i++){ // Iterates through all inode blocks
-		disk_read(i,it_block.data);
-		for(j = 0; j < INODES_PER_BLOCK; j++){ // scans 128 inodes per block
-			if(it_block.inode[j].isvalid == 1){
-				printf("inode %d:\n",j+((i-1)*INODES_PER_BLOCK)); // check this
-				printf("    size: %d bytes\n",it_block.inode[j].size);
-				printf("    direct blocks:");
-				// ceiling of (size / 4096) is the limit rather than 5, print all direct blocks
-				for(k = 0; k < POINTERS_PER_INODE; k++){ // direct blocks
-					if(it_block.inode[j].direct[k] > 0){ // CHANGE THIS
-						printf(" %d",it_block.inode[j].direct[k]);
-					}
-				}
-				printf("\n");
-				if(it_block.inode[j].indirect > 0){ // indirect block
-					printf("    indirect block: %d\n",it_block.inode[j].indirect);
-					disk_read(it_block.inode[j].indirect,tmp_block.data);
-					printf("    indirect data blocks:");
-					for(k = 0; k < POINTERS_PER_BLOCK; k++){
-						if(tmp_block.pointers[k] > 0){ // THEY ARE ALL 0
-							printf(" %d",tmp_block.pointers[k]);
-						}
-					}
-					printf("\n");
-				}
+	if(r->out) fprintf(r->out,"    extents:");
+	for(k = 0; k < n; k++){
+		if(k >= EXTENTS_PER_INODE && inode->extentblock <= 0){
+			break;
+		}
+		struct fs_extent *ext = extent_ref(inode,tmp_block,k);
+		if(r->out) fprintf(r->out," %d+%d",ext->start,ext->length);
+		if(r->use_bitmap && ext->start > 0){
+			for(b = ext->start; b < ext->start+ext->length; b++){
+				bitmap_set(&r->used,b);
 			}
 		}
 	}
-}
+	if(r->out) fprintf(r->out,"\n");
 
-int fs_mount()
-{
-	if(ISMOUNT == true){ //     UNCOMMENT THIS WE NEED IT DON'T FORGET TO UNCOMMENT THIS WE NEED IT
-		printf("Error: disk already mounted\n");
-		return 0;
+	if(inode->extentblock > 0){
+		if(r->out) fprintf(r->out,"    extent block: %d\n",inode->extentblock);
+		if(r->use_bitmap) bitmap_set(&r->used,inode->extentblock);
 	}
+}
 
+// the blocks under an indirect block of the given depth, 1 for a single
+// indirect block
+static void scan_tree( struct scan_range *r, int blocknum, int depth )
+{
 	union fs_block block;
-	union fs_block it_block;
-	union fs_block tmp_block;
+	int k;
 
-	disk_read(0,block.data);
-	if(block.super.magic != FS_MAGIC){
-		printf("Error: Not a valid filesystem, failed to mount.\n");
-		return 0;
+	if(r->use_bitmap) bitmap_set(&r->used,blocknum);
+	disk_read_r(r->disk,blocknum,block.data);
+	for(k = 0; k < POINTERS_PER_BLOCK; k++){
+		if(block.pointers[k] <= 0){
+			continue;
+		}
+		if(depth > 1){
+			scan_tree(r,block.pointers[k],depth-1);
+		} else{
+			if(r->out) fprintf(r->out," %d",block.pointers[k]);
+			if(r->use_bitmap) bitmap_set(&r->used,block.pointers[k]);
+		}
 	}
-	int ninodes = block.super.ninodeblocks;
-	NUM_BLOCKS = block.super.nblocks;
-	bitmap = (int *) malloc(sizeof(int)*block.super.nblocks); // WHAT IF WE DEMOUNT? NEEDS TO BE 
-	//FREED
-	int i, j, k;
-	for(i = 0; i < ninodes+1; i++){
-		bitmap[i] = 1;
-	}
-	for(i = 1; i <= block.super.ninodeblocks; i++){ // Iterates through all inode blocks
-		disk_read(i,it_block.data);
-		for(j = 0; j< INODES_PER_BLOCK; j++){ // scans 128 inodes per block
-			if(it_block.inode[j].isvalid ==1){ // if there is a valid inode in a block
-				bitmap[i] = i;
-				for(k = 0; k < POINTERS_PER_INODE; k++){ // direct blocks
-					if(it_block.inode[j].direct[k] > 0){ // CHANGE THIS
-						bitmap[it_block.inode[j].direct[k]] = it_block.inode[j].direct[k];
-					}
-				}
+}
 
-				if(it_block.inode[j].indirect > 0){ // indirect block
-					bitmap[it_block.inode[j].indirect] = it_block.inode[j].indirect;
-					disk_read(it_block.inode[j].indirect,tmp_block.data);
-					for(k = 0; k < POINTERS_PER_BLOCK; k++){
-						if(tmp_block.pointers[k] > 0){ // THEY ARE ALL 0
-							bitmap[tmp_block.pointers[k]] = tmp_block.pointers[k];
-						}
-					}
-				}
-			}
+// the FS_FEATURE_LARGEFILE half of scan_worker
+static void scan_large( struct scan_range *r, struct fs_inode *inode )
+{
+	static const char *names[] = { "indirect", "double indirect", "triple indirect" };
+	int roots[] = { inode->lindirect, inode->dindirect, inode->tindirect };
+	int k;
+
+	if(r->out) fprintf(r->out,"    direct blocks:");
+	for(k = 0; k < LARGE_DIRECT; k++){
+		if(inode->ldirect[k] > 0){
+			if(r->out) fprintf(r->out," %d",inode->ldirect[k]);
+			if(r->use_bitmap) bitmap_set(&r->used,inode->ldirect[k]);
 		}
 	}
-	for(i = 0; i < block.super.nblocks; i++){
-		printf(" %d ",bitmap[i]);
+	if(r->out) fprintf(r->out,"\n");
+
+	for(k = 0; k < 3; k++){
+		if(roots[k] > 0){
+			if(r->out) fprintf(r->out,"    %s block: %d\n",names[k],roots[k]);
+			if(r->out) fprintf(r->out,"    %s data blocks:",names[k]);
+			scan_tree(r,roots[k],k+1);
+			if(r->out) fprintf(r->out,"\n");
+		}
 	}
-	
-	ISMOUNT = true;
-	return 1;
 }
 
-int fs_create()
+static void *scan_worker( void *arg )
 {
-	union fs_block block;
-	disk_read(0,block.data);
-	int ninodeblocks = block.super.ninodeblocks;
-	int i,j;
-	for(i = 1; i <= ninodeblocks; i++){
-		disk_read(i,block.data);
-		for(j = 0; j < INODES_PER_BLOCK; j++){
-			if ( (i > 1) || (i == 1 && j !=0) ) {
-				if(block.inode[j].isvalid == 0){
-					block.inode[j].isvalid = 1;
-					block.inode[j].size = 0;
-					disk_write(i,block.data);
-					return ((i-1)*INODES_PER_BLOCK)+j;
+	struct scan_range *r = arg;
+	union fs_block it_block;
+	union fs_block tmp_block;
+	int i, j, k;
+	int perblock = inodes_per_block(r->features);
+
+	disk_trace_tag(r->tag);
+
+	for(i = r->first; i <= r->last; i++){ // Iterates through this worker's inode blocks
+		disk_read_r(r->disk,i,it_block.data);
+		for(j = 0; j < perblock; j++){ // scans 128 inodes per block, 32 if they are inline ones
+			struct fs_inode *inode = inode_at(r->features,it_block.data,j);
+			if(inode->isvalid != 1){
+				continue;
+			}
+
+			if(r->use_bitmap){
+				bitmap_set(&r->valid,j+((i-1)*perblock));
+			}
+			if(r->out){
+				fprintf(r->out,"inode %d:\n",j+((i-1)*perblock));
+				fprintf(r->out,"    size: %lld bytes\n",(long long)size_with(r->features,inode));
+			}
+			if(is_inline(r->features,inode)){
+				if(r->out) fprintf(r->out,"    data inline\n");
+				continue;
+			}
+			if(r->features & FS_FEATURE_EXTENTS){
+				scan_extents(r,inode,&tmp_block);
+				continue;
+			}
+			if(r->features & FS_FEATURE_LARGEFILE){
+				scan_large(r,inode);
+				continue;
+			}
+
+			if(r->out) fprintf(r->out,"    direct blocks:");
+			for(k = 0; k < POINTERS_PER_INODE; k++){ // direct blocks
+				if(inode->direct[k] > 0){
+					if(r->out) fprintf(r->out," %d",inode->direct[k]);
+					if(r->use_bitmap) bitmap_set(&r->used,inode->direct[k]);
 				}
 			}
+			if(r->out) fprintf(r->out,"\n");
+
+			if(inode->indirect > 0){ // indirect block
+				if(r->out) fprintf(r->out,"    indirect block: %d\n",inode->indirect);
+				if(r->use_bitmap) bitmap_set(&r->used,inode->indirect);
+				disk_read_r(r->disk,inode->indirect,tmp_block.data);
+				if(r->out) fprintf(r->out,"    indirect data blocks:");
+				for(k = 0; k < POINTERS_PER_BLOCK; k++){
+					if(tmp_block.pointers[k] > 0){
+						if(r->out) fprintf(r->out," %d",tmp_block.pointers[k]);
+						if(r->use_bitmap) bitmap_set(&r->used,tmp_block.pointers[k]);
+					}
+				}
+				if(r->out) fprintf(r->out,"\n");
+			}
 		}
 	}
-	printf("Error: no space in inode blocks\n");
+
 	return 0;
 }
 
-int fs_delete( int inumber )
+// scans inode blocks 1..ninodeblocks, merging the blocks they use into
+// used and the inodes in use into valid (if given), and printing them
+// fs_debug style (if describe is set)
+static int scan_inodes( fs_t *fs, int ninodeblocks, int nblocks, int features, struct bitmap *used, struct bitmap *valid, bool describe )
 {
-	union fs_block block;
-	int numInBlock = inumber%INODES_PER_BLOCK;
-	int numBlock = floor(inumber/INODES_PER_BLOCK)+1;
-	disk_read(numBlock,block.data);
-
-	if(block.inode[numInBlock].isvalid == 0)
-	{
-		return 0;
+	int nthreads = SCAN_THREADS;
+	if(nthreads <= 0){
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if(nthreads > ninodeblocks){
+		nthreads = ninodeblocks;
+	}
+	if(nthreads < 1){
+		nthreads = 1;
 	}
 
-	block.inode[numInBlock].isvalid = 0;
-	block.inode[numInBlock].size = 0;
+	// the workers bypass the cache, so anything dirty in it has to go first
+	cache_flush_r(fs->cache);
 
-	int k;
+	struct scan_range *ranges = calloc(nthreads,sizeof(struct scan_range));
+	if(!ranges){
+		printf("Error: not enough memory to scan the inode table\n");
+		return 0;
+	}
 
-	for(k = 0; k < POINTERS_PER_INODE; k++){
-		if(block.inode[numInBlock].direct[k] > 0){
-			bitmap[block.inode[numInBlock].direct[k]] = 0;
-			block.inode[numInBlock].direct[k] = 0; // direct blocks to 0
+	int t;
+	int first = 1;
+	int ok = 1;
+	for(t = 0; t < nthreads; t++){
+		int count = ninodeblocks/nthreads + (t < ninodeblocks%nthreads ? 1 : 0);
+		ranges[t].first = first;
+		ranges[t].last = first+count-1;
+		ranges[t].features = features;
+		ranges[t].disk = fs->disk;
+		ranges[t].tag = describe ? FS_CALL_DEBUG : FS_CALL_MOUNT;
+		first += count;
+
+		if(used){
+			ranges[t].use_bitmap = true;
+			if(!bitmap_init(&ranges[t].used,nblocks)) ok = 0;
+			if(!bitmap_init(&ranges[t].valid,ninodeblocks*inodes_per_block(features))) ok = 0;
+		}
+		if(describe){
+			ranges[t].out = open_memstream(&ranges[t].text,&ranges[t].textlen);
+			if(!ranges[t].out) ok = 0;
 		}
 	}
-	
-	if(block.inode[numInBlock].indirect > 0){
-		union fs_block indirect;
-		disk_read(block.inode[numInBlock].indirect,indirect.data);
-		for(k = 0; k < POINTERS_PER_BLOCK; k++){
-			if( indirect.pointers[k] > 0 ){
-				bitmap[indirect.pointers[k]] = 0;
-				indirect.pointers[k] = 0;
+
+	if(ok){
+		// the calling thread takes the first range itself
+		for(t = 1; t < nthreads; t++){
+			if(pthread_create(&ranges[t].thread,0,scan_worker,&ranges[t]) != 0){
+				scan_worker(&ranges[t]); // couldn't get a thread, do it here
+				ranges[t].thread = 0;
 			}
 		}
+		scan_worker(&ranges[0]);
+		for(t = 1; t < nthreads; t++){
+			if(ranges[t].thread) pthread_join(ranges[t].thread,0);
+		}
+	} else{
+		printf("Error: not enough memory to scan the inode table\n");
 	}
 
-	block.inode[numInBlock].indirect = 0; // indirect blocks to 0
-	disk_write(numBlock,block.data);
-
-	return 1;
-	// fix the bitmap???
+	for(t = 0; t < nthreads; t++){
+		if(ranges[t].use_bitmap){
+			if(ok) bitmap_merge(used,&ranges[t].used);
+			if(ok) bitmap_merge(valid,&ranges[t].valid);
+			bitmap_free(&ranges[t].used);
+			bitmap_free(&ranges[t].valid);
+		}
+		if(ranges[t].out){
+			fclose(ranges[t].out);
+			if(ok) fwrite(ranges[t].text,1,ranges[t].textlen,stdout);
+			free(ranges[t].text);
+		}
+	}
+	free(ranges);
 
+	return ok;
 }
 
-int fs_getsize( int inumber )
+void fs_debug_r( fs_t *fs )
 {
 	union fs_block block;
-	int numInBlock = inumber%INODES_PER_BLOCK;
-	int numBlock = floor(inumber/INODES_PER_BLOCK)+1;
-	disk_read(numBlock,block.data);
-	if(block.inode[numInBlock].size >= 0){
-		return block.inode[numInBlock].size;
+
+	disk_trace_tag(FS_CALL_DEBUG);
+	cache_read_r(fs->cache,0,block.data);
+	printf("superblock:\n");
+
+	if(block.super.magic == FS_MAGIC || block.super.magic == FS_MAGIC_V1){
+		printf("    magic number is valid\n");
 	} else{
-		return -1;
+		printf("    magic number is not valid\n");
+		return;
+	}
+
+	printf("    %d blocks\n",block.super.nblocks);
+	printf("    %d blocks for inodes\n",block.super.ninodeblocks);
+	printf("    %d inodes total\n",block.super.ninodes);
+	int features = 0; // the rest of a V1 superblock is garbage
+	if(block.super.magic == FS_MAGIC){
+		printf("    %d blocks for the free block bitmap\n",block.super.nbitmapblocks);
+		if(block.super.ninodebitmapblocks > 0){
+			printf("    %d blocks for the free inode bitmap\n",block.super.ninodebitmapblocks);
+		}
+		if(block.super.njournalblocks > 0){
+			printf("    %d blocks for the journal\n",block.super.njournalblocks);
+		}
+		printf("    state: %s\n",block.super.state == FS_STATE_CLEAN ? "clean" : "dirty");
+		if(block.super.features & FS_FEATURE_EXTENTS){
+			printf("    inodes use extents\n");
+		} else if(block.super.features & FS_FEATURE_LARGEFILE){
+			printf("    inodes have double and triple indirect blocks\n");
+		}
+		if(block.super.features & FS_FEATURE_INLINE){
+			printf("    inodes hold files of up to %d bytes inline\n",INLINE_MAX);
+		}
+		if(block.super.ninodebitmapblocks > 0 && block.super.dirinode > 0){
+			printf("    names are kept in inode %d\n",block.super.dirinode);
+		}
+		features = block.super.features;
 	}
+
+	scan_inodes(fs,block.super.ninodeblocks,block.super.nblocks,features,0,0,true);
 }
 
-int fs_read( int inumber, char *data, int length, int offset )
+// copies on-disk bitmap blocks into an in-memory bitmap, or back out
+static void fs_load_bitmap( fs_t *fs, struct bitmap *map, int start, int nblocks )
 {
-	if(ISMOUNT==false){return 0;}
 	union fs_block block;
-	int numInBlock = inumber%INODES_PER_BLOCK;
-	int numBlock = floor(inumber/INODES_PER_BLOCK)+1;
-	disk_read(numBlock,block.data);
-
-	if(block.inode[numInBlock].isvalid == 0){
-		return 0;
+	int i;
+	for(i = 0; i < nblocks; i++){
+		cache_read_r(fs->cache,start+i,block.data);
+		int bytes = (map->nwords*8) - i*DISK_BLOCK_SIZE;
+		memcpy((char *)map->words + i*DISK_BLOCK_SIZE,block.data,bytes < DISK_BLOCK_SIZE ? bytes : DISK_BLOCK_SIZE);
 	}
+	for(i = map->nbits; i < map->nwords*64; i++){
+		map->words[i/64] |= (uint64_t)1 << (i%64); // keep the padding past the end marked used
+	}
+	bitmap_recount(map);
+}
 
-	int bytes_Copied = 0;
-	int bytes_Traversed = 0;
-	int i,j;
-
-	for(i=0;i<POINTERS_PER_INODE;i++){
-		if(block.inode[numInBlock].direct[i] > 0){ // if there is a valid direct pointer
-
-			union fs_block direct;
-			disk_read(block.inode[numInBlock].direct[i],direct.data); // read in the direct block
+// the i-th on-disk block of an in-memory bitmap
+static void bitmap_block( struct bitmap *map, int i, char *data )
+{
+	int bytes = (map->nwords*8) - i*DISK_BLOCK_SIZE;
+	memset(data,0,DISK_BLOCK_SIZE);
+	memcpy(data,(char *)map->words + i*DISK_BLOCK_SIZE,bytes < DISK_BLOCK_SIZE ? bytes : DISK_BLOCK_SIZE);
+}
 
-			for(j=0;j<DISK_BLOCK_SIZE;j++){ // for every data byte
-				if(bytes_Traversed >= offset){
-					data[bytes_Copied] = direct.data[j]; // copy the data into data[]
-					bytes_Copied++; // increment the number of bytes Copied
-					bytes_Traversed++;
+static void fs_store_bitmap( fs_t *fs, struct bitmap *map, int start, int nblocks )
+{
+	union fs_block block;
+	int i;
+	for(i = 0; i < nblocks; i++){
+		bitmap_block(map,i,block.data);
+		cache_write_r(fs->cache,start+i,block.data);
+	}
+}
 
-					if(bytes_Copied == length){ // if we have copied the length requested, return
-						return bytes_Copied;
-					}
-				} else{
-					bytes_Traversed++;
-				}
-			}
-		}
+// Metadata blocks are read and written through these. With a journal a
+// changed block goes into the running transaction, and is read back from
+// there until the commit has handed it on to the cache.
+static void meta_read( fs_t *fs, int blocknum, char *data )
+{
+	if(!fs->journal || !journal_lookup(fs->journal,blocknum,data)){
+		cache_read_r(fs->cache,blocknum,data);
 	}
+}
 
-	if(block.inode[numInBlock].indirect > 0){ // if there is a valid indirect block
+static void meta_write( fs_t *fs, int blocknum, const char *data )
+{
+	if(fs->journal){
+		journal_log(fs->journal,blocknum,data);
+	} else{
+		cache_write_r(fs->cache,blocknum,data);
+	}
+}
 
-		union fs_block indirect;
-		disk_read(block.inode[numInBlock].indirect,indirect.data); // open that indirect block
+// notes that bits first..first+count-1 of one of the bitmaps changed, so
+// the blocks holding them go into the next transaction (under alloc_lock)
+static void bitmap_changed( fs_t *fs, struct bitmap *map, int first, int count )
+{
+	if(!fs->journal || first < 0 || count <= 0){
+		return;
+	}
+	int base = (map == &fs->inodemap) ? fs->super.nbitmapblocks : 0;
+	int b;
+	for(b = first/BITS_PER_BLOCK; b <= (first+count-1)/BITS_PER_BLOCK; b++){
+		bitmap_set(&fs->bitmapdirty,base+b);
+	}
+}
 
-		for(i=0;i<POINTERS_PER_BLOCK;i++){
-			if(indirect.pointers[i] > 0){ // if there is a valid indirect pointer
+// records how far the last search of map went (under alloc_lock)
+static void note_scan( fs_t *fs, const struct bitmap *map )
+{
+	if(__atomic_load_n(&stats_on,__ATOMIC_RELAXED)){
+		histogram_add(&fs->stats[map == &fs->inodemap ? FS_STAT_INODE_SCAN : FS_STAT_BLOCK_SCAN],map->scanned,0);
+	}
+}
 
-				union fs_block indirectData;
-				disk_read(indirect.pointers[i],indirectData.data); // read that data block
+static void freed_append( struct fs_freed_list *list, int start, int count, int delay )
+{
+	struct fs_freed *last = list->count ? &list->extents[list->count-1] : 0;
+	if(last && last->delay == delay && last->start + last->length == start){
+		last->length += count;
+		return;
+	}
+	if(list->count == list->size){
+		int size = list->size ? list->size*2 : 64;
+		struct fs_freed *extents = realloc(list->extents,sizeof(struct fs_freed)*size);
+		if(!extents){
+			printf("ERROR: out of memory for the list of freed blocks\n");
+			abort();
+		}
+		list->extents = extents;
+		list->size = size;
+	}
+	list->extents[list->count].start = start;
+	list->extents[list->count].length = count;
+	list->extents[list->count].delay = delay;
+	list->count++;
+}
 
-				for(j = 0; j < DISK_BLOCK_SIZE; j++){
-					if(bytes_Traversed >= offset){
-						data[bytes_Copied] = indirectData.data[j];
-						bytes_Copied++;
-						bytes_Traversed++;
+// Hands count blocks from start back to the allocator (under alloc_lock).
+// With a journal, data blocks become free once the transaction freeing
+// them is durable, and metadata blocks (indirect and extent blocks) two
+// commits later, when no copy of them is left in the journal to replay.
+// Without one they become free when the operation freeing them calls
+// settle_frees. Either way they are discarded on the way, see
+// release_blocks, and neighbouring blocks freed together make one extent.
+static void free_blocks( fs_t *fs, int start, int count, bool metadata )
+{
+	if(!fs->journal){
+		freed_append(&fs->freeing,start,count,0);
+		return;
+	}
+	freed_append(&fs->freeing,start,count,metadata ? 2 : 0);
+	bitmap_changed(fs,&fs->bitmap,start,count);
+}
 
-						if(bytes_Copied == length){
-							return bytes_Copied;
-						}
-					} else{
-						bytes_Traversed++;
-					}
-				}
-			}
-		}
+// Discards freed extents on the disk, so the image doesn't keep what was
+// in them, and only then clears them in the bitmap; nobody can have
+// allocated them again in the meantime. Called without alloc_lock.
+static void release_blocks( fs_t *fs, const struct fs_freed *extents, int count )
+{
+	int k;
+	for(k = 0; k < count; k++){
+		cache_discard_r(fs->cache,extents[k].start,extents[k].length);
 	}
-	return bytes_Copied;
+	pthread_mutex_lock(&fs->alloc_lock);
+	for(k = 0; k < count; k++){
+		bitmap_clear_range(&fs->bitmap,extents[k].start,extents[k].length);
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
 }
 
-int fs_write( int inumber, const char *data, int length, int offset )
+// whether any freed blocks are still waiting for a commit
+static bool frees_pending( fs_t *fs )
 {
+	pthread_mutex_lock(&fs->alloc_lock);
+	bool pending = fs->freeing.count > 0 || fs->freed.count > 0;
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return pending;
+}
 
-	if(ISMOUNT == false){return 0;}
+// Lets every freed block go at once: without a journal after each
+// operation that frees some, with one when it is closed.
+static void settle_frees( fs_t *fs )
+{
+	struct fs_freed_list freed, freeing;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	freed = fs->freed;
+	freeing = fs->freeing;
+	memset(&fs->freed,0,sizeof(fs->freed));
+	memset(&fs->freeing,0,sizeof(fs->freeing));
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	release_blocks(fs,freed.extents,freed.count);
+	release_blocks(fs,freeing.extents,freeing.count);
+	free(freed.extents);
+	free(freeing.extents);
+}
 
+// Journal hook, runs with no operation in progress just before a
+// transaction is closed: logs the bitmap blocks it changed, with every
+// block freed so far shown free.
+static void journal_prepare( void *arg )
+{
+	fs_t *fs = arg;
 	union fs_block block;
+	int i, k;
 
-	int numInBlock = inumber%INODES_PER_BLOCK;
-	int numBlock = floor(inumber/INODES_PER_BLOCK)+1;
-	disk_read(numBlock,block.data);
-	
-	// printf("Reading the %dth element in block %d\n",numInBlock,numBlock);/////@@@@@
+	pthread_mutex_lock(&fs->alloc_lock);
 
-	if(block.inode[numInBlock].isvalid == 0){
-		printf("Failed to write to inode %d: inode not valid\n",inumber);
-		return 0;
+	for(k = 0; k < fs->freeing.count; k++){
+		struct fs_freed *f = &fs->freeing.extents[k];
+		freed_append(&fs->freed,f->start,f->length,f->delay);
 	}
+	fs->freeing.count = 0;
 
-	int bytes_Written = 0;
-	int bytes_Traversed = 0;
-	int i,j,newBlock;
-	bool found_block;
-
-
-	/* DIRECT */
-	for(i = 0; i < POINTERS_PER_INODE; i++){ // input data into direct pointers
-		// Finds which block using Direct Pointers to write to
-		// printf("checking direct pointer %d\n",i); ////////@@@@
-		if(block.inode[numInBlock].direct[i] <= 0){ // if direct pointer is invalid
-			// printf("    no pointer for the %dth direct pointer\n",i); ///////@@@@@@@@
-			found_block = false;
-			for(j = 0; j < NUM_BLOCKS; j++){ // check the bitmap for a free block
-				// printf("        checking bitmap element %d\n",j);//////////@@@@@@@@
-				if(bitmap[j] == 0){    // if the block is free
-					// printf("            free block %d found\n",j);
-					newBlock = j;
-					block.inode[numInBlock].direct[i] = newBlock; // sets the direct pointer????????
-					// printf("NEWBLOCK ======= %d\n",newBlock);
-					// printf("            inode %d direct pointer %d set to %d\n",inumber,i,block.inode[numInBlock].direct[i]);///////@@@@@@@
-					found_block = true;
-					bitmap[newBlock] = 1;
-					break;
-				}
+	for(i = 0; i < fs->bitmapdirty.nbits; i++){
+		if(!bitmap_test(&fs->bitmapdirty,i)){
+			continue;
+		}
+		bitmap_clear(&fs->bitmapdirty,i);
+
+		if(i >= fs->super.nbitmapblocks){
+			int b = i - fs->super.nbitmapblocks;
+			bitmap_block(&fs->inodemap,b,block.data);
+			journal_log(fs->journal,fs->super.inodebitmapstart+b,block.data);
+			continue;
+		}
+
+		bitmap_block(&fs->bitmap,i,block.data);
+		int lo = i*BITS_PER_BLOCK, hi = lo+BITS_PER_BLOCK;
+		for(k = 0; k < fs->freed.count; k++){
+			int bit = fs->freed.extents[k].start;
+			int end = bit + fs->freed.extents[k].length;
+			for(bit = (bit > lo) ? bit : lo; bit < end && bit < hi; bit++){
+				block.data[(bit-lo)/8] &= ~(1 << (bit%8));
 			}
-			if(!found_block && (i == 4)){ // makes sure there is space in the bitmap but checks all inodes
-				// printf("        Error: cannot allocate new direct data block, no space\n");
-				break; // No more space for direct blocks, goes to the indirect blocks
-			} else if(!found_block){
-				continue;
+		}
+		journal_log(fs->journal,fs->super.bitmapstart+i,block.data);
+	}
+
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
+
+// Journal hook, runs once a transaction is durable: the frees that were
+// waiting for it take effect.
+static void journal_done( void *arg )
+{
+	fs_t *fs = arg;
+	struct fs_freed_list ripe = { 0, 0, 0 };
+	int k, n = 0;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	for(k = 0; k < fs->freed.count; k++){
+		struct fs_freed *f = &fs->freed.extents[k];
+		if(f->delay == 0){
+			freed_append(&ripe,f->start,f->length,0);
+		} else{
+			f->delay--;
+			fs->freed.extents[n++] = *f;
+		}
+	}
+	fs->freed.count = n;
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	release_blocks(fs,ripe.extents,ripe.count);
+	free(ripe.extents);
+}
+
+// frees everything fs_mount set up
+static void fs_release( fs_t *fs )
+{
+	if(fs->journal){
+		journal_close(fs->journal);
+		fs->journal = 0;
+	}
+	bitmap_free(&fs->bitmap);
+	bitmap_free(&fs->inodemap);
+	bitmap_free(&fs->bitmapdirty);
+	free(fs->freeing.extents);
+	free(fs->freed.extents);
+	memset(&fs->freeing,0,sizeof(fs->freeing));
+	memset(&fs->freed,0,sizeof(fs->freed));
+	free(fs->inodes);
+	free(fs->inodes_loaded);
+	fs->inodes = 0;
+	fs->inodes_loaded = 0;
+	int i;
+	for(i = 0; i < DELALLOC_SLOTS; i++){
+		free(fs->delalloc[i].data);
+	}
+	memset(fs->delalloc,0,sizeof(fs->delalloc));
+	fs->delalloc_used = 0;
+}
+
+int fs_mount_r( fs_t *fs )
+{
+	uint64_t start = stats_start();
+	disk_trace_tag(FS_CALL_MOUNT);
+	if(fs->mounted == true){
+		printf("Error: disk already mounted\n");
+		return 0;
+	}
+
+	union fs_block block;
+
+	cache_read_r(fs->cache,0,block.data);
+	if(block.super.magic != FS_MAGIC && block.super.magic != FS_MAGIC_V1){
+		printf("Error: Not a valid filesystem, failed to mount.\n");
+		return 0;
+	}
+	if(block.super.magic == FS_MAGIC_V1){ // the rest of a V1 superblock is garbage
+		block.super.bitmapstart = 0;
+		block.super.nbitmapblocks = 0;
+		block.super.state = FS_STATE_DIRTY;
+		block.super.features = 0;
+	}
+	if(block.super.magic == FS_MAGIC_V1 || block.super.inodebitmapstart <= 0){
+		block.super.inodebitmapstart = 0;
+		block.super.ninodebitmapblocks = 0;
+		block.super.journalstart = 0;
+		block.super.njournalblocks = 0;
+		block.super.dirinode = 0;
+	}
+	fs->super = block.super;
+
+	// all of this is freed again by fs_unmount
+	bool ok = bitmap_init(&fs->bitmap,fs->super.nblocks);
+	ok = bitmap_init(&fs->inodemap,fs->super.ninodes) && ok;
+	fs->inodes = calloc(fs->super.ninodeblocks,DISK_BLOCK_SIZE);
+	fs->inodes_loaded = calloc(fs->super.ninodeblocks,sizeof(bool));
+	if(!ok || !fs->inodes || !fs->inodes_loaded){
+		printf("Error: not enough memory to mount the disk\n");
+		fs_release(fs);
+		return 0;
+	}
+
+	if(fs->super.njournalblocks > 0){
+		// after a crash, replaying the journal brings every metadata block,
+		// bitmaps included, up to the last commit
+		int reserve = fs->super.nbitmapblocks+fs->super.ninodebitmapblocks;
+		fs->journal = journal_open(fs->cache,fs->super.journalstart,fs->super.njournalblocks,reserve,journal_prepare,journal_done,fs);
+		if(!fs->journal || !bitmap_init(&fs->bitmapdirty,reserve)){
+			printf("Error: cannot open the journal\n");
+			fs_release(fs);
+			return 0;
+		}
+		int replayed = journal_recover(fs->journal,fs->super.state != FS_STATE_CLEAN);
+		if(replayed < 0){
+			fs_release(fs);
+			return 0;
+		}
+		if(replayed > 0){
+			printf("replayed %d transactions from the journal\n",replayed);
+		}
+		// the superblock is logged when the names directory is made
+		cache_read_r(fs->cache,0,block.data);
+		fs->super.dirinode = block.super.dirinode;
+		fs_load_bitmap(fs,&fs->bitmap,fs->super.bitmapstart,fs->super.nbitmapblocks);
+		fs_load_bitmap(fs,&fs->inodemap,fs->super.inodebitmapstart,fs->super.ninodebitmapblocks);
+	} else if(fs->super.magic == FS_MAGIC && fs->super.state == FS_STATE_CLEAN && fs->super.ninodebitmapblocks > 0){
+		fs_load_bitmap(fs,&fs->bitmap,fs->super.bitmapstart,fs->super.nbitmapblocks);
+		fs_load_bitmap(fs,&fs->inodemap,fs->super.inodebitmapstart,fs->super.ninodebitmapblocks);
+	} else{
+		int i;
+		for(i = 0; i < 1+fs->super.ninodeblocks+fs->super.nbitmapblocks+fs->super.ninodebitmapblocks; i++){
+			bitmap_set(&fs->bitmap,i);
+		}
+		bitmap_set(&fs->inodemap,0);
+		if(!scan_inodes(fs,fs->super.ninodeblocks,fs->super.nblocks,fs->super.features,&fs->bitmap,&fs->inodemap,false)){
+			fs_release(fs);
+			return 0;
+		}
+	}
+
+	// until the next clean unmount the on-disk bitmap may go stale, so the
+	// dirty mark has to be durable before anything else reaches the disk
+	if(fs->super.magic == FS_MAGIC){
+		block.super.state = FS_STATE_DIRTY;
+		cache_write_r(fs->cache,0,block.data);
+		cache_flush_r(fs->cache);
+		disk_sync_r(fs->disk);
+	}
+
+	fs->mounted = true;
+	stats_end(&fs->stats[FS_STAT_MOUNT],start,0);
+	return 1;
+}
+
+int fs_unmount_r( fs_t *fs )
+{
+	uint64_t start = stats_start();
+	disk_trace_tag(FS_CALL_UNMOUNT);
+	if(fs->mounted == false){
+		printf("Error: disk not mounted\n");
+		return 0;
+	}
+
+	delalloc_flush_all(fs);
+
+	if(fs->journal){
+		// commits what is left, and the next mount starts the journal
+		// over, so everything freed really is free
+		journal_close(fs->journal);
+		fs->journal = 0;
+		settle_frees(fs);
+	}
+
+	if(fs->super.magic == FS_MAGIC){
+		union fs_block block;
+
+		// everything else must be durable before the superblock says clean,
+		// or a crash could leave a clean mark over stale bitmaps
+		fs_store_bitmap(fs,&fs->bitmap,fs->super.bitmapstart,fs->super.nbitmapblocks);
+		fs_store_bitmap(fs,&fs->inodemap,fs->super.inodebitmapstart,fs->super.ninodebitmapblocks);
+		cache_flush_r(fs->cache);
+		disk_sync_r(fs->disk);
+
+		cache_read_r(fs->cache,0,block.data);
+		block.super.state = FS_STATE_CLEAN;
+		cache_write_r(fs->cache,0,block.data);
+		cache_flush_r(fs->cache);
+		disk_sync_r(fs->disk);
+	}
+
+	cache_flush_r(fs->cache); // push every dirty block out before letting go
+	fs_release(fs);
+
+	fs->mounted = false;
+	stats_end(&fs->stats[FS_STAT_UNMOUNT],start,0);
+	return 1;
+}
+
+int fs_ismounted_r( fs_t *fs )
+{
+	return fs->mounted;
+}
+
+// the in-memory copy of an inode, or 0 if there is no such inode
+static struct fs_inode *inode_get( fs_t *fs, int inumber )
+{
+	if(fs->mounted == false || inumber <= 0 || inumber >= fs->super.ninodes){
+		return 0;
+	}
+
+	int features = fs->super.features;
+	int numBlock = inumber/inodes_per_block(features);
+	if(!__atomic_load_n(&fs->inodes_loaded[numBlock],__ATOMIC_ACQUIRE)){
+		pthread_mutex_lock(&fs->table_lock);
+		if(!fs->inodes_loaded[numBlock]){
+			meta_read(fs,numBlock+1,fs->inodes + (size_t)numBlock*DISK_BLOCK_SIZE);
+			__atomic_store_n(&fs->inodes_loaded[numBlock],true,__ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&fs->table_lock);
+	}
+	return inode_at(features,fs->inodes,inumber);
+}
+
+// writes an inode back through to its inode block (or the journal). The neighbours that
+// share the block go along as they stand; any of them still being changed
+// is written again by its own inode_put once that change is done.
+static void inode_put( fs_t *fs, int inumber )
+{
+	int numBlock = inumber/inodes_per_block(fs->super.features);
+	meta_write(fs,numBlock+1,fs->inodes + (size_t)numBlock*DISK_BLOCK_SIZE);
+}
+
+// claims a free inode and sets it up as an empty file, returns 0 if none is left
+static int create_inode( fs_t *fs )
+{
+	if(fs->journal) journal_begin(fs->journal,JOURNAL_OP_BLOCKS);
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	int inumber = bitmap_alloc(&fs->inodemap);
+	note_scan(fs,&fs->inodemap);
+	bitmap_changed(fs,&fs->inodemap,inumber,1);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if(inumber <= 0){
+		if(fs->journal) journal_end(fs->journal,JOURNAL_OP_BLOCKS);
+		printf("Error: no space in inode blocks\n");
+		return 0;
+	}
+
+	// no inode lock: nobody knows this inode yet, and the lock is shared with
+	// other inodes whose holders may be waiting for this transaction to end
+	struct fs_inode *inode = inode_get(fs,inumber);
+	memset(inode,0,inode_bytes(fs->super.features));
+	inode->isvalid = 1;
+	if(fs->super.features & FS_FEATURE_INLINE){
+		set_inline(inode,true);
+	}
+	inode_put(fs,inumber);
+
+	if(fs->journal) journal_end(fs->journal,JOURNAL_OP_BLOCKS);
+	return inumber;
+}
+
+int fs_create_r( fs_t *fs )
+{
+	uint64_t start = stats_start();
+	disk_trace_tag(FS_CALL_CREATE);
+	if(fs->mounted == false){
+		printf("Error: disk not mounted\n");
+		return 0;
+	}
+
+	int inumber = create_inode(fs);
+
+	stats_end(&fs->stats[FS_STAT_CREATE],start,0);
+	return inumber;
+}
+
+// whether inumber is the names directory, which only fs_link_r and
+// fs_unlink_r may change
+static bool is_dir( fs_t *fs, int inumber )
+{
+	return inumber > 0 && inumber == __atomic_load_n(&fs->super.dirinode,__ATOMIC_ACQUIRE);
+}
+
+// where the direct pointers and the roots of the single, double and
+// triple indirect trees of a block-mapped inode are, for this disk's
+// layout; roots the layout doesn't have are 0. Returns how many direct
+// pointers there are.
+static int inode_pointers( fs_t *fs, struct fs_inode *inode, int **direct, int *roots[3] )
+{
+	if(fs->super.features & FS_FEATURE_LARGEFILE){
+		*direct = inode->ldirect;
+		roots[0] = &inode->lindirect;
+		roots[1] = &inode->dindirect;
+		roots[2] = &inode->tindirect;
+		return LARGE_DIRECT;
+	}
+	*direct = inode->direct;
+	roots[0] = &inode->indirect;
+	roots[1] = 0;
+	roots[2] = 0;
+	return POINTERS_PER_INODE;
+}
+
+// how many blocks a file can have with this disk's layout
+static int64_t max_file_blocks( fs_t *fs )
+{
+	int64_t p = POINTERS_PER_BLOCK;
+	if(fs->super.features & FS_FEATURE_EXTENTS){
+		return INT_MAX;
+	}
+	if(fs->super.features & FS_FEATURE_LARGEFILE){
+		return LARGE_DIRECT + p + p*p + p*p*p;
+	}
+	return POINTERS_PER_INODE + p;
+}
+
+// frees an indirect block of the given depth (1 for a single indirect
+// block) and every block under it
+static void free_tree( fs_t *fs, int blocknum, int depth )
+{
+	union fs_block block;
+	int k;
+
+	meta_read(fs,blocknum,block.data);
+	if(depth > 1){
+		for(k = 0; k < POINTERS_PER_BLOCK; k++){
+			if(block.pointers[k] > 0){
+				free_tree(fs,block.pointers[k],depth-1);
 			}
 		}
+	}
 
-		union fs_block direct;
-		disk_read(block.inode[numInBlock].direct[i],direct.data); // read in the direct block
-
-		// printf("    WRITE TO NODE:\n");
-		for(j = 0; j < DISK_BLOCK_SIZE; j++){ // for every data byte
-			if(bytes_Traversed >= offset){
-				direct.data[j] = data[bytes_Written];//@@@@@@@@@@@@@@@  j  bytes Written @@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@
-				// printf("%c",direct.data[j]);
-				bytes_Written++; // increment the number of bytes Copied
-				block.inode[numInBlock].size++; // increments the size of the inode
-				// printf("% d ",bytes_Written);
-				bytes_Traversed++;
-				if(bytes_Written >= length){ // if we have copied the length requested, return
-					disk_write(block.inode[numInBlock].direct[i],direct.data);
-					// printf("Wrote %d bytes : exited in direct because %d = %d\n",bytes_Written,bytes_Written,length);
-					disk_write(numBlock,block.data); // writes back the inode
-					return bytes_Written;
-				}
-			} else{
-				bytes_Traversed++;
+	pthread_mutex_lock(&fs->alloc_lock);
+	if(depth == 1){
+		for(k = 0; k < POINTERS_PER_BLOCK; k++){
+			if(block.pointers[k] > 0){
+				free_blocks(fs,block.pointers[k],1,false);
 			}
 		}
-		disk_write(block.inode[numInBlock].direct[i],direct.data);
 	}
-	// printf("Exited after Direct\n");
+	free_blocks(fs,blocknum,1,true); // the indirect block itself
+	pthread_mutex_unlock(&fs->alloc_lock);
+}
 
-	/* INDIRECT */
-	// printf("Trying to add data to inode======================\n");
-	
-	if(block.inode[numInBlock].indirect <= 0){ // if the indirect block is not in use
-		// printf("No indirect block associated with this inode\n");
-		found_block = false;
-		for(j = 0; j < NUM_BLOCKS; j++){
-			if(bitmap[j]==0){
-				// printf("indirect block allocated at block %d\n",j);
-				newBlock = j;
-				block.inode[numInBlock].indirect = newBlock;
-				found_block = true;
-				bitmap[newBlock] = 1;
+static int delete_inode( fs_t *fs, int inumber )
+{
+	struct fs_inode *inode = inode_get(fs,inumber);
+
+	if(!inode || inode->isvalid == 0)
+	{
+		return 0;
+	}
+
+	inode->isvalid = 0;
+	inode_set_size(fs,inode,0);
+
+	int k;
+
+	if(is_inline(fs->super.features,inode)){
+		memset(inline_data(inode),0,INLINE_MAX); // no blocks to free
+		set_inline(inode,false);
+	} else if(fs->super.features & FS_FEATURE_EXTENTS){
+		// the extent block is read before the allocator is locked
+		union fs_block more;
+		if(inode->extentblock > 0){
+			meta_read(fs,inode->extentblock,more.data);
+		}
+
+		pthread_mutex_lock(&fs->alloc_lock);
+		for(k = 0; k < inode->nextents && k < MAX_EXTENTS; k++){
+			if(k >= EXTENTS_PER_INODE && inode->extentblock <= 0){
 				break;
 			}
+			struct fs_extent *ext = extent_ref(inode,&more,k);
+			if(ext->start > 0){
+				free_blocks(fs,ext->start,ext->length,false);
+			}
 		}
-		if(!found_block){
-			printf("Error: cannot allocate new indirect block, not enough space\n");
-			return 0;
+		if(inode->extentblock > 0){
+			free_blocks(fs,inode->extentblock,1,true); // the extent block itself
+		}
+		pthread_mutex_unlock(&fs->alloc_lock);
+
+		memset(inode->extent,0,sizeof(inode->extent));
+		inode->nextents = 0;
+		inode->extentblock = 0;
+	} else{
+		int *direct, *roots[3];
+		int ndirect = inode_pointers(fs,inode,&direct,roots);
+
+		pthread_mutex_lock(&fs->alloc_lock);
+		for(k = 0; k < ndirect; k++){
+			if(direct[k] > 0){
+				free_blocks(fs,direct[k],1,false);
+				direct[k] = 0; // direct blocks to 0
+			}
+		}
+		pthread_mutex_unlock(&fs->alloc_lock);
+
+		for(k = 0; k < 3; k++){
+			if(roots[k] && *roots[k] > 0){
+				free_tree(fs,*roots[k],k+1);
+				*roots[k] = 0; // indirect blocks to 0
+			}
+		}
+	}
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	bitmap_clear(&fs->inodemap,inumber);
+	bitmap_changed(fs,&fs->inodemap,inumber,1);
+	if(inumber < fs->inodemap.hint){
+		fs->inodemap.hint = inumber; // fs_create keeps handing out the lowest free inode
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	inode_put(fs,inumber);
+
+	return 1;
+
+}
+
+int fs_delete_r( fs_t *fs, int inumber )
+{
+	uint64_t start = stats_start();
+	disk_trace_tag(FS_CALL_DELETE);
+	if(is_dir(fs,inumber)){
+		printf("Error: inode %d holds the file names\n",inumber);
+		return 0;
+	}
+	pthread_rwlock_wrlock(inode_lock(fs,inumber));
+	struct fs_inode *inode = inode_get(fs,inumber);
+	while(inode && inode->isvalid && inode->nlinks > 0){
+		// the directory is locked before the inode, so let go of it first
+		pthread_rwlock_unlock(inode_lock(fs,inumber));
+		dir_forget(fs,inumber);
+		pthread_rwlock_wrlock(inode_lock(fs,inumber));
+	}
+	delalloc_drop(fs,inumber);
+	if(fs->journal) journal_begin(fs->journal,JOURNAL_OP_BLOCKS);
+	int result = delete_inode(fs,inumber);
+	if(fs->journal) journal_end(fs->journal,JOURNAL_OP_BLOCKS);
+	pthread_rwlock_unlock(inode_lock(fs,inumber));
+	if(!fs->journal) settle_frees(fs);
+	stats_end(&fs->stats[FS_STAT_DELETE],start,0);
+	return result;
+}
+
+int64_t fs_getsize_r( fs_t *fs, int inumber )
+{
+	uint64_t start = stats_start();
+	disk_trace_tag(FS_CALL_GETSIZE);
+	int64_t size = -1;
+	pthread_rwlock_rdlock(inode_lock(fs,inumber));
+	struct fs_inode *inode = inode_get(fs,inumber);
+	if(inode && inode->isvalid && inode_size(fs,inode) >= 0){
+		size = inode_size(fs,inode);
+		int64_t held = delalloc_end(fs,inumber);
+		if(held > size){
+			size = held;
 		}
 	}
+	pthread_rwlock_unlock(inode_lock(fs,inumber));
+	stats_end(&fs->stats[FS_STAT_GETSIZE],start,0);
+	return size;
+}
+
+// what is left of the blocks set aside for the delayed writes this thread
+// is flushing, see delalloc_flush
+static __thread int reserve_owed = 0;
+
+// lets this thread claim the blocks set aside for it (under alloc_lock)
+static void reserve_open( fs_t *fs )
+{
+	fs->bitmap.reserved -= reserve_owed;
+}
+
+// counts got blocks claimed since reserve_open against what was set aside
+// for this thread, and sets the rest aside again (under alloc_lock)
+static void reserve_close( fs_t *fs, int got )
+{
+	reserve_owed -= (got < reserve_owed) ? got : reserve_owed;
+	fs->bitmap.reserved += reserve_owed;
+}
+
+// finds a free block in the bitmap and claims it, returns 0 if the disk is full
+static int alloc_block( fs_t *fs )
+{
+	pthread_mutex_lock(&fs->alloc_lock);
+	reserve_open(fs);
+	int j = bitmap_alloc(&fs->bitmap);
+	reserve_close(fs,j > 0);
+	note_scan(fs,&fs->bitmap);
+	bitmap_changed(fs,&fs->bitmap,j,1);
+	pthread_mutex_unlock(&fs->alloc_lock);
+	return (j > 0) ? j : 0;
+}
 
+// one indirect block on the path map_block last walked
+struct fs_map_level {
+	int blocknum;       // 0 if none is loaded
+	bool dirty;
+	union fs_block block;
+};
 
+// State carried through one fs_read/fs_write while it maps file blocks to
+// disk blocks. Block-mapped files keep the indirect blocks on the path to
+// the last block mapped, one per level of the tree, and neighbouring
+// blocks share that path, so each indirect block is read about once per
+// call. Extent-mapped files keep their extent block in indirect.
+struct fs_map {
+	fs_t *fs;
+	struct fs_inode *inode;
 	union fs_block indirect;
-	disk_read(block.inode[numInBlock].indirect,indirect.data); // open that indirect block
-
-	for(i = 0; i < POINTERS_PER_BLOCK; i++){
-		if(indirect.pointers[i] <= 0){ // if there is an unused pointer
-			found_block = false;
-			for(j=0;j<NUM_BLOCKS;j++){ // check the bitmap for a free block
-				if(bitmap[j] == 0){    // if the block is free
-					newBlock = j;
-					indirect.pointers[i] = newBlock;
-					found_block = true;
-					bitmap[newBlock] = 1;
-					break;
+	bool indirect_loaded;
+	bool indirect_dirty;
+	int ext_index;      // extent the last lookup landed in
+	int ext_base;       // first logical block of that extent
+	struct fs_map_level level[3];
+	int run_start;      // data blocks claimed ahead by write_inode
+	int run_count;
+};
+
+// the k-th extent of the file being mapped, loading the extent block
+// the first time it is needed
+static struct fs_extent *extent_at( struct fs_map *map, int k )
+{
+	fs_t *fs = map->fs;
+	if(k >= EXTENTS_PER_INODE && !map->indirect_loaded){
+		meta_read(fs,map->inode->extentblock,map->indirect.data);
+		map->indirect_loaded = true;
+	}
+	return extent_ref(map->inode,&map->indirect,k);
+}
+
+// number of blocks an extent-mapped file has allocated
+static int extent_blocks( struct fs_map *map )
+{
+	int k, total = 0;
+	for(k = 0; k < map->inode->nextents; k++){
+		total += extent_at(map,k)->length;
+	}
+	return total;
+}
+
+// Extents are in file order, so finding a logical block means walking
+// them and adding up lengths. Lookups inside one read or write move
+// forward, so the walk picks up where the previous one stopped.
+static int map_extent( struct fs_map *map, int logical )
+{
+	int k = 0, base = 0;
+	if(logical >= map->ext_base){
+		k = map->ext_index;
+		base = map->ext_base;
+	}
+
+	for(; k < map->inode->nextents && k < MAX_EXTENTS; k++){
+		struct fs_extent *ext = extent_at(map,k);
+		if(logical < base+ext->length){
+			map->ext_index = k;
+			map->ext_base = base;
+			return (ext->start > 0) ? ext->start + (logical-base) : 0;
+		}
+		base += ext->length;
+	}
+	return 0;
+}
+
+// Grows an extent-mapped file until it has nblocks blocks allocated: first
+// by extending its last extent in place while the blocks after it are
+// free, then by adding extents, each one the longest contiguous run the
+// bitmap can offer for what is still missing. Returns how many blocks the
+// file has afterwards, which is less than asked for when space runs out.
+static int extend_extents( struct fs_map *map, int nblocks )
+{
+	fs_t *fs = map->fs;
+	struct fs_inode *inode = map->inode;
+	int have = extent_blocks(map);
+
+	while(have < nblocks){
+		if(inode->nextents > 0){
+			struct fs_extent *last = extent_at(map,inode->nextents-1);
+			int end = last->start + last->length;
+			int had = have;
+			pthread_mutex_lock(&fs->alloc_lock);
+			reserve_open(fs);
+			while(have < nblocks && last->start > 0 && !bitmap_test(&fs->bitmap,end) && fs->bitmap.nbits-fs->bitmap.used > fs->bitmap.reserved){
+				bitmap_set(&fs->bitmap,end);
+				bitmap_changed(fs,&fs->bitmap,end,1);
+				last->length++;
+				end++;
+				have++;
+				if(inode->nextents > EXTENTS_PER_INODE){
+					map->indirect_dirty = true;
 				}
 			}
-			if(!found_block && (i == POINTERS_PER_BLOCK-1)){
-				// printf("no room in the indirect block");
-				return 0;
-			} else if(!found_block){
-				continue;
+			reserve_close(fs,have-had);
+			pthread_mutex_unlock(&fs->alloc_lock);
+			if(have == nblocks){
+				break;
 			}
 		}
 
-		union fs_block indirectData;
-		disk_read(indirect.pointers[i],indirectData.data); // read that data block
-
-		for(j = 0 ; j < DISK_BLOCK_SIZE; j++){ // for every data byte
-			if(bytes_Traversed >= offset){
-				indirectData.data[j] = data[bytes_Written]; ////// j bytes_Written @@@@@@@@@@@@@@@@@@@
-				// printf("%c",indirectData.data[j]);
-				bytes_Written++; // increment the number of bytes Copied
-				block.inode[numInBlock].size++; // increments the size of the inode
-				// printf("% d ",bytes_Written);
-				bytes_Traversed++;
-				if(bytes_Written >= length){ // if we have copied the length requested, return
-					disk_write(indirect.pointers[i],indirectData.data); // writes to the data block
-					// printf("Wrote %d bytes : exited in direct because %d = %d\n",bytes_Written,bytes_Written,length);
-					disk_write(numBlock,block.data); // writes back the inode
-					disk_write(block.inode[numInBlock].indirect,indirect.data); // writes to the indirect block
-					return bytes_Written;
-				}
+		if(inode->nextents >= MAX_EXTENTS){
+			break; // too fragmented to grow any further
+		}
+		if(inode->nextents == EXTENTS_PER_INODE && inode->extentblock <= 0){
+			int newBlock = alloc_block(fs);
+			if(newBlock == 0){
+				break;
+			}
+			inode->extentblock = newBlock;
+			memset(map->indirect.data,0,DISK_BLOCK_SIZE);
+			map->indirect_loaded = true;
+			map->indirect_dirty = true;
+		}
+
+		int got;
+		pthread_mutex_lock(&fs->alloc_lock);
+		reserve_open(fs);
+		int start = bitmap_alloc_run(&fs->bitmap,nblocks-have,&got);
+		reserve_close(fs,got);
+		note_scan(fs,&fs->bitmap);
+		if(start > 0){
+			bitmap_changed(fs,&fs->bitmap,start,got);
+		}
+		pthread_mutex_unlock(&fs->alloc_lock);
+		if(start <= 0){
+			break;
+		}
+		struct fs_extent *ext = extent_at(map,inode->nextents);
+		ext->start = start;
+		ext->length = got;
+		inode->nextents++;
+		if(inode->nextents > EXTENTS_PER_INODE){
+			map->indirect_dirty = true;
+		}
+		have += got;
+	}
+
+	return have;
+}
+
+// Makes room for n more extents at index k by moving the ones from k on
+// along. Returns false if the file can't have that many.
+static bool extent_insert( struct fs_map *map, int k, int n )
+{
+	struct fs_inode *inode = map->inode;
+	int j;
+
+	if(inode->nextents + n > MAX_EXTENTS){
+		return false;
+	}
+	if(inode->nextents + n > EXTENTS_PER_INODE && inode->extentblock <= 0){
+		int newBlock = alloc_block(map->fs);
+		if(newBlock == 0){
+			return false;
+		}
+		inode->extentblock = newBlock;
+		memset(map->indirect.data,0,DISK_BLOCK_SIZE);
+		map->indirect_loaded = true;
+	}
+
+	for(j = inode->nextents-1; j >= k; j--){
+		*extent_at(map,j+n) = *extent_at(map,j);
+	}
+	inode->nextents += n;
+	if(inode->nextents > EXTENTS_PER_INODE){
+		map->indirect_dirty = true;
+	}
+	map->ext_index = 0;
+	map->ext_base = 0;
+	return true;
+}
+
+// takes extent k out, moving the ones after it back
+static void extent_remove( struct fs_map *map, int k )
+{
+	struct fs_inode *inode = map->inode;
+	int j;
+	for(j = k; j+1 < inode->nextents; j++){
+		*extent_at(map,j) = *extent_at(map,j+1);
+	}
+	inode->nextents--;
+	if(inode->nextents >= EXTENTS_PER_INODE){
+		map->indirect_dirty = true;
+	}
+	map->ext_index = 0;
+	map->ext_base = 0;
+}
+
+// Adds a hole of count blocks to the end of an extent-mapped file's map.
+// A hole is an extent that starts at block 0.
+static bool extent_hole( struct fs_map *map, int count )
+{
+	struct fs_inode *inode = map->inode;
+	if(inode->nextents > 0){
+		struct fs_extent *last = extent_at(map,inode->nextents-1);
+		if(last->start == 0){
+			last->length += count;
+			if(inode->nextents > EXTENTS_PER_INODE){
+				map->indirect_dirty = true;
+			}
+			return true;
+		}
+	}
+	if(!extent_insert(map,inode->nextents,1)){
+		return false;
+	}
+	struct fs_extent *ext = extent_at(map,inode->nextents-1);
+	ext->start = 0;
+	ext->length = count;
+	return true;
+}
+
+// Gives the blocks from first up to end that lie in holes of an
+// extent-mapped file disk blocks of their own. Each run allocated either
+// carries on the extent in front of it or becomes an extent of its own,
+// with the hole split around it. Returns false if space or extents run
+// out part way.
+static bool extent_fill( struct fs_map *map, int first, int end )
+{
+	fs_t *fs = map->fs;
+	struct fs_inode *inode = map->inode;
+	int k = 0, base = 0;
+
+	while(k < inode->nextents){
+		if(first < base){
+			first = base; // the blocks in between are mapped already
+		}
+		if(first >= end){
+			break;
+		}
+		struct fs_extent *ext = extent_at(map,k);
+		int length = ext->length;
+		if(ext->start > 0 || base+length <= first){
+			base += length;
+			k++;
+			continue;
+		}
+
+		// first is in hole k, which covers base up to base+length
+		int got;
+		int want = ((end < base+length) ? end : base+length) - first;
+		pthread_mutex_lock(&fs->alloc_lock);
+		reserve_open(fs);
+		int start = bitmap_alloc_run(&fs->bitmap,want,&got);
+		reserve_close(fs,got);
+		note_scan(fs,&fs->bitmap);
+		if(start > 0){
+			bitmap_changed(fs,&fs->bitmap,start,got);
+		}
+		pthread_mutex_unlock(&fs->alloc_lock);
+		if(start <= 0){
+			return false;
+		}
+
+		int before = first-base;
+		int after = base+length-(first+got);
+		struct fs_extent *prev = (k > 0) ? extent_at(map,k-1) : 0;
+
+		if(before == 0 && prev && prev->start > 0 && prev->start+prev->length == start){
+			prev->length += got;
+			if(after > 0){
+				extent_at(map,k)->length = after;
 			} else{
-				bytes_Traversed++;
+				extent_remove(map,k);
 			}
+		} else{
+			int n = (before > 0) + 1 + (after > 0);
+			if(!extent_insert(map,k+1,n-1)){
+				pthread_mutex_lock(&fs->alloc_lock);
+				bitmap_clear_range(&fs->bitmap,start,got);
+				bitmap_changed(fs,&fs->bitmap,start,got);
+				pthread_mutex_unlock(&fs->alloc_lock);
+				return false;
+			}
+			if(before > 0){
+				*extent_at(map,k) = (struct fs_extent){ 0, before };
+				k++;
+			}
+			*extent_at(map,k) = (struct fs_extent){ start, got };
+			if(after > 0){
+				*extent_at(map,k+1) = (struct fs_extent){ 0, after };
+			}
+			k++;
+		}
+		if(inode->nextents > EXTENTS_PER_INODE){
+			map->indirect_dirty = true;
 		}
-		disk_write(indirect.pointers[i],indirectData.data); // writes to the data block
+
+		// k is now whatever follows the new blocks: the rest of the hole,
+		// if any, which the next round carries on with
+		base = first+got;
+		first += got;
 	}
+	return true;
+}
 
-	return bytes_Written;
+// writes back the indirect block held at one level of the map, if changed
+static void map_release( struct fs_map *map, int k )
+{
+	struct fs_map_level *level = &map->level[k];
+	if(level->blocknum > 0 && level->dirty){
+		meta_write(map->fs,level->blocknum,level->block.data);
+	}
+	level->dirty = false;
+}
+
+// Returns the disk block behind logical block `logical` of the file, 0 if
+// there is none (or, when allocating, no space left), and -1 if the file
+// can't reach that far. With alloc set a missing block is allocated, and
+// *fresh tells the caller that its old contents are garbage. Extent-mapped
+// files never allocate here, fs_write grows them with extend_extents.
+static int map_block( struct fs_map *map, int logical, bool alloc, bool *fresh )
+{
+	fs_t *fs = map->fs;
+	struct fs_inode *inode = map->inode;
+	int *slot;
+
+	if(fresh) *fresh = false;
+
+	if(fs->super.features & FS_FEATURE_EXTENTS){
+		return map_extent(map,logical);
+	}
+
+	int *direct, *roots[3];
+	int ndirect = inode_pointers(fs,inode,&direct,roots);
+	int depth = 0;
+
+	if(logical < ndirect){
+		slot = &direct[logical];
+	} else{
+		// find the tree the block is in and its index within that tree
+		int n = logical - ndirect;
+		int64_t span = 1; // blocks under one pointer of the top indirect block
+		while(depth < 3 && roots[depth] && n >= span*POINTERS_PER_BLOCK){
+			n -= span*POINTERS_PER_BLOCK;
+			span *= POINTERS_PER_BLOCK;
+			depth++;
+		}
+		if(depth == 3 || !roots[depth]){
+			return -1;
+		}
+		slot = roots[depth];
+		depth++;
+
+		// then walk down it, one indirect block per level
+		int k;
+		for(k = 0; k < depth; k++){
+			struct fs_map_level *level = &map->level[k];
+			if(*slot <= 0){
+				if(!alloc){
+					return 0;
+				}
+				int newBlock = alloc_block(fs);
+				if(newBlock == 0){
+					printf("Error: cannot allocate new indirect block, not enough space\n");
+					return 0;
+				}
+				map_release(map,k);
+				*slot = newBlock;
+				if(k > 0){
+					map->level[k-1].dirty = true;
+				}
+				level->blocknum = newBlock;
+				memset(level->block.data,0,DISK_BLOCK_SIZE);
+				level->dirty = true;
+			} else if(level->blocknum != *slot){
+				map_release(map,k);
+				meta_read(fs,*slot,level->block.data);
+				level->blocknum = *slot;
+			}
+			slot = &level->block.pointers[n/span];
+			n %= span;
+			span /= POINTERS_PER_BLOCK;
+		}
+	}
+
+	if(*slot <= 0 && alloc){
+		int newBlock;
+		if(map->run_count > 0){
+			newBlock = map->run_start++;
+			map->run_count--;
+		} else{
+			newBlock = alloc_block(fs);
+		}
+		if(newBlock == 0){
+			return 0;
+		}
+		*slot = newBlock;
+		if(depth > 0){
+			map->level[depth-1].dirty = true;
+		}
+		if(fresh) *fresh = true;
+	}
+
+	return (*slot > 0) ? *slot : 0;
+}
+
+// Sequential readahead. Each recently read inode remembers where a
+// sequential reader would continue. When the next read starts exactly
+// there, the window of blocks pulled into the cache ahead of it doubles,
+// up to READAHEAD_MAX; a read anywhere else drops it back to nothing.
+// The window is only topped up once half of it has been consumed, so a
+// stream turns into a few large prefetches rather than many small ones.
+
+#define READAHEAD_MIN   4
+#define READAHEAD_MAX   64
+
+static void readahead( struct fs_map *map, int inumber, int64_t offset, int length )
+{
+	fs_t *fs = map->fs;
+	struct readahead *ra = &fs->readahead[inumber % READAHEAD_SLOTS];
+
+	pthread_mutex_lock(&fs->readahead_lock);
+
+	if(ra->inumber != inumber){
+		memset(ra,0,sizeof(*ra));
+		ra->inumber = inumber;
+	}
+
+	if(offset == ra->next_offset){
+		ra->window = ra->window ? ra->window*2 : READAHEAD_MIN;
+		if(ra->window > READAHEAD_MAX){
+			ra->window = READAHEAD_MAX;
+		}
+	} else{
+		ra->window = 0;
+		ra->fetched = 0;
+	}
+	ra->next_offset = offset+length;
+
+	int64_t size = inode_size(fs,map->inode);
+	if(ra->window == 0 || size <= 0){
+		pthread_mutex_unlock(&fs->readahead_lock);
+		return;
+	}
+
+	int from = (offset+length) / DISK_BLOCK_SIZE;
+	int lastblock = (size-1) / DISK_BLOCK_SIZE;
+	int to = from + ra->window - 1;
+	if(to > lastblock){
+		to = lastblock;
+	}
+	if(ra->fetched > from){
+		from = ra->fetched;
+	}
+	if(from > to || (to < lastblock && to-from+1 < ra->window/2)){
+		pthread_mutex_unlock(&fs->readahead_lock);
+		return;
+	}
+	ra->fetched = to+1;
+	pthread_mutex_unlock(&fs->readahead_lock);
+
+	int blocknums[READAHEAD_MAX];
+	int n = 0;
+	int logical;
+	for(logical = from; logical <= to; logical++){
+		int blocknum = map_block(map,logical,false,0);
+		if(blocknum < 0){
+			break;
+		}
+		if(blocknum > 0){
+			blocknums[n++] = blocknum;
+		}
+	}
+
+	cache_prefetch_r(fs->cache,blocknums,n);
+}
+
+static int read_inode( fs_t *fs, int inumber, char *data, int length, int64_t offset )
+{
+	struct fs_inode *inode = inode_get(fs,inumber);
+	if(!inode || inode->isvalid == 0 || offset < 0 || length <= 0){
+		return 0;
+	}
+
+	int64_t size = inode_size(fs,inode);
+	if(offset >= size){
+		return 0;
+	}
+	if(length > size - offset){ // never read past the end of the file
+		length = size - offset;
+	}
+	if(is_inline(fs->super.features,inode)){
+		memcpy(data,inline_data(inode)+offset,length);
+		return length;
+	}
+
+	struct fs_map map = { .fs = fs, .inode = inode };
+	union fs_block head, tail; // the partial blocks at either end, if any
+	int first = offset / DISK_BLOCK_SIZE;
+	int last = (offset+length-1) / DISK_BLOCK_SIZE;
+	int count = last-first+1;
+	int i;
+
+	int *phys = malloc(sizeof(int)*count);
+	char **bufs = malloc(sizeof(char *)*count);
+	if(!phys || !bufs){
+		free(phys);
+		free(bufs);
+		return 0;
+	}
+
+	// map every block first, so physically contiguous runs can be read
+	// with one call, and whole blocks land directly in the caller's buffer
+	for(i = 0; i < count; i++){
+		int64_t start = (int64_t)(first+i)*DISK_BLOCK_SIZE;
+		phys[i] = map_block(&map,first+i,false,0);
+		if(phys[i] < 0){ // past the largest possible file
+			count = i;
+			length = start-offset;
+			break;
+		}
+		if(start >= offset && start+DISK_BLOCK_SIZE <= offset+length){
+			bufs[i] = data + (start-offset);
+		} else{
+			bufs[i] = (i == 0) ? head.data : tail.data;
+		}
+	}
+
+	// every physically contiguous run becomes one request, and the whole
+	// set (direct and indirect blocks alike) goes to the disk as one batch
+	struct disk_request *runs = malloc(sizeof(struct disk_request)*(count > 0 ? count : 1));
+	int nruns = 0;
+	if(!runs){
+		free(phys);
+		free(bufs);
+		return 0;
+	}
+
+	i = 0;
+	while(i < count){
+		if(phys[i] == 0){
+			memset(bufs[i],0,DISK_BLOCK_SIZE); // never written, reads as zeros
+			i++;
+			continue;
+		}
+		int n = 1;
+		while(i+n < count && phys[i+n] == phys[i]+n) n++;
+		runs[nruns].op = DISK_OP_READ;
+		runs[nruns].blocknum = phys[i];
+		runs[nruns].count = n;
+		runs[nruns].data = bufs+i;
+		nruns++;
+		i += n;
+	}
+	cache_read_batch_r(fs->cache,runs,nruns);
+	free(runs);
+
+	// copy out the pieces of the partial blocks that were asked for
+	if(count > 0 && bufs[0] == head.data){
+		int inblock = offset % DISK_BLOCK_SIZE;
+		int chunk = DISK_BLOCK_SIZE - inblock;
+		if(chunk > length){
+			chunk = length;
+		}
+		memcpy(data,head.data+inblock,chunk);
+	}
+	if(count > 1 && bufs[count-1] == tail.data){
+		int64_t start = (int64_t)(first+count-1)*DISK_BLOCK_SIZE;
+		memcpy(data+(start-offset),tail.data,offset+length-start);
+	}
+
+	readahead(&map,inumber,offset,length);
+
+	free(phys);
+	free(bufs);
+	return length;
+}
+
+// Writes length bytes at offset, allocating only the blocks the write
+// touches; anything between the old end of file and offset stays a hole.
+// Called in pieces by fs_write_r, see WRITE_PIECE.
+static int write_inode( fs_t *fs, int inumber, const char *data, int length, int64_t offset )
+{
+	struct fs_inode *inode = inode_get(fs,inumber);
+	if(!inode || inode->isvalid == 0){
+		printf("Failed to write to inode %d: inode not valid\n",inumber);
+		return 0;
+	}
+	if(offset < 0 || length <= 0 || (offset+length-1) / DISK_BLOCK_SIZE >= INT_MAX){
+		return 0;
+	}
+
+	struct fs_map map = { .fs = fs, .inode = inode };
+	union fs_block head, tail; // the partial blocks at either end, if any
+
+	int64_t size = inode_size(fs,inode);
+	int first = offset / DISK_BLOCK_SIZE;
+	int last = (offset+length-1) / DISK_BLOCK_SIZE;
+	int count = last-first+1;
+	int i;
+
+	int *phys = malloc(sizeof(int)*count);
+	bool *fresh = malloc(sizeof(bool)*count);
+	const char **bufs = malloc(sizeof(char *)*count);
+	if(!phys || !fresh || !bufs){
+		free(phys);
+		free(fresh);
+		free(bufs);
+		return 0;
+	}
+
+	// allocate everything up front, stopping short if the disk fills up
+	if(fs->super.features & FS_FEATURE_EXTENTS){
+		// holes the write lands in get split around it, and past the
+		// mapped end the file grows by a hole up to first, then by data
+		int mapped = extent_blocks(&map);
+		for(i = 0; i < count; i++){
+			fresh[i] = (first+i >= mapped) || map_block(&map,first+i,false,0) == 0;
+		}
+		bool ok = true;
+		if(first < mapped){
+			ok = extent_fill(&map,first,(last < mapped) ? last+1 : mapped);
+		}
+		if(ok && last >= mapped){
+			if(first > mapped){
+				ok = extent_hole(&map,first-mapped);
+			}
+			if(ok){
+				extend_extents(&map,last+1);
+			}
+		}
+		map.ext_index = 0;
+		map.ext_base = 0;
+		for(i = 0; i < count; i++){
+			phys[i] = map_block(&map,first+i,false,0);
+			if(phys[i] <= 0){
+				count = i;
+				break;
+			}
+		}
+	} else{
+		// claim the data blocks still missing as one run, so they end up
+		// next to each other instead of in between the indirect blocks
+		int missing = 0;
+		for(i = 0; i < count; i++){
+			if(map_block(&map,first+i,false,0) == 0){
+				missing++;
+			}
+		}
+		if(missing > 0){
+			pthread_mutex_lock(&fs->alloc_lock);
+			reserve_open(fs);
+			map.run_start = bitmap_alloc_run(&fs->bitmap,missing,&map.run_count);
+			reserve_close(fs,map.run_count);
+			note_scan(fs,&fs->bitmap);
+			if(map.run_start > 0){
+				bitmap_changed(fs,&fs->bitmap,map.run_start,map.run_count);
+			} else{
+				map.run_count = 0;
+			}
+			pthread_mutex_unlock(&fs->alloc_lock);
+		}
+
+		for(i = 0; i < count; i++){
+			phys[i] = map_block(&map,first+i,true,&fresh[i]);
+			if(phys[i] <= 0){
+				count = i;
+				break;
+			}
+		}
+
+		if(map.run_count > 0){
+			pthread_mutex_lock(&fs->alloc_lock);
+			bitmap_clear_range(&fs->bitmap,map.run_start,map.run_count);
+			bitmap_changed(fs,&fs->bitmap,map.run_start,map.run_count);
+			pthread_mutex_unlock(&fs->alloc_lock);
+		}
+	}
+
+	int64_t bytes_Written = (int64_t)(first+count)*DISK_BLOCK_SIZE - offset;
+	if(bytes_Written > length){
+		bytes_Written = length;
+	}
+	if(bytes_Written < 0){
+		bytes_Written = 0;
+	}
+	int64_t end = offset+bytes_Written;
+
+	for(i = 0; i < count; i++){
+		int64_t start = (int64_t)(first+i)*DISK_BLOCK_SIZE;
+
+		if(start >= offset && start+DISK_BLOCK_SIZE <= end){
+			bufs[i] = data + (start-offset); // whole block, no copy needed
+		} else{
+			// partial block, keep whatever the write doesn't cover
+			char *tmp = (start <= offset) ? head.data : tail.data;
+			if(fresh[i]){
+				memset(tmp,0,DISK_BLOCK_SIZE);
+			} else{
+				cache_read_r(fs->cache,phys[i],tmp);
+			}
+			int from = (offset > start) ? offset-start : 0;
+			int to = (end < start+DISK_BLOCK_SIZE) ? end-start : DISK_BLOCK_SIZE;
+			memcpy(tmp+from,data+(start+from-offset),to-from);
+			bufs[i] = tmp;
+		}
+	}
+
+	i = 0;
+	while(i < count){
+		int n = 1;
+		while(i+n < count && phys[i+n] == phys[i]+n) n++;
+		cache_write_range_r(fs->cache,phys[i],n,bufs+i);
+		i += n;
+	}
+
+	if(bytes_Written > 0 && end > size){
+		inode_set_size(fs,inode,end);
+	}
+
+	if(map.indirect_dirty){
+		meta_write(fs,inode->extentblock,map.indirect.data);
+	}
+	for(i = 0; i < 3; i++){
+		map_release(&map,i);
+	}
+	inode_put(fs,inumber);
+
+	free(phys);
+	free(fresh);
+	free(bufs);
+	return bytes_Written;
+}
+
+// Writes are carried out, and journaled, in pieces of at most WRITE_PIECE
+// bytes, so one piece never changes more metadata blocks than
+// WRITE_CREDITS: the inode block, two leaf indirect blocks and two above
+// each of them, or the extent block.
+#define WRITE_PIECE   (256*DISK_BLOCK_SIZE)
+#define WRITE_CREDITS 8
+
+// Moves an inline file's data out to a block, leaving it an ordinary
+// file of the same size. Returns false, with the file left as it was, if
+// there is no block to be had. The caller holds the inode lock
+// exclusively.
+static bool inline_spill( fs_t *fs, int inumber )
+{
+	struct fs_inode *inode = inode_get(fs,inumber);
+	char held[INLINE_MAX];
+	int size = inode->size;
+
+	memcpy(held,inline_data(inode),size);
+	memset(inline_data(inode),0,INLINE_MAX);
+	set_inline(inode,false);
+	inode_set_size(fs,inode,0);
+	if(size == 0){
+		inode_put(fs,inumber);
+		return true;
+	}
+	if(write_inode(fs,inumber,held,size,0) == size){
+		return true;
+	}
+
+	memset(inline_data(inode),0,INLINE_MAX);
+	memcpy(inline_data(inode),held,size);
+	set_inline(inode,true);
+	inode_set_size(fs,inode,size);
+	inode_put(fs,inumber);
+	return false;
+}
+
+// Writes to a file that is still inline. Returns how much was written if
+// the file still fits in its inode afterwards, and otherwise moves it out
+// to blocks and returns -1 for the caller to carry on as usual, or 0 if
+// that failed. The bytes past an inline file's end are always zero, so a
+// write past the end leaves zeros in between. The caller holds the inode
+// lock exclusively.
+static int write_inline( fs_t *fs, int inumber, const char *data, int length, int64_t offset )
+{
+	struct fs_inode *inode = inode_get(fs,inumber);
+	if(offset < 0 || offset+length > INLINE_MAX){
+		return inline_spill(fs,inumber) ? -1 : 0;
+	}
+
+	memcpy(inline_data(inode)+offset,data,length);
+	if(offset+length > inode->size){
+		inode_set_size(fs,inode,offset+length);
+	}
+	inode_put(fs,inumber);
+	return length;
+}
+
+// Carries out a write in pieces, see WRITE_PIECE. The caller holds the
+// inode lock exclusively.
+static int write_pieces( fs_t *fs, int inumber, const char *data, int length, int64_t offset )
+{
+	int done = 0, commits = 0;
+
+	struct fs_inode *inode = inode_get(fs,inumber);
+	if(inode && inode->isvalid && is_inline(fs->super.features,inode)){
+		if(fs->journal) journal_begin(fs->journal,WRITE_CREDITS);
+		int result = write_inline(fs,inumber,data,length,offset);
+		if(fs->journal) journal_end(fs->journal,WRITE_CREDITS);
+		if(result >= 0){
+			return result;
+		}
+	}
+
+	while(done < length){
+		int64_t at = offset+done;
+		int64_t upto = at / DISK_BLOCK_SIZE * DISK_BLOCK_SIZE + WRITE_PIECE;
+		int want = (length-done < upto-at) ? length-done : upto-at;
+
+		if(fs->journal) journal_begin(fs->journal,WRITE_CREDITS);
+		int result = write_inode(fs,inumber,data+done,want,at);
+		if(fs->journal) journal_end(fs->journal,WRITE_CREDITS);
+
+		done += result;
+		if(result < want){
+			// out of space, unless blocks freed lately only wait for a
+			// commit or three (see free_blocks)
+			if(fs->journal && commits < 3 && frees_pending(fs)){
+				journal_commit(fs->journal);
+				commits++;
+				continue;
+			}
+			break;
+		}
+	}
+	return done;
+}
+
+// DELAYED ALLOCATION
+// A write that lands right at the end of a file is copied into one of the
+// fs->delalloc slots instead of going to disk, and the writes after it are
+// added on for as long as they keep appending. Blocks are allocated only
+// when the slot is flushed: when it fills up, the file is written
+// elsewhere, read, synced or deleted, or the disk is unmounted. By then
+// the whole run is known, so it gets one contiguous allocation, whole
+// blocks go out without being read first, and the inode and indirect
+// blocks change once per WRITE_PIECE rather than once per call.
+//
+// Every write a slot takes sets aside the blocks it will need in
+// fs->bitmap.reserved, where no other allocation can take them, or isn't
+// held back. The flush draws on them (see reserve_open) and gives back
+// what it didn't need, so it never runs out of space for a write that
+// was already accepted.
+
+// the slot holding back writes to inumber, or 0 (under delalloc_lock)
+static struct delalloc *delalloc_find( fs_t *fs, int inumber )
+{
+	int i;
+	if(inumber <= 0){
+		return 0;
+	}
+	for(i = 0; i < DELALLOC_SLOTS; i++){
+		if(fs->delalloc[i].inumber == inumber){
+			return &fs->delalloc[i];
+		}
+	}
+	return 0;
+}
+
+static struct delalloc *delalloc_lookup( fs_t *fs, int inumber )
+{
+	if(__atomic_load_n(&fs->delalloc_used,__ATOMIC_ACQUIRE) == 0){
+		return 0;
+	}
+	pthread_mutex_lock(&fs->delalloc_lock);
+	struct delalloc *d = delalloc_find(fs,inumber);
+	pthread_mutex_unlock(&fs->delalloc_lock);
+	return d;
+}
+
+// frees the slot, and whatever is left of the blocks set aside for it
+static void delalloc_release( fs_t *fs, struct delalloc *d )
+{
+	pthread_mutex_lock(&fs->alloc_lock);
+	fs->bitmap.reserved -= reserve_owed;
+	reserve_owed = 0;
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	pthread_mutex_lock(&fs->delalloc_lock);
+	d->inumber = 0;
+	d->length = 0;
+	d->reserved = 0;
+	__atomic_sub_fetch(&fs->delalloc_used,1,__ATOMIC_RELEASE);
+	pthread_mutex_unlock(&fs->delalloc_lock);
+}
+
+// where the data held back for inumber ends, or 0 if there is none; the
+// caller holds the inode lock
+static int64_t delalloc_end( fs_t *fs, int inumber )
+{
+	struct delalloc *d = delalloc_lookup(fs,inumber);
+	return d ? d->offset+d->length : 0;
+}
+
+// Writes out what inumber has held back, if anything. The caller holds
+// the inode lock exclusively.
+static void delalloc_flush( fs_t *fs, int inumber )
+{
+	struct delalloc *d = delalloc_lookup(fs,inumber);
+	if(!d){
+		return;
+	}
+	// the blocks belong to the writes held back, whichever call flushes them
+	int tag = disk_trace_tag(FS_CALL_WRITE);
+	reserve_owed = d->reserved;
+	write_pieces(fs,inumber,d->data,d->length,d->offset);
+	delalloc_release(fs,d);
+	disk_trace_tag(tag);
+}
+
+// forgets what inumber has held back, for when it is deleted
+static void delalloc_drop( fs_t *fs, int inumber )
+{
+	struct delalloc *d = delalloc_lookup(fs,inumber);
+	if(d){
+		reserve_owed = d->reserved;
+		delalloc_release(fs,d);
+	}
+}
+
+static void delalloc_flush_all( fs_t *fs )
+{
+	int i;
+	for(i = 0; i < DELALLOC_SLOTS; i++){
+		pthread_mutex_lock(&fs->delalloc_lock);
+		int inumber = fs->delalloc[i].inumber;
+		pthread_mutex_unlock(&fs->delalloc_lock);
+		if(inumber > 0){
+			pthread_rwlock_wrlock(inode_lock(fs,inumber));
+			delalloc_flush(fs,inumber);
+			pthread_rwlock_unlock(inode_lock(fs,inumber));
+		}
+	}
+}
+
+// Sets aside what d needs on top of what it has to hold everything up to
+// end. Returns false if the disk doesn't have that much free.
+static bool delalloc_reserve( fs_t *fs, struct delalloc *d, int64_t end )
+{
+	int need = (int)((end-1)/DISK_BLOCK_SIZE - d->offset/DISK_BLOCK_SIZE + 1) + DELALLOC_META - d->reserved;
+	if(need <= 0){
+		return true;
+	}
+	pthread_mutex_lock(&fs->alloc_lock);
+	bool ok = fs->bitmap.nbits-bitmap_count(&fs->bitmap)-fs->bitmap.reserved >= need;
+	if(ok){
+		fs->bitmap.reserved += need;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+	if(ok){
+		d->reserved += need;
+	}
+	return ok;
+}
+
+// Holds a write back if it carries on from what inumber already holds, or
+// if it appends to the file and a slot is free. Returns whether it did;
+// if not, the caller writes it out as usual. The caller holds the inode
+// lock exclusively.
+static bool delalloc_write( fs_t *fs, int inumber, const char *data, int length, int64_t offset )
+{
+	int capacity = DELALLOC_BLOCKS*DISK_BLOCK_SIZE;
+	struct delalloc *d = delalloc_lookup(fs,inumber);
+
+	if((offset+length-1) / DISK_BLOCK_SIZE >= max_file_blocks(fs)){
+		delalloc_flush(fs,inumber);
+		return false; // past what the file can hold, fs_write_r comes up short
+	}
+	if(d && offset == d->offset+d->length && length <= capacity-d->length && delalloc_reserve(fs,d,offset+length)){
+		memcpy(d->data+d->length,data,length);
+		d->length += length;
+		return true;
+	}
+	delalloc_flush(fs,inumber);
+
+	struct fs_inode *inode = inode_get(fs,inumber);
+	if(!inode || inode->isvalid == 0 || offset != inode_size(fs,inode) || length >= capacity){
+		return false;
+	}
+
+	pthread_mutex_lock(&fs->delalloc_lock);
+	d = 0;
+	int i;
+	for(i = 0; i < DELALLOC_SLOTS && !d; i++){
+		if(fs->delalloc[i].inumber == 0){
+			d = &fs->delalloc[i];
+		}
+	}
+	if(d && !d->data){
+		d->data = malloc(capacity);
+		if(!d->data){
+			d = 0;
+		}
+	}
+	if(d){
+		d->inumber = inumber;
+		d->offset = offset;
+		d->length = 0;
+		d->reserved = 0;
+		__atomic_add_fetch(&fs->delalloc_used,1,__ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&fs->delalloc_lock);
+
+	if(!d){
+		return false;
+	}
+	if(!delalloc_reserve(fs,d,offset+length)){
+		delalloc_release(fs,d);
+		return false;
+	}
+	memcpy(d->data,data,length);
+	d->length = length;
+	return true;
+}
+
+int fs_read_r( fs_t *fs, int inumber, char *data, int length, int64_t offset )
+{
+	uint64_t start = stats_start();
+	disk_trace_tag(FS_CALL_READ);
+	if(delalloc_lookup(fs,inumber)){
+		pthread_rwlock_wrlock(inode_lock(fs,inumber));
+		delalloc_flush(fs,inumber);
+		pthread_rwlock_unlock(inode_lock(fs,inumber));
+	}
+
+	pthread_rwlock_rdlock(inode_lock(fs,inumber));
+	int result = read_inode(fs,inumber,data,length,offset);
+	pthread_rwlock_unlock(inode_lock(fs,inumber));
+	stats_end(&fs->stats[FS_STAT_READ],start,result > 0 ? result : 0);
+	return result;
+}
+
+int fs_write_r( fs_t *fs, int inumber, const char *data, int length, int64_t offset )
+{
+	uint64_t start = stats_start();
+	disk_trace_tag(FS_CALL_WRITE);
+	if(fs->mounted == false){return 0;}
+	if(length <= 0){return 0;}
+	if(is_dir(fs,inumber)){
+		printf("Error: inode %d holds the file names\n",inumber);
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(inode_lock(fs,inumber));
+	int done = length;
+	if(!delalloc_write(fs,inumber,data,length,offset)){
+		done = write_pieces(fs,inumber,data,length,offset);
+	}
+	pthread_rwlock_unlock(inode_lock(fs,inumber));
+	stats_end(&fs->stats[FS_STAT_WRITE],start,done > 0 ? done : 0);
+	return done;
+}
+
+// Frees what the tree under *slot holds from logical block keep on. The
+// tree is depth levels of indirect blocks deep (1 for a single indirect
+// block) and starts at logical block base. An indirect block left with
+// nothing under it is freed as well and its slot cleared.
+static void trim_tree( fs_t *fs, int *slot, int depth, int64_t base, int64_t keep )
+{
+	union fs_block block;
+	int64_t span = 1; // blocks under each pointer
+	int k;
+
+	for(k = 1; k < depth; k++){
+		span *= POINTERS_PER_BLOCK;
+	}
+	if(*slot <= 0 || base+span*POINTERS_PER_BLOCK <= keep){
+		return;
+	}
+	if(base >= keep){
+		free_tree(fs,*slot,depth);
+		*slot = 0;
+		return;
+	}
+
+	meta_read(fs,*slot,block.data);
+	bool changed = false, empty = true;
+	for(k = (keep-base)/span; k < POINTERS_PER_BLOCK; k++){
+		int old = block.pointers[k];
+		if(old <= 0){
+			continue;
+		}
+		if(depth == 1){
+			pthread_mutex_lock(&fs->alloc_lock);
+			free_blocks(fs,old,1,false);
+			pthread_mutex_unlock(&fs->alloc_lock);
+			block.pointers[k] = 0;
+		} else{
+			trim_tree(fs,&block.pointers[k],depth-1,base+k*span,keep);
+		}
+		changed = changed || block.pointers[k] != old;
+	}
+	for(k = 0; k < POINTERS_PER_BLOCK && empty; k++){
+		empty = block.pointers[k] <= 0;
+	}
+
+	if(empty){
+		pthread_mutex_lock(&fs->alloc_lock);
+		free_blocks(fs,*slot,1,true);
+		pthread_mutex_unlock(&fs->alloc_lock);
+		*slot = 0;
+	} else if(changed){
+		meta_write(fs,*slot,block.data);
+	}
+}
+
+// Cuts an extent-mapped file's map down to its first keep blocks.
+static void trim_extents( struct fs_map *map, int64_t keep )
+{
+	fs_t *fs = map->fs;
+	struct fs_inode *inode = map->inode;
+	int64_t base = 0;
+	int k, kept = 0;
+
+	pthread_mutex_lock(&fs->alloc_lock);
+	for(k = 0; k < inode->nextents && k < MAX_EXTENTS; k++){
+		struct fs_extent *ext = extent_at(map,k);
+		int length = ext->length;
+		if(base >= keep){
+			if(ext->start > 0){
+				free_blocks(fs,ext->start,ext->length,false);
+			}
+		} else{
+			if(base+length > keep){
+				int cut = keep-base;
+				if(ext->start > 0){
+					free_blocks(fs,ext->start+cut,length-cut,false);
+				}
+				ext->length = cut;
+				map->indirect_dirty = map->indirect_dirty || k >= EXTENTS_PER_INODE;
+			}
+			kept = k+1;
+		}
+		base += length;
+	}
+	inode->nextents = kept;
+
+	if(kept <= EXTENTS_PER_INODE && inode->extentblock > 0){
+		free_blocks(fs,inode->extentblock,1,true);
+		inode->extentblock = 0;
+		map->indirect_dirty = false;
+	}
+	pthread_mutex_unlock(&fs->alloc_lock);
+
+	if(map->indirect_dirty){
+		meta_write(fs,inode->extentblock,map->indirect.data);
+		map->indirect_dirty = false;
+	}
+	map->ext_index = 0;
+	map->ext_base = 0;
+}
+
+// Sets the size of a file. Shrinking frees every block past the new end
+// (discarding it, see free_blocks) and zeroes the rest of the last block,
+// so the bytes a later write leaves in front of itself read as zeros;
+// growing leaves a hole.
+static int truncate_inode( fs_t *fs, int inumber, int64_t length )
+{
+	struct fs_inode *inode = inode_get(fs,inumber);
+	if(!inode || inode->isvalid == 0 || length < 0){
+		return 0;
+	}
+	if((length+DISK_BLOCK_SIZE-1) / DISK_BLOCK_SIZE > max_file_blocks(fs)){
+		return 0;
+	}
+
+	if(is_inline(fs->super.features,inode)){
+		if(length <= INLINE_MAX){
+			if(length < inode->size){
+				memset(inline_data(inode)+length,0,inode->size-length);
+			}
+			inode_set_size(fs,inode,length);
+			inode_put(fs,inumber);
+			return 1;
+		}
+		if(!inline_spill(fs,inumber)){
+			return 0;
+		}
+	}
+
+	struct fs_map map = { .fs = fs, .inode = inode };
+	int64_t keep = (length+DISK_BLOCK_SIZE-1) / DISK_BLOCK_SIZE;
+	int k;
+
+	if(length < inode_size(fs,inode)){
+		if(fs->super.features & FS_FEATURE_EXTENTS){
+			trim_extents(&map,keep);
+		} else{
+			int *direct, *roots[3];
+			int ndirect = inode_pointers(fs,inode,&direct,roots);
+			int64_t base = ndirect, span = POINTERS_PER_BLOCK;
+
+			pthread_mutex_lock(&fs->alloc_lock);
+			for(k = keep; k < ndirect; k++){
+				if(direct[k] > 0){
+					free_blocks(fs,direct[k],1,false);
+					direct[k] = 0;
+				}
+			}
+			pthread_mutex_unlock(&fs->alloc_lock);
+
+			for(k = 0; k < 3 && roots[k]; k++){
+				trim_tree(fs,roots[k],k+1,base,keep);
+				base += span;
+				span *= POINTERS_PER_BLOCK;
+			}
+		}
+
+		int tail = length % DISK_BLOCK_SIZE;
+		int blocknum = tail ? map_block(&map,keep-1,false,0) : 0;
+		if(blocknum > 0){
+			union fs_block block;
+			cache_read_r(fs->cache,blocknum,block.data);
+			memset(block.data+tail,0,DISK_BLOCK_SIZE-tail);
+			cache_write_r(fs->cache,blocknum,block.data);
+		}
+	}
+
+	inode_set_size(fs,inode,length);
+	inode_put(fs,inumber);
+	return 1;
+}
+
+int fs_truncate_r( fs_t *fs, int inumber, int64_t length )
+{
+	uint64_t start = stats_start();
+	disk_trace_tag(FS_CALL_TRUNCATE);
+	if(fs->mounted == false){return 0;}
+	if(is_dir(fs,inumber)){
+		printf("Error: inode %d holds the file names\n",inumber);
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(inode_lock(fs,inumber));
+	delalloc_flush(fs,inumber);
+	if(fs->journal) journal_begin(fs->journal,JOURNAL_OP_BLOCKS);
+	int result = truncate_inode(fs,inumber,length);
+	if(fs->journal) journal_end(fs->journal,JOURNAL_OP_BLOCKS);
+	pthread_rwlock_unlock(inode_lock(fs,inumber));
+	if(!fs->journal) settle_frees(fs);
+	stats_end(&fs->stats[FS_STAT_TRUNCATE],start,0);
+	return result;
+}
+
+// Makes everything written so far durable. With a journal that is one
+// commit, shared with whoever else asks at the same moment.
+int fs_sync_r( fs_t *fs )
+{
+	uint64_t start = stats_start();
+	disk_trace_tag(FS_CALL_SYNC);
+	int result;
+	if(fs->mounted == false){
+		printf("Error: disk not mounted\n");
+		return 0;
+	}
+	delalloc_flush_all(fs);
+	if(fs->journal){
+		result = journal_commit(fs->journal);
+	} else{
+		cache_flush_r(fs->cache);
+		result = disk_sync_r(fs->disk);
+	}
+	stats_end(&fs->stats[FS_STAT_SYNC],start,0);
+	return result;
+}
+
+// NAMES
+// Names live in one directory file, whose inode the superblock records
+// once fs_link_r has made it. The directory is a linear hash table: a
+// name goes in bucket hash%2^level, or hash%2^(level+1) if that bucket has
+// already been split, and whenever the table is more than DIR_FILL_PERCENT
+// full the bucket at split is split in two. The table grows a bucket at a
+// time, and a lookup reads the header and one bucket however many names
+// there are. A bucket that fills up anyway chains on to overflow blocks,
+// handed out from the top of what the file can map downwards so they
+// never get in the way of new buckets. Both are allocated DIR_GROW at a
+// time, so they stay in long runs on the disk (and in few extents). The
+// directory's blocks are metadata, read and written with meta_read and
+// meta_write, so a change to the names is as atomic as any other.
+
+#define DIR_MAGIC        0x44495231
+#define DIR_FILL_PERCENT 75
+#define DIR_CHAIN_MAX    8  // most blocks one bucket may take, overflow included
+#define DIR_CREDITS      24 // a split or an insert, and what allocating for it changes
+#define DIR_GROW         64 // blocks the directory grows by at a time, at either end
+
+// FNV-1a
+static unsigned name_hash( const char *name )
+{
+	unsigned hash = 2166136261u;
+	while(*name){
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+	}
+	return hash;
+}
+
+static int dir_buckets( const struct fs_dirheader *h )
+{
+	return (1 << h->level) + h->split;
+}
+
+static int dir_bucket( const struct fs_dirheader *h, unsigned hash )
+{
+	unsigned b = hash & ((1u << h->level) - 1);
+	if(b < (unsigned)h->split){
+		b = hash & ((2u << h->level) - 1);
+	}
+	return b;
+}
+
+// the disk block behind block logical of the directory, or 0 if there is none
+static int dir_block( fs_t *fs, int logical )
+{
+	struct fs_map map = { .fs = fs, .inode = inode_get(fs,fs->super.dirinode) };
+	int blocknum = map_block(&map,logical,false,0);
+	int i;
+	for(i = 0; i < 3; i++){
+		map_release(&map,i);
+	}
+	return (blocknum > 0) ? blocknum : 0;
+}
+
+// allocates count zeroed blocks of the directory from first on, false if
+// the disk is full
+static bool dir_grow( fs_t *fs, int first, int count )
+{
+	char *zeros = calloc(count,DISK_BLOCK_SIZE);
+	if(!zeros){
+		return false;
+	}
+	int length = count*DISK_BLOCK_SIZE;
+	bool ok = write_inode(fs,fs->super.dirinode,zeros,length,(int64_t)first*DISK_BLOCK_SIZE) == length;
+	free(zeros);
+	return ok;
+}
+
+// reads block logical of the directory, a block never written reads as zeros
+static int dir_read( fs_t *fs, int logical, union fs_block *block )
+{
+	int blocknum = dir_block(fs,logical);
+	if(blocknum > 0){
+		meta_read(fs,blocknum,block->data);
+	} else{
+		memset(block->data,0,DISK_BLOCK_SIZE);
+	}
+	return blocknum;
+}
+
+// checks a name and works out its hash, false if it won't do
+static bool name_ok( const char *name, unsigned *hash )
+{
+	size_t length = name ? strlen(name) : 0;
+	if(length == 0 || length > FS_NAME_MAX){
+		printf("Error: names must be 1 to %d bytes long\n",FS_NAME_MAX);
+		return false;
+	}
+	*hash = name_hash(name);
+	return true;
+}
+
+// Makes an empty directory and records it in the superblock, under
+// dir_lock held exclusively. Returns false if there is no room for it.
+static bool dir_create( fs_t *fs )
+{
+	union fs_block block;
+	int dir = create_inode(fs);
+	if(dir <= 0){
+		return false;
+	}
+	if(fs->journal) journal_begin(fs->journal,DIR_CREDITS);
+
+	// its blocks are mapped like any file's, never held inline
+	struct fs_inode *inode = inode_get(fs,dir);
+	if(fs->super.features & FS_FEATURE_INLINE){
+		set_inline(inode,false);
+		inode_put(fs,dir);
+	}
+	__atomic_store_n(&fs->super.dirinode,dir,__ATOMIC_RELEASE);
+
+	int64_t limit = max_file_blocks(fs);
+	bool ok = dir_grow(fs,0,2);
+	if(ok){
+		memset(block.data,0,DISK_BLOCK_SIZE);
+		block.dirheader.magic = DIR_MAGIC;
+		block.dirheader.buckets = 1;
+		block.dirheader.overflow = (limit < INT_MAX) ? limit : INT_MAX;
+		block.dirheader.overflowlow = block.dirheader.overflow;
+		meta_write(fs,dir_block(fs,0),block.data);
+
+		meta_read(fs,0,block.data);
+		block.super.dirinode = dir;
+		meta_write(fs,0,block.data);
+	}
+
+	if(fs->journal) journal_end(fs->journal,DIR_CREDITS);
+
+	if(!ok){
+		__atomic_store_n(&fs->super.dirinode,0,__ATOMIC_RELEASE);
+		pthread_rwlock_wrlock(inode_lock(fs,dir));
+		if(fs->journal) journal_begin(fs->journal,JOURNAL_OP_BLOCKS);
+		delete_inode(fs,dir);
+		if(fs->journal) journal_end(fs->journal,JOURNAL_OP_BLOCKS);
+		pthread_rwlock_unlock(inode_lock(fs,dir));
+		printf("Error: no room for the names directory\n");
+	}
+	return ok;
+}
+
+// Looks name up in the directory. Returns the inode it stands for, or 0,
+// and when found leaves the block holding it in block, its place in
+// *logical and *slot, and the block before it in the chain in *prev (0
+// if it is in the bucket's own block).
+static int dir_find( fs_t *fs, const struct fs_dirheader *h, const char *name, unsigned hash,
+	union fs_block *block, int *logical, int *slot, int *prev )
+{
+	int at = 1+dir_bucket(h,hash), before = 0;
+	int i;
+
+	while(at > 0){
+		dir_read(fs,at,block);
+		for(i = 0; i < (int)DIRENTS_PER_BLOCK; i++){
+			struct fs_dirent *e = &block->dir.entries[i];
+			if(e->inumber > 0 && e->hash == hash && !strcmp(e->name,name)){
+				if(logical) *logical = at;
+				if(slot) *slot = i;
+				if(prev) *prev = before;
+				return e->inumber;
+			}
+		}
+		before = at;
+		at = block->dir.next;
+	}
+	return 0;
+}
+
+// an overflow block to add to a chain, zeroed, or 0 if the directory is full
+static int dir_overflow( fs_t *fs, struct fs_dirheader *h )
+{
+	union fs_block block;
+	int logical = h->freeoverflow;
+
+	if(logical > 0){
+		int blocknum = dir_read(fs,logical,&block);
+		h->freeoverflow = block.dir.next;
+		memset(block.data,0,DISK_BLOCK_SIZE);
+		meta_write(fs,blocknum,block.data);
+		return logical;
+	}
+	if(h->overflow == h->overflowlow){
+		int grow = DIR_GROW;
+		if(h->overflowlow-grow <= h->buckets){
+			grow = h->overflowlow-h->buckets-1;
+		}
+		if(grow <= 0 || !dir_grow(fs,h->overflowlow-grow,grow)){
+			return 0;
+		}
+		h->overflowlow -= grow;
+	}
+	return --h->overflow;
+}
+
+// writes out entries as the chain that starts at the bucket block first
+// and goes on through the overflow blocks in spare, taking as many as it
+// needs; returns how many of spare it took
+static int dir_fill( fs_t *fs, int first, struct fs_dirent *entries, int count, int *spare )
+{
+	union fs_block block;
+	int at = first, used = 0, done = 0;
+
+	for(;;){
+		int n = count-done;
+		if(n > (int)DIRENTS_PER_BLOCK){
+			n = DIRENTS_PER_BLOCK;
+		}
+		memset(block.data,0,DISK_BLOCK_SIZE);
+		memcpy(block.dir.entries,entries+done,n*sizeof(struct fs_dirent));
+		block.dir.count = n;
+		done += n;
+		if(done < count){
+			block.dir.next = spare[used++];
+		}
+		meta_write(fs,dir_block(fs,at),block.data);
+		if(done >= count){
+			return used;
+		}
+		at = block.dir.next;
+	}
+}
+
+// Splits the bucket at h->split in two, moving the names that now hash to
+// the new bucket over to it. The two reuse the old chain's overflow
+// blocks, which is always enough, and hand back any they don't need.
+static void dir_split( fs_t *fs, struct fs_dirheader *h )
+{
+	union fs_block block;
+	int old = h->split, new = dir_buckets(h);
+	struct fs_dirent entries[DIR_CHAIN_MAX*DIRENTS_PER_BLOCK];
+	int spare[DIR_CHAIN_MAX];
+	int nspare = 0, count = 0, moved = 0;
+	int i;
+
+	if(new >= h->buckets){
+		int grow = DIR_GROW;
+		if(1+h->buckets+grow > h->overflowlow){
+			grow = h->overflowlow-1-h->buckets;
+		}
+		if(grow <= 0 || !dir_grow(fs,1+h->buckets,grow)){
+			return; // no room to grow, buckets just chain further
+		}
+		h->buckets += grow;
+	}
+
+	int at = 1+old;
+	while(at > 0){
+		dir_read(fs,at,&block);
+		for(i = 0; i < (int)DIRENTS_PER_BLOCK; i++){
+			if(block.dir.entries[i].inumber > 0){
+				entries[count++] = block.dir.entries[i];
+			}
+		}
+		at = block.dir.next;
+		if(at > 0 && nspare < DIR_CHAIN_MAX){
+			spare[nspare++] = at;
+		}
+	}
+
+	// the ones with the next bit of the hash set move to the new bucket,
+	// which sits 2^level past the old one
+	struct fs_dirent *moving = malloc(sizeof(struct fs_dirent)*(count > 0 ? count : 1));
+	if(!moving){
+		return;
+	}
+	int kept = 0;
+	for(i = 0; i < count; i++){
+		if(entries[i].hash >> h->level & 1){
+			moving[moved++] = entries[i];
+		} else{
+			entries[kept++] = entries[i];
+		}
+	}
+
+	int used = dir_fill(fs,1+old,entries,kept,spare);
+	used += dir_fill(fs,1+new,moving,moved,spare+used);
+	free(moving);
+
+	for(i = used; i < nspare; i++){
+		int blocknum = dir_read(fs,spare[i],&block);
+		memset(block.data,0,DISK_BLOCK_SIZE);
+		block.dir.next = h->freeoverflow;
+		meta_write(fs,blocknum,block.data);
+		h->freeoverflow = spare[i];
+	}
+
+	if(++h->split == 1 << h->level){
+		h->level++;
+		h->split = 0;
+	}
+}
+
+// Adds a name for inumber, which the caller has checked is not taken.
+// Returns false if its bucket can't take another.
+static bool dir_insert( fs_t *fs, struct fs_dirheader *h, const char *name, unsigned hash, int inumber )
+{
+	union fs_block block;
+	int at = 1+dir_bucket(h,hash), last = at, length = 0;
+	int blocknum, i;
+
+	while(at > 0){
+		blocknum = dir_read(fs,at,&block);
+		if(block.dir.count < (int)DIRENTS_PER_BLOCK){
+			break;
+		}
+		last = at;
+		at = block.dir.next;
+		length++;
+	}
+
+	if(at <= 0){
+		// every block in the chain is full, add one to the end
+		if(length >= DIR_CHAIN_MAX || (at = dir_overflow(fs,h)) <= 0){
+			printf("Error: no room for another name like %s\n",name);
+			return false;
+		}
+		blocknum = dir_read(fs,last,&block);
+		block.dir.next = at;
+		meta_write(fs,blocknum,block.data);
+		blocknum = dir_read(fs,at,&block);
+	}
+
+	for(i = 0; block.dir.entries[i].inumber > 0; i++);
+	struct fs_dirent *e = &block.dir.entries[i];
+	e->inumber = inumber;
+	e->hash = hash;
+	strcpy(e->name,name);
+	block.dir.count++;
+	meta_write(fs,blocknum,block.data);
+
+	h->nentries++;
+	return true;
+}
+
+// locks inumber too, for a caller holding the directory inode's lock
+// exclusively; the two may hash onto the same lock
+static void lock_named( fs_t *fs, int inumber )
+{
+	if(inode_lock(fs,inumber) != inode_lock(fs,fs->super.dirinode)){
+		pthread_rwlock_wrlock(inode_lock(fs,inumber));
+	}
+}
+
+static void unlock_named( fs_t *fs, int inumber )
+{
+	if(inode_lock(fs,inumber) != inode_lock(fs,fs->super.dirinode)){
+		pthread_rwlock_unlock(inode_lock(fs,inumber));
+	}
+}
+
+// Takes entry slot out of directory block logical, read into block, which
+// follows block prev in its chain (0 if it starts one), and counts the
+// name off its inode. The caller holds the directory inode and that inode
+// locked, and writes the header back. Returns whether the block was left
+// empty and came out of the chain.
+static bool dir_remove( fs_t *fs, struct fs_dirheader *h, union fs_block *block, int logical, int slot, int prev )
+{
+	union fs_block before;
+	int inumber = block->dir.entries[slot].inumber;
+	bool gone = false;
+
+	memset(&block->dir.entries[slot],0,sizeof(struct fs_dirent));
+	block->dir.count--;
+
+	// an overflow block left empty comes out of its chain
+	if(block->dir.count == 0 && prev > 0){
+		int prevblock = dir_read(fs,prev,&before);
+		before.dir.next = block->dir.next;
+		meta_write(fs,prevblock,before.data);
+		block->dir.next = h->freeoverflow;
+		h->freeoverflow = logical;
+		gone = true;
+	}
+	meta_write(fs,dir_block(fs,logical),block->data);
+	h->nentries--;
+
+	struct fs_inode *inode = inode_get(fs,inumber);
+	if(inode && inode->nlinks > 0){
+		inode->nlinks--;
+		inode_put(fs,inumber);
+	}
+	return gone;
+}
+
+// Takes away every name inumber still has, for fs_delete_r. That means
+// going through the whole directory, so it stops as soon as the inode's
+// count says there are none left.
+static void dir_forget( fs_t *fs, int inumber )
+{
+	union fs_block header, block;
+	int b, i;
+
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	int dir = fs->super.dirinode;
+	if(dir <= 0){
+		pthread_rwlock_unlock(&fs->dir_lock);
+		return;
+	}
+	pthread_rwlock_wrlock(inode_lock(fs,dir));
+	lock_named(fs,inumber);
+	struct fs_inode *inode = inode_get(fs,inumber);
+	int headblock = dir_read(fs,0,&header);
+	struct fs_dirheader *h = &header.dirheader;
+
+	for(b = 0; b < dir_buckets(h) && inode->nlinks > 0; b++){
+		int at = 1+b, prev = 0;
+		while(at > 0 && inode->nlinks > 0){
+			dir_read(fs,at,&block);
+			int next = block.dir.next;
+			bool gone = false;
+			for(i = 0; i < (int)DIRENTS_PER_BLOCK && !gone; i++){
+				if(block.dir.entries[i].inumber == inumber){
+					if(fs->journal) journal_begin(fs->journal,JOURNAL_OP_BLOCKS);
+					gone = dir_remove(fs,h,&block,at,i,prev);
+					meta_write(fs,headblock,header.data);
+					if(fs->journal) journal_end(fs->journal,JOURNAL_OP_BLOCKS);
+				}
+			}
+			if(!gone){
+				prev = at;
+			}
+			at = next;
+		}
+	}
+
+	// a count the names don't bear out must not keep the inode forever
+	if(inode->nlinks > 0){
+		if(fs->journal) journal_begin(fs->journal,JOURNAL_OP_BLOCKS);
+		inode->nlinks = 0;
+		inode_put(fs,inumber);
+		if(fs->journal) journal_end(fs->journal,JOURNAL_OP_BLOCKS);
+	}
+
+	unlock_named(fs,inumber);
+	pthread_rwlock_unlock(inode_lock(fs,dir));
+	pthread_rwlock_unlock(&fs->dir_lock);
+}
+
+int fs_lookup_r( fs_t *fs, const char *name )
+{
+	uint64_t start = stats_start();
+	disk_trace_tag(FS_CALL_LOOKUP);
+	union fs_block header, block;
+	unsigned hash;
+	int inumber = 0;
+
+	if(fs->mounted == false){
+		printf("Error: disk not mounted\n");
+		return 0;
+	}
+	if(!name_ok(name,&hash)){
+		return 0;
+	}
+
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	int dir = fs->super.dirinode;
+	if(dir > 0){
+		pthread_rwlock_rdlock(inode_lock(fs,dir));
+		dir_read(fs,0,&header);
+		inumber = dir_find(fs,&header.dirheader,name,hash,&block,0,0,0);
+		pthread_rwlock_unlock(inode_lock(fs,dir));
+	}
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	stats_end(&fs->stats[FS_STAT_LOOKUP],start,0);
+	return inumber;
+}
+
+int fs_link_r( fs_t *fs, const char *name, int inumber )
+{
+	uint64_t start = stats_start();
+	disk_trace_tag(FS_CALL_LINK);
+	union fs_block header, block;
+	unsigned hash;
+
+	if(fs->mounted == false){
+		printf("Error: disk not mounted\n");
+		return 0;
+	}
+	if(!name_ok(name,&hash)){
+		return 0;
+	}
+	if(fs->super.magic != FS_MAGIC || fs->super.ninodebitmapblocks == 0){
+		printf("Error: this disk is too old to hold names, format it again\n");
+		return 0;
+	}
+
+	// checked again once it is locked, this just spares making the
+	// directory for a name that can't go in
+	pthread_rwlock_rdlock(inode_lock(fs,inumber));
+	struct fs_inode *inode = inode_get(fs,inumber);
+	bool valid = inode && inode->isvalid;
+	pthread_rwlock_unlock(inode_lock(fs,inumber));
+	if(!valid || is_dir(fs,inumber)){
+		printf("Error: inode %d is not a file\n",inumber);
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	int result = 0;
+	if(fs->super.dirinode > 0 || dir_create(fs)){
+		int dir = fs->super.dirinode;
+		pthread_rwlock_wrlock(inode_lock(fs,dir));
+		// held until the name is in, so the inode can't be deleted under it
+		lock_named(fs,inumber);
+		inode = inode_get(fs,inumber);
+		int headblock = dir_read(fs,0,&header);
+		struct fs_dirheader *h = &header.dirheader;
+
+		if(!inode->isvalid){
+			printf("Error: inode %d is not a file\n",inumber);
+		} else if(inode->nlinks == USHRT_MAX){
+			printf("Error: inode %d has too many names\n",inumber);
+		} else if(dir_find(fs,h,name,hash,&block,0,0,0)){
+			printf("Error: %s already exists\n",name);
+		} else{
+			// grow the table first if it is full enough, as its own change
+			if((int64_t)h->nentries*100 >= (int64_t)dir_buckets(h)*DIRENTS_PER_BLOCK*DIR_FILL_PERCENT){
+				if(fs->journal) journal_begin(fs->journal,DIR_CREDITS);
+				dir_split(fs,h);
+				meta_write(fs,headblock,header.data);
+				if(fs->journal) journal_end(fs->journal,DIR_CREDITS);
+			}
+
+			if(fs->journal) journal_begin(fs->journal,DIR_CREDITS);
+			result = dir_insert(fs,h,name,hash,inumber);
+			if(result){
+				inode->nlinks++;
+				inode_put(fs,inumber);
+			}
+			meta_write(fs,headblock,header.data);
+			if(fs->journal) journal_end(fs->journal,DIR_CREDITS);
+		}
+		unlock_named(fs,inumber);
+		pthread_rwlock_unlock(inode_lock(fs,dir));
+	}
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	stats_end(&fs->stats[FS_STAT_LINK],start,0);
+	return result;
+}
+
+int fs_unlink_r( fs_t *fs, const char *name )
+{
+	uint64_t start = stats_start();
+	disk_trace_tag(FS_CALL_UNLINK);
+	union fs_block header, block;
+	unsigned hash;
+	int logical, slot, prev;
+	int result = 0;
+
+	if(fs->mounted == false){
+		printf("Error: disk not mounted\n");
+		return 0;
+	}
+	if(!name_ok(name,&hash)){
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(&fs->dir_lock);
+	int dir = fs->super.dirinode;
+	if(dir > 0){
+		pthread_rwlock_wrlock(inode_lock(fs,dir));
+		int headblock = dir_read(fs,0,&header);
+		struct fs_dirheader *h = &header.dirheader;
+
+		int inumber = dir_find(fs,h,name,hash,&block,&logical,&slot,&prev);
+		if(inumber > 0){
+			// inode locks come before the transaction, as everywhere else
+			lock_named(fs,inumber);
+			if(fs->journal) journal_begin(fs->journal,JOURNAL_OP_BLOCKS);
+			dir_remove(fs,h,&block,logical,slot,prev);
+			meta_write(fs,headblock,header.data);
+			if(fs->journal) journal_end(fs->journal,JOURNAL_OP_BLOCKS);
+			unlock_named(fs,inumber);
+			result = 1;
+		}
+		pthread_rwlock_unlock(inode_lock(fs,dir));
+	}
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	if(!result){
+		printf("Error: no such name %s\n",name);
+	}
+	stats_end(&fs->stats[FS_STAT_UNLINK],start,0);
+	return result;
+}
+
+int fs_list_r( fs_t *fs, void (*fn)( const char *name, int inumber, void *arg ), void *arg )
+{
+	disk_trace_tag(FS_CALL_LOOKUP);
+	union fs_block header, block;
+	int count = 0;
+	int b, i;
+
+	if(fs->mounted == false){
+		printf("Error: disk not mounted\n");
+		return 0;
+	}
+
+	pthread_rwlock_rdlock(&fs->dir_lock);
+	int dir = fs->super.dirinode;
+	if(dir > 0){
+		pthread_rwlock_rdlock(inode_lock(fs,dir));
+		dir_read(fs,0,&header);
+		for(b = 0; b < dir_buckets(&header.dirheader); b++){
+			int at = 1+b;
+			while(at > 0){
+				dir_read(fs,at,&block);
+				for(i = 0; i < (int)DIRENTS_PER_BLOCK; i++){
+					if(block.dir.entries[i].inumber > 0){
+						fn(block.dir.entries[i].name,block.dir.entries[i].inumber,arg);
+						count++;
+					}
+				}
+				at = block.dir.next;
+			}
+		}
+		pthread_rwlock_unlock(inode_lock(fs,dir));
+	}
+	pthread_rwlock_unlock(&fs->dir_lock);
+
+	return count;
+}
+// BULK BUILDING
+// fs_build_r lays a whole set of files out on a freshly formatted disk in
+// one pass, without going through fs_write_r. File i becomes inode i+1 and
+// gets one contiguous run of blocks, right after the previous file's, with
+// every indirect block just in front of the blocks it points to. Because
+// the layout is worked out ahead, every block is written once and the
+// inode table, the data and the bitmaps each go out as a few long
+// sequential writes. Names are linked at the end through fs_link_r.
+
+#define BUILD_RUN 256 // blocks gathered before they are written out together
+
+// consecutive blocks waiting to go to the disk with one write
+struct build_run {
+	cache_t *cache;
+	int start;
+	int count;
+	char *data;
+	const char *blocks[BUILD_RUN];
+};
+
+static void run_flush( struct build_run *run )
+{
+	if(run->count > 0){
+		cache_write_range_r(run->cache,run->start,run->count,run->blocks);
+	}
+	run->count = 0;
+}
+
+// room for block blocknum in the run, zeroed, flushing the run first if
+// it can't be added to
+static char *run_block( struct build_run *run, int blocknum )
+{
+	if(run->count == BUILD_RUN || (run->count > 0 && blocknum != run->start+run->count)){
+		run_flush(run);
+	}
+	if(run->count == 0){
+		run->start = blocknum;
+	}
+	char *data = run->data + (size_t)run->count*DISK_BLOCK_SIZE;
+	run->blocks[run->count++] = data;
+	memset(data,0,DISK_BLOCK_SIZE);
+	return data;
+}
+
+// the data run, and where the file being laid out comes from
+struct build {
+	struct build_run run;
+	int next;          // next block to hand out
+	int index;
+	int64_t offset;
+	int64_t size;
+	int (*fill)( int index, char *data, int length, int64_t offset, void *arg );
+	void *arg;
+	bool ok;
+};
+
+// how many blocks a tree of the given depth takes to map n data blocks,
+// counting the indirect blocks and the data (depth 0 is the data alone)
+static int64_t tree_blocks( int depth, int64_t n )
+{
+	if(depth == 0 || n == 0){
+		return n;
+	}
+	int64_t span = 1; // data blocks under one pointer
+	int k;
+	for(k = 1; k < depth; k++){
+		span *= POINTERS_PER_BLOCK;
+	}
+	int64_t full = n/span;
+	return 1 + full*tree_blocks(depth-1,span) + tree_blocks(depth-1,n%span);
+}
+
+// writes the next count blocks of the file, reading them from fill
+static void build_data( struct build *b, int64_t count )
+{
+	while(count-- > 0 && b->ok){
+		char *data = run_block(&b->run,b->next++);
+		int length = (b->size-b->offset < DISK_BLOCK_SIZE) ? (int)(b->size-b->offset) : DISK_BLOCK_SIZE;
+		if(b->fill(b->index,data,length,b->offset,b->arg) != length){
+			printf("Error: couldn't read %d bytes of inode %d at %lld\n",length,b->index+1,(long long)b->offset);
+			b->ok = false;
+		}
+		b->offset += length;
+	}
+}
+
+// writes a tree of the given depth mapping the next n blocks of the file,
+// its top indirect block first, and returns where that went
+static int build_tree( struct build *b, int depth, int64_t n )
+{
+	int top = b->next;
+	if(depth == 0){
+		build_data(b,n);
+		return top;
+	}
+
+	int64_t span = 1;
+	int k;
+	for(k = 1; k < depth; k++){
+		span *= POINTERS_PER_BLOCK;
+	}
+
+	union fs_block block;
+	memset(block.data,0,DISK_BLOCK_SIZE);
+	int64_t left = n, at = top+1;
+	for(k = 0; left > 0; k++){
+		int64_t child = (left < span) ? left : span;
+		block.pointers[k] = (int)at;
+		at += tree_blocks(depth-1,child);
+		left -= child;
+	}
+	memcpy(run_block(&b->run,b->next++),block.data,DISK_BLOCK_SIZE);
+
+	for(left = n; left > 0 && b->ok; left -= span){
+		build_tree(b,depth-1,(left < span) ? left : span);
+	}
+	return top;
+}
+
+// how many blocks a file of nblocks data blocks takes in all, with the
+// pointer layout of a block-mapped inode
+static int64_t file_blocks( fs_t *fs, int64_t nblocks )
+{
+	struct fs_inode scratch;
+	int *direct, *roots[3];
+	int ndirect = inode_pointers(fs,&scratch,&direct,roots);
+	int64_t total = 0, span = 1;
+	int depth;
+
+	if(fs->super.features & FS_FEATURE_EXTENTS){
+		return nblocks;
+	}
+	total = (nblocks < ndirect) ? nblocks : ndirect;
+	nblocks -= total;
+	for(depth = 0; depth < 3 && roots[depth] && nblocks > 0; depth++){
+		span *= POINTERS_PER_BLOCK;
+		int64_t n = (nblocks < span) ? nblocks : span;
+		total += tree_blocks(depth+1,n);
+		nblocks -= n;
+	}
+	return total;
+}
+
+// lays out the file b is set up for in inode, writing its blocks
+static void build_file( fs_t *fs, struct build *b, struct fs_inode *inode )
+{
+	int64_t nblocks = (b->size + DISK_BLOCK_SIZE-1) / DISK_BLOCK_SIZE;
+
+	inode->isvalid = 1;
+	if((fs->super.features & FS_FEATURE_INLINE) && b->size <= INLINE_MAX){
+		set_inline(inode,true);
+		inode->size = (int)b->size;
+		if(b->size > 0 && b->fill(b->index,inline_data(inode),(int)b->size,0,b->arg) != b->size){
+			printf("Error: couldn't read %lld bytes of inode %d\n",(long long)b->size,b->index+1);
+			b->ok = false;
+		}
+		return;
+	}
+	inode_set_size(fs,inode,b->size);
+
+	if(fs->super.features & FS_FEATURE_EXTENTS){
+		if(nblocks > 0){
+			inode->nextents = 1;
+			inode->extent[0].start = b->next;
+			inode->extent[0].length = (int)nblocks;
+			build_data(b,nblocks);
+		}
+		return;
+	}
+
+	int *direct, *roots[3];
+	int ndirect = inode_pointers(fs,inode,&direct,roots);
+	int64_t span = 1;
+	int k;
+
+	for(k = 0; k < ndirect && nblocks > 0; k++, nblocks--){
+		direct[k] = b->next;
+		build_data(b,1);
+	}
+	for(k = 0; k < 3 && roots[k] && nblocks > 0; k++){
+		span *= POINTERS_PER_BLOCK;
+		int64_t n = (nblocks < span) ? nblocks : span;
+		*roots[k] = build_tree(b,k+1,n);
+		nblocks -= n;
+	}
+}
+
+// writes a bitmap whose first count bits are set into its blocks
+static void build_bitmap( struct build_run *run, int start, int nblocks, int64_t count )
+{
+	int i;
+	for(i = 0; i < nblocks; i++){
+		char *data = run_block(run,start+i);
+		int64_t bits = count - (int64_t)i*BITS_PER_BLOCK;
+		if(bits <= 0){
+			continue;
+		}
+		if(bits >= BITS_PER_BLOCK){
+			memset(data,0xff,DISK_BLOCK_SIZE);
+			continue;
+		}
+		memset(data,0xff,bits/8);
+		if(bits%8){
+			data[bits/8] = (1 << (bits%8)) - 1;
+		}
+	}
+	run_flush(run);
+}
+
+int fs_build_r( fs_t *fs, int features, const struct fs_build_file *files, int nfiles,
+	int (*fill)( int index, char *data, int length, int64_t offset, void *arg ), void *arg )
+{
+	union fs_block block;
+	int i;
+
+	if(!fs_format_with_r(fs,features)){
+		return 0;
+	}
+	cache_read_r(fs->cache,0,block.data);
+	fs->super = block.super;
+	struct fs_superblock *super = &fs->super;
+
+	int ipb = inodes_per_block(features);
+	int firstdata = super->njournalblocks ? super->journalstart + super->njournalblocks
+	                                      : super->inodebitmapstart + super->ninodebitmapblocks;
+
+	// work the whole layout out first, so nothing is written that won't fit
+	int64_t needed = firstdata;
+	if(nfiles >= super->ninodes){
+		printf("Error: %d files but only %d inodes\n",nfiles,super->ninodes-1);
+		return 0;
+	}
+	for(i = 0; i < nfiles; i++){
+		int64_t nblocks = (files[i].size + DISK_BLOCK_SIZE-1) / DISK_BLOCK_SIZE;
+		if((features & FS_FEATURE_INLINE) && files[i].size <= INLINE_MAX){
+			continue;
+		}
+		if(nblocks > max_file_blocks(fs)){
+			printf("Error: inode %d would be %lld bytes, too big for this layout\n",i+1,(long long)files[i].size);
+			return 0;
+		}
+		needed += file_blocks(fs,nblocks);
+	}
+	if(needed > super->nblocks){
+		printf("Error: the files need %lld blocks and the disk has %d\n",(long long)needed,super->nblocks);
+		return 0;
+	}
+
+	struct build b;
+	struct build_run inodes;
+	memset(&b,0,sizeof(b));
+	memset(&inodes,0,sizeof(inodes));
+	b.run.cache = inodes.cache = fs->cache;
+	b.run.data = malloc((size_t)BUILD_RUN*DISK_BLOCK_SIZE);
+	inodes.data = malloc((size_t)BUILD_RUN*DISK_BLOCK_SIZE);
+	if(!b.run.data || !inodes.data){
+		printf("Error: out of memory\n");
+		free(b.run.data);
+		free(inodes.data);
+		return 0;
+	}
+	b.next = firstdata;
+	b.fill = fill;
+	b.arg = arg;
+	b.ok = true;
+
+	// the inode table in inode order, beside the data in the same order
+	char *inodeblock = 0;
+	for(i = 0; i < nfiles && b.ok; i++){
+		int inumber = i+1;
+		if(i == 0 || inumber%ipb == 0){
+			inodeblock = run_block(&inodes,1 + inumber/ipb);
+		}
+		b.index = i;
+		b.offset = 0;
+		b.size = files[i].size;
+		build_file(fs,&b,inode_at(features,inodeblock,inumber%ipb));
+	}
+	run_flush(&b.run);
+	run_flush(&inodes);
+
+	if(b.ok){
+		build_bitmap(&inodes,super->bitmapstart,super->nbitmapblocks,b.next);
+		build_bitmap(&inodes,super->inodebitmapstart,super->ninodebitmapblocks,nfiles+1);
+		cache_flush_r(fs->cache);
+	}
+	free(b.run.data);
+	free(inodes.data);
+	if(!b.ok){
+		return 0;
+	}
+
+	// and the names, the ordinary way
+	if(!fs_mount_r(fs)){
+		return 0;
+	}
+	for(i = 0; i < nfiles && b.ok; i++){
+		if(files[i].name && !fs_link_r(fs,files[i].name,i+1)){
+			b.ok = false;
+		}
+	}
+	return fs_unmount_r(fs) && b.ok;
+}
+
+
+int fs_histograms_r( fs_t *fs, struct stats_entry *entries, int max )
+{
+	int i;
+	for(i = 0; i < FS_STATS && i < max; i++){
+		entries[i].name = stat_names[i];
+		entries[i].unit = (i == FS_STAT_BLOCK_SCAN || i == FS_STAT_INODE_SCAN) ? "bits" : "ns";
+		entries[i].h = &fs->stats[i];
+	}
+	return i;
+}
+
+void fs_stats_reset_r( fs_t *fs )
+{
+	int i;
+	for(i = 0; i < FS_STATS; i++){
+		histogram_reset(&fs->stats[i]);
+	}
+}
+
+const char *fs_call_name( int call )
+{
+	static const char *names[FS_CALLS] = {
+		"background", "format", "mount", "unmount", "create", "delete",
+		"getsize", "read", "write", "truncate", "sync", "debug",
+		"lookup", "link", "unlink",
+	};
+	return (call >= 0 && call < FS_CALLS) ? names[call] : "unknown";
+}
+
+//////////// HANDLES /////////////
+
+static fs_t *fs_new( cache_t *cache )
+{
+	int i;
+	fs_t *fs = calloc(1,sizeof(fs_t));
+	if(!fs) return 0;
+
+	fs->cache = cache;
+	fs->disk = cache ? cache_disk(cache) : 0;
+	for(i = 0; i < INODE_LOCKS; i++){
+		pthread_rwlock_init(&fs->inode_locks[i],0);
+	}
+	pthread_mutex_init(&fs->alloc_lock,0);
+	pthread_mutex_init(&fs->table_lock,0);
+	pthread_mutex_init(&fs->readahead_lock,0);
+	pthread_mutex_init(&fs->delalloc_lock,0);
+	pthread_rwlock_init(&fs->dir_lock,0);
+
+	return fs;
+}
+
+fs_t *fs_attach( cache_t *cache )
+{
+	return fs_new(cache);
+}
+
+fs_t *fs_open( const char *image, int nblocks )
+{
+	disk_t *disk = disk_open(image,nblocks,DISK_BACKEND_PREAD);
+	if(!disk) return 0;
+
+	if(!disk_async_init_r(disk,DISK_DEFAULT_QUEUE_DEPTH,DISK_ASYNC_AUTO)){
+		disk_close_r(disk);
+		return 0;
+	}
+
+	cache_t *cache = cache_open(disk,CACHE_DEFAULT_BLOCKS);
+	if(!cache){
+		disk_close_r(disk);
+		return 0;
+	}
+
+	fs_t *fs = fs_new(cache);
+	if(!fs){
+		cache_close_r(cache);
+		disk_close_r(disk);
+		return 0;
+	}
+	fs->owned = true;
+
+	return fs;
+}
+
+void fs_close( fs_t *fs )
+{
+	int i;
+
+	if(fs->mounted){
+		fs_unmount_r(fs);
+	}
+	if(fs->owned){
+		cache_close_r(fs->cache);
+		disk_close_r(fs->disk);
+	}
+
+	for(i = 0; i < INODE_LOCKS; i++){
+		pthread_rwlock_destroy(&fs->inode_locks[i]);
+	}
+	pthread_mutex_destroy(&fs->alloc_lock);
+	pthread_mutex_destroy(&fs->table_lock);
+	pthread_mutex_destroy(&fs->readahead_lock);
+	pthread_mutex_destroy(&fs->delalloc_lock);
+	pthread_rwlock_destroy(&fs->dir_lock);
+	free(fs);
+}
+
+// The original single-filesystem interface. The default filesystem picks
+// up whatever cache_init last set up each time it is formatted, mounted or
+// inspected, which is when the shell may have switched disks under it.
+
+fs_t *fs_default()
+{
+	if(!default_fs){
+		default_fs = fs_new(0);
+		if(!default_fs){
+			printf("ERROR: out of memory for the filesystem\n");
+			abort();
+		}
+	}
+	return default_fs;
+}
+
+static fs_t *fs_default_on_cache()
+{
+	fs_t *fs = fs_default();
+	if(!fs->mounted){
+		fs->cache = cache_default();
+		fs->disk = fs->cache ? cache_disk(fs->cache) : 0;
+	}
+	return fs;
+}
+
+void fs_debug()
+{
+	fs_debug_r(fs_default_on_cache());
+}
+
+int fs_format()
+{
+	return fs_format_r(fs_default_on_cache());
+}
+
+int fs_format_with( int features )
+{
+	return fs_format_with_r(fs_default_on_cache(),features);
+}
+
+int fs_build( int features, const struct fs_build_file *files, int nfiles,
+	int (*fill)( int index, char *data, int length, int64_t offset, void *arg ), void *arg )
+{
+	return fs_build_r(fs_default_on_cache(),features,files,nfiles,fill,arg);
+}
+
+int fs_mount()
+{
+	return fs_mount_r(fs_default_on_cache());
+}
+
+int fs_unmount()
+{
+	return fs_unmount_r(fs_default());
+}
+
+int fs_ismounted()
+{
+	return fs_ismounted_r(fs_default());
+}
+
+int fs_create()
+{
+	return fs_create_r(fs_default());
+}
+
+int fs_delete( int inumber )
+{
+	return fs_delete_r(fs_default(),inumber);
+}
+
+int64_t fs_getsize( int inumber )
+{
+	return fs_getsize_r(fs_default(),inumber);
+}
+
+int fs_sync()
+{
+	return fs_sync_r(fs_default());
+}
+
+int fs_read( int inumber, char *data, int length, int64_t offset )
+{
+	return fs_read_r(fs_default(),inumber,data,length,offset);
+}
+
+int fs_write( int inumber, const char *data, int length, int64_t offset )
+{
+	return fs_write_r(fs_default(),inumber,data,length,offset);
+}
+
+int fs_truncate( int inumber, int64_t length )
+{
+	return fs_truncate_r(fs_default(),inumber,length);
+}
+
+int fs_lookup( const char *name )
+{
+	return fs_lookup_r(fs_default(),name);
+}
+
+int fs_link( const char *name, int inumber )
+{
+	return fs_link_r(fs_default(),name,inumber);
+}
+
+int fs_unlink( const char *name )
+{
+	return fs_unlink_r(fs_default(),name);
+}
+
+int fs_list( void (*fn)( const char *name, int inumber, void *arg ), void *arg )
+{
+	return fs_list_r(fs_default(),fn,arg);
 }
@@ -1,15 +1,124 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stdint.h>
+
+#define FS_FEATURE_EXTENTS   1 // inodes map their data with (start,length) extents
+#define FS_FEATURE_LARGEFILE 2 // double and triple indirect blocks, 64-bit sizes
+#define FS_FEATURE_INLINE    4 // 128-byte inodes that hold small files themselves
+
+// The call a filesystem is working on, as it tags disk traces with
+// disk_trace_tag. Background work, like the journal's timed commits, has
+// no call of its own.
+#define FS_CALL_NONE     0
+#define FS_CALL_FORMAT   1
+#define FS_CALL_MOUNT    2
+#define FS_CALL_UNMOUNT  3
+#define FS_CALL_CREATE   4
+#define FS_CALL_DELETE   5
+#define FS_CALL_GETSIZE  6
+#define FS_CALL_READ     7
+#define FS_CALL_WRITE    8
+#define FS_CALL_TRUNCATE 9
+#define FS_CALL_SYNC     10
+#define FS_CALL_DEBUG    11
+#define FS_CALL_LOOKUP   12
+#define FS_CALL_LINK     13
+#define FS_CALL_UNLINK   14
+#define FS_CALLS         15
+
+#define FS_NAME_MAX      55 // longest name fs_link takes, in bytes
+
+struct cache;
+struct stats_entry;
+
+typedef struct fs fs_t;
+
+// A filesystem handle. fs_open opens the image with its own disk and
+// cache, fs_attach puts a filesystem on a cache the caller already has
+// (and keeps), and fs_close unmounts if needed and lets go of everything
+// the handle opened. Handles are independent of each other and of the
+// default one below, so one process can serve many images at once. The
+// *_r calls are the same as the ones below without the suffix.
+fs_t *fs_open( const char *image, int nblocks );
+fs_t *fs_attach( struct cache *c );
+void  fs_close( fs_t *fs );
+
+void fs_debug_r( fs_t *fs );
+int  fs_format_r( fs_t *fs );
+int  fs_format_with_r( fs_t *fs, int features );
+int  fs_mount_r( fs_t *fs );
+int  fs_unmount_r( fs_t *fs );
+int  fs_ismounted_r( fs_t *fs );
+
+int  fs_create_r( fs_t *fs );
+int  fs_delete_r( fs_t *fs, int inumber );
+int64_t fs_getsize_r( fs_t *fs, int inumber );
+
+int  fs_read_r( fs_t *fs, int inumber, char *data, int length, int64_t offset );
+int  fs_write_r( fs_t *fs, int inumber, const char *data, int length, int64_t offset );
+int  fs_truncate_r( fs_t *fs, int inumber, int64_t length );
+int  fs_sync_r( fs_t *fs );
+
+// Names for inodes, in one flat namespace kept on the disk. fs_lookup_r
+// returns the inode a name stands for, or 0. fs_link_r gives an inode a
+// name (an inode may have several), and fs_unlink_r takes a name away.
+// Each inode counts its names, and fs_delete_r takes away any it still
+// has, which costs a pass over the whole directory. fs_list_r calls fn for every name and returns
+// how many there were; fn must not change the names itself.
+int  fs_lookup_r( fs_t *fs, const char *name );
+int  fs_link_r( fs_t *fs, const char *name, int inumber );
+int  fs_unlink_r( fs_t *fs, const char *name );
+int  fs_list_r( fs_t *fs, void (*fn)( const char *name, int inumber, void *arg ), void *arg );
+
+// Formats the disk with features and puts nfiles files on it in one pass,
+// file i as inode i+1 with the name files[i].name (none if 0), each in one
+// contiguous run of blocks. fill is asked for every byte of every file in
+// order, length bytes of file index at offset, and must return length.
+// Returns 0 if the files don't fit or fill fails, which leaves the disk
+// to be formatted again.
+struct fs_build_file {
+	const char *name;
+	int64_t size;
+};
+
+int  fs_build_r( fs_t *fs, int features, const struct fs_build_file *files, int nfiles,
+	int (*fill)( int index, char *data, int length, int64_t offset, void *arg ), void *arg );
+
+// Latency histograms for each call above from fs_mount_r on, kept while
+// stats_enable has them on, plus how many bits each block and inode
+// allocation searched. They last as long as the handle, across mounts.
+int  fs_histograms_r( fs_t *fs, struct stats_entry *entries, int max );
+void fs_stats_reset_r( fs_t *fs );
+
+// the name of one of the FS_CALL_* tags
+const char *fs_call_name( int call );
+
+// The default filesystem, on top of the default cache from cache_init.
+fs_t *fs_default();
+
 void fs_debug();
+void fs_set_scan_threads( int n );
 int  fs_format();
+int  fs_format_with( int features );
+int  fs_build( int features, const struct fs_build_file *files, int nfiles,
+	int (*fill)( int index, char *data, int length, int64_t offset, void *arg ), void *arg );
 int  fs_mount();
+int  fs_unmount();
+int  fs_ismounted();
 
 int  fs_create();
 int  fs_delete( int inumber );
-int  fs_getsize();
+int64_t fs_getsize( int inumber );
+
+int  fs_read( int inumber, char *data, int length, int64_t offset );
+int  fs_write( int inumber, const char *data, int length, int64_t offset );
+int  fs_truncate( int inumber, int64_t length );
+int  fs_sync();
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+int  fs_lookup( const char *name );
+int  fs_link( const char *name, int inumber );
+int  fs_unlink( const char *name );
+int  fs_list( void (*fn)( const char *name, int inumber, void *arg ), void *arg );
 
 #endif
@@ -0,0 +1,721 @@
+
+#include "fs.h"
+#include "disk.h"
+#include "cache.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// Repeatable filesystem benchmark. It formats the disk and runs, in order,
+// whichever of these workloads -w names (all of them by default):
+//
+//   seqwrite  writes one file of -s MB front to back, -b bytes per call
+//   seqread   reads that file back front to back with a cold cache
+//   randread  -n reads of -b bytes at random block-aligned offsets in it
+//   churn     -n small files of -f bytes created and written, keeping the
+//             last CHURN_LIVE alive and deleting the one before them
+//   copy      copies an -s MB host file into a new inode and back out, the
+//             way the shell's copyin and copyout do
+//   mount     -r cold mounts of the disk as the workloads left it, then of
+//             each image named after <nblocks>, copied onto <diskfile>
+//
+// Every workload starts from a freshly opened cache and ends with
+// everything it wrote on the disk, so the block counts include the
+// write-back. For each one it reports operations per second, MB/s, the
+// median and 99th percentile latency of single operations, and disk block
+// reads and writes per operation. The table goes to standard output, and
+// -j also writes the same numbers as JSON to a file, or instead of the
+// table with -j -. The time spent making up and checking data is left out.
+// Messages from the filesystem itself are thrown away unless -v is given,
+// and -T runs everything with the filesystem's own latency histograms
+// turned on, to see what they cost. The random offsets come from a fixed
+// seed (-S), so runs are comparable.
+//
+// The disk is formatted as fs_format does, block-mapped with double and
+// triple indirect blocks (-l, the default), or with -x extent-mapped.
+// -i formats with inline inodes, which keep churn files of up to 116 bytes
+// out of data blocks.
+// Everything on <diskfile> is destroyed; the images given are only read.
+
+#define CHURN_LIVE 64
+#define COPY_CHUNK 16384
+#define MAX_RESULTS 32
+
+struct result {
+	char name[64];
+	int ops;
+	long long bytes;     // data moved by the operations
+	double seconds;      // wall time for all of them, including the final sync
+	double p50;          // per-operation latency, in seconds
+	double p99;
+	double reads;        // disk blocks per operation
+	double writes;
+};
+
+static int cacheblocks = CACHE_DEFAULT_BLOCKS;
+static int backend = DISK_BACKEND_PREAD;
+static int features = FS_FEATURE_LARGEFILE;
+static int filemb = 4;
+static int iosize = 65536;
+static int nops = 2000;
+static int smallsize = 4096;
+static int mounts = 20;
+static unsigned seed = 1;
+
+static const char *diskfile;
+static int nblocks;
+
+static disk_t *disk = 0;
+static cache_t *cache = 0;
+static fs_t *fs = 0;
+static FILE *report;
+
+static int seqfile = 0;   // the file seqwrite leaves for seqread and randread
+
+static struct result results[MAX_RESULTS];
+static int nresults = 0;
+
+// the operation being timed and everything measured so far
+static double *latency = 0;
+static int nlatency = 0;
+static double started;
+static double aside;       // time spent making and checking data, not counted
+static struct disk_stats before;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static int compare_doubles( const void *a, const void *b )
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile( double *sorted, int n, int p )
+{
+	if(n == 0) return 0;
+	int i = (int)((long long)n*p/100);
+	if(i >= n) i = n-1;
+	return sorted[i];
+}
+
+// opens a cache on the disk and mounts it, so every workload starts cold
+static int bench_mount()
+{
+	cache = cache_open(disk,cacheblocks);
+	if(!cache) return 0;
+	fs = fs_attach(cache);
+	if(!fs || !fs_mount_r(fs)) {
+		if(fs) fs_close(fs);
+		cache_close_r(cache);
+		fs = 0;
+		cache = 0;
+		return 0;
+	}
+	return 1;
+}
+
+static void bench_unmount()
+{
+	fs_close(fs);
+	cache_close_r(cache);
+	fs = 0;
+	cache = 0;
+}
+
+static int bench_open( const char *image, int n )
+{
+	disk = disk_open(image,n,backend);
+	if(!disk) return 0;
+	if(!disk_async_init_r(disk,DISK_DEFAULT_QUEUE_DEPTH,DISK_ASYNC_AUTO)) {
+		disk_close_r(disk);
+		disk = 0;
+		return 0;
+	}
+	return 1;
+}
+
+static void bench_close()
+{
+	disk_close_r(disk);
+	disk = 0;
+}
+
+static int bench_start( int ops )
+{
+	free(latency);
+	latency = malloc(sizeof(double)*(ops > 0 ? ops : 1));
+	if(!latency) return 0;
+	nlatency = 0;
+	disk_stats_r(disk,&before);
+	aside = 0;
+	started = now();
+	return 1;
+}
+
+static void bench_op( double start )
+{
+	latency[nlatency++] = now() - start;
+}
+
+static void bench_end( const char *name, long long bytes )
+{
+	struct result *r = &results[nresults];
+	struct disk_stats after;
+
+	r->seconds = now() - started - aside;
+	disk_stats_r(disk,&after);
+
+	if(nresults < MAX_RESULTS-1) nresults++;
+	snprintf(r->name,sizeof(r->name),"%s",name);
+	r->ops = nlatency;
+	r->bytes = bytes;
+
+	qsort(latency,nlatency,sizeof(double),compare_doubles);
+	r->p50 = percentile(latency,nlatency,50);
+	r->p99 = percentile(latency,nlatency,99);
+
+	int ops = nlatency > 0 ? nlatency : 1;
+	r->reads = (double)(after.reads - before.reads) / ops;
+	r->writes = (double)(after.writes - before.writes) / ops;
+}
+
+// the byte at offset in the benchmark's files, so reads can be checked
+static char pattern( int64_t offset )
+{
+	return (char)((offset/7) ^ (offset*13));
+}
+
+static void fill( char *buffer, int64_t offset, int length )
+{
+	double start = now();
+	int i;
+	for(i = 0; i < length; i++) {
+		buffer[i] = pattern(offset+i);
+	}
+	aside += now() - start;
+}
+
+static int check( const char *buffer, int64_t offset, int length )
+{
+	double start = now();
+	int i;
+	for(i = 0; i < length; i++) {
+		if(buffer[i] != pattern(offset+i)) {
+			fprintf(report,"ERROR: byte %lld read back wrong\n",(long long)(offset+i));
+			return 0;
+		}
+	}
+	aside += now() - start;
+	return 1;
+}
+
+static int64_t filesize()
+{
+	return (int64_t)filemb*1024*1024;
+}
+
+static int run_seqwrite()
+{
+	char *buffer = malloc(iosize);
+	int64_t size = filesize();
+	int64_t offset;
+	int ok = 1;
+
+	if(!buffer || !bench_mount()) {
+		free(buffer);
+		return 0;
+	}
+
+	seqfile = fs_create_r(fs);
+	if(seqfile <= 0 || !bench_start((int)((size+iosize-1)/iosize))) {
+		fprintf(report,"ERROR: couldn't create the file for seqwrite\n");
+		bench_unmount();
+		free(buffer);
+		return 0;
+	}
+
+	for(offset = 0; offset < size; offset += iosize) {
+		int length = size-offset < iosize ? (int)(size-offset) : iosize;
+		fill(buffer,offset,length);
+		double start = now();
+		int actual = fs_write_r(fs,seqfile,buffer,length,offset);
+		bench_op(start);
+		if(actual != length) {
+			fprintf(report,"ERROR: seqwrite wrote %d bytes at %lld, not %d\n",actual,(long long)offset,length);
+			ok = 0;
+			break;
+		}
+	}
+	fs_sync_r(fs);
+	cache_flush_r(cache);
+	bench_end("seqwrite",offset);
+
+	bench_unmount();
+	free(buffer);
+	return ok;
+}
+
+// seqread and randread need the file seqwrite makes even when it isn't run
+static int need_seqfile()
+{
+	if(seqfile > 0) return 1;
+
+	int n = nresults;
+	int ok = run_seqwrite();
+	nresults = n;
+	return ok;
+}
+
+static int run_seqread()
+{
+	char *buffer = malloc(iosize);
+	int64_t size = filesize();
+	int64_t offset;
+	int ok = 1;
+
+	if(!buffer || !need_seqfile() || !bench_mount()) {
+		free(buffer);
+		return 0;
+	}
+
+	bench_start((int)((size+iosize-1)/iosize));
+	for(offset = 0; offset < size; offset += iosize) {
+		int length = size-offset < iosize ? (int)(size-offset) : iosize;
+		double start = now();
+		int actual = fs_read_r(fs,seqfile,buffer,length,offset);
+		bench_op(start);
+		if(actual != length || !check(buffer,offset,length)) {
+			fprintf(report,"ERROR: seqread read %d bytes at %lld, not %d\n",actual,(long long)offset,length);
+			ok = 0;
+			break;
+		}
+	}
+	bench_end("seqread",offset);
+
+	bench_unmount();
+	free(buffer);
+	return ok;
+}
+
+static int run_randread()
+{
+	char *buffer = malloc(iosize);
+	int64_t size = filesize();
+	int64_t nslots = (size-iosize)/DISK_BLOCK_SIZE + 1;
+	unsigned rng = seed;
+	long long bytes = 0;
+	int i, ok = 1;
+
+	if(!buffer || !need_seqfile() || !bench_mount()) {
+		free(buffer);
+		return 0;
+	}
+	if(nslots < 1) nslots = 1;
+
+	bench_start(nops);
+	for(i = 0; i < nops; i++) {
+		int64_t offset = (int64_t)(((unsigned long long)rand_r(&rng) << 16 ^ rand_r(&rng)) % nslots) * DISK_BLOCK_SIZE;
+		int length = size-offset < iosize ? (int)(size-offset) : iosize;
+		double start = now();
+		int actual = fs_read_r(fs,seqfile,buffer,length,offset);
+		bench_op(start);
+		if(actual != length || !check(buffer,offset,length)) {
+			fprintf(report,"ERROR: randread read %d bytes at %lld, not %d\n",actual,(long long)offset,length);
+			ok = 0;
+			break;
+		}
+		bytes += actual;
+	}
+	bench_end("randread",bytes);
+
+	bench_unmount();
+	free(buffer);
+	return ok;
+}
+
+static int run_churn()
+{
+	char *buffer = malloc(smallsize);
+	int live[CHURN_LIVE];
+	long long bytes = 0;
+	int i, ok = 1;
+
+	if(!buffer || !bench_mount()) {
+		free(buffer);
+		return 0;
+	}
+	fill(buffer,0,smallsize);
+	memset(live,0,sizeof(live));
+
+	bench_start(nops);
+	for(i = 0; i < nops; i++) {
+		int *slot = &live[i%CHURN_LIVE];
+		double start = now();
+		if(*slot > 0 && !fs_delete_r(fs,*slot)) {
+			fprintf(report,"ERROR: churn couldn't delete inode %d\n",*slot);
+			ok = 0;
+			break;
+		}
+		*slot = fs_create_r(fs);
+		if(*slot <= 0 || fs_write_r(fs,*slot,buffer,smallsize,0) != smallsize) {
+			fprintf(report,"ERROR: churn couldn't create a %d byte file\n",smallsize);
+			ok = 0;
+			break;
+		}
+		bench_op(start);
+		bytes += smallsize;
+	}
+	fs_sync_r(fs);
+	cache_flush_r(cache);
+	bench_end("churn",bytes);
+
+	for(i = 0; i < CHURN_LIVE; i++) {
+		if(live[i] > 0) fs_delete_r(fs,live[i]);
+	}
+	bench_unmount();
+	free(buffer);
+	return ok;
+}
+
+static int run_copy()
+{
+	char hostfile[1024];
+	char buffer[COPY_CHUNK];
+	int64_t size = filesize();
+	int64_t offset;
+	int inumber, result, ok = 1;
+	FILE *file;
+
+	snprintf(hostfile,sizeof(hostfile),"%s.copy",diskfile);
+	file = fopen(hostfile,"w");
+	if(!file) {
+		fprintf(report,"ERROR: couldn't create %s: %s\n",hostfile,strerror(errno));
+		return 0;
+	}
+	for(offset = 0; offset < size; offset += result) {
+		result = size-offset < COPY_CHUNK ? (int)(size-offset) : COPY_CHUNK;
+		fill(buffer,offset,result);
+		fwrite(buffer,1,result,file);
+	}
+	fclose(file);
+
+	if(!bench_mount()) {
+		unlink(hostfile);
+		return 0;
+	}
+	inumber = fs_create_r(fs);
+
+	// copyin
+	file = fopen(hostfile,"r");
+	bench_start((int)(size/COPY_CHUNK)+1);
+	offset = 0;
+	while(file && inumber > 0) {
+		double start = now();
+		result = fread(buffer,1,sizeof(buffer),file);
+		if(result <= 0) break;
+		int actual = fs_write_r(fs,inumber,buffer,result,offset);
+		bench_op(start);
+		if(actual != result) {
+			fprintf(report,"ERROR: copyin wrote %d bytes at %lld, not %d\n",actual,(long long)offset,result);
+			ok = 0;
+			break;
+		}
+		offset += actual;
+	}
+	fs_sync_r(fs);
+	cache_flush_r(cache);
+	bench_end("copyin",offset);
+	if(file) fclose(file);
+	bench_unmount();
+
+	// copyout, from a cold cache
+	if(ok && inumber > 0 && bench_mount()) {
+		file = fopen(hostfile,"w");
+		bench_start((int)(size/COPY_CHUNK)+1);
+		offset = 0;
+		while(file) {
+			double start = now();
+			result = fs_read_r(fs,inumber,buffer,sizeof(buffer),offset);
+			if(result <= 0) break;
+			fwrite(buffer,1,result,file);
+			bench_op(start);
+			offset += result;
+		}
+		if(file) fclose(file);
+		bench_end("copyout",offset);
+		if(offset != size) {
+			fprintf(report,"ERROR: copyout copied %lld bytes, not %lld\n",(long long)offset,(long long)size);
+			ok = 0;
+		}
+		fs_delete_r(fs,inumber);
+		bench_unmount();
+	} else {
+		ok = 0;
+	}
+
+	unlink(hostfile);
+	return ok;
+}
+
+// times mounting whatever is on the open disk, each time with a new cache
+static int time_mounts( const char *name )
+{
+	int i;
+
+	bench_start(mounts);
+	for(i = 0; i < mounts; i++) {
+		double start = now();
+		if(!bench_mount()) {
+			fprintf(report,"ERROR: couldn't mount %s\n",name);
+			return 0;
+		}
+		bench_op(start);
+		bench_unmount();
+	}
+	bench_end(name,0);
+	return 1;
+}
+
+// copies a prebuilt image onto the scratch disk and times mounting it
+static int run_mount_image( const char *image )
+{
+	char name[64];
+	char buffer[COPY_CHUNK];
+	int in, out, result = 0;
+	struct stat info;
+
+	in = open(image,O_RDONLY);
+	if(in < 0 || fstat(in,&info) != 0) {
+		fprintf(report,"ERROR: couldn't open %s: %s\n",image,strerror(errno));
+		if(in >= 0) close(in);
+		return 0;
+	}
+	out = open(diskfile,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	if(out < 0) {
+		fprintf(report,"ERROR: couldn't create %s: %s\n",diskfile,strerror(errno));
+		close(in);
+		return 0;
+	}
+	while((result = read(in,buffer,sizeof(buffer))) > 0) {
+		if(write(out,buffer,result) != result) {
+			result = -1;
+			break;
+		}
+	}
+	close(in);
+	close(out);
+	if(result < 0) {
+		fprintf(report,"ERROR: couldn't copy %s: %s\n",image,strerror(errno));
+		return 0;
+	}
+
+	if(!bench_open(diskfile,(int)(info.st_size/DISK_BLOCK_SIZE))) {
+		fprintf(report,"ERROR: couldn't open a copy of %s\n",image);
+		return 0;
+	}
+	snprintf(name,sizeof(name),"mount:%s",image);
+	int ok = time_mounts(name);
+	bench_close();
+	return ok;
+}
+
+static void print_text()
+{
+	int i;
+
+	fprintf(report,"%-24s %8s %9s %11s %9s %10s %10s %9s %9s\n",
+		"workload","ops","seconds","ops/s","MB/s","p50 us","p99 us","reads/op","writes/op");
+	for(i = 0; i < nresults; i++) {
+		struct result *r = &results[i];
+		fprintf(report,"%-24s %8d %9.3f %11.1f %9.1f %10.1f %10.1f %9.2f %9.2f\n",
+			r->name,r->ops,r->seconds,
+			r->seconds > 0 ? r->ops/r->seconds : 0,
+			r->seconds > 0 ? r->bytes/r->seconds/(1024*1024) : 0,
+			r->p50*1e6,r->p99*1e6,r->reads,r->writes);
+	}
+}
+
+static void print_json( FILE *file )
+{
+	int i;
+
+	fprintf(file,"{\n");
+	fprintf(file,"  \"config\": {\"nblocks\": %d, \"features\": %d, \"cacheblocks\": %d, \"backend\": \"%s\", "
+		"\"filemb\": %d, \"iosize\": %d, \"ops\": %d, \"smallsize\": %d, \"mounts\": %d, \"seed\": %u},\n",
+		nblocks,features,cacheblocks,backend == DISK_BACKEND_MMAP ? "mmap" : "pread",
+		filemb,iosize,nops,smallsize,mounts,seed);
+	fprintf(file,"  \"results\": [\n");
+	for(i = 0; i < nresults; i++) {
+		struct result *r = &results[i];
+		fprintf(file,"    {\"name\": \"%s\", \"ops\": %d, \"bytes\": %lld, \"seconds\": %.6f, "
+			"\"ops_per_sec\": %.3f, \"mb_per_sec\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, "
+			"\"reads_per_op\": %.4f, \"writes_per_op\": %.4f}%s\n",
+			r->name,r->ops,r->bytes,r->seconds,
+			r->seconds > 0 ? r->ops/r->seconds : 0,
+			r->seconds > 0 ? r->bytes/r->seconds/(1024*1024) : 0,
+			r->p50*1e6,r->p99*1e6,r->reads,r->writes,
+			i+1 < nresults ? "," : "");
+	}
+	fprintf(file,"  ]\n}\n");
+}
+
+static int selected( const char *list, const char *name )
+{
+	const char *p = list;
+	size_t n = strlen(name);
+
+	while(p && *p) {
+		if(!strncmp(p,name,n) && (p[n] == ',' || p[n] == 0)) return 1;
+		p = strchr(p,',');
+		if(p) p++;
+	}
+	return 0;
+}
+
+static void usage( const char *program )
+{
+	printf("use: %s [-b iosize] [-c cacheblocks] [-f smallsize] [-i] [-j jsonfile] [-m] [-n ops] [-r mounts]\n"
+	       "       [-s filemb] [-S seed] [-T] [-v] [-w workloads] [-x] [-l] <diskfile> <nblocks> [image ...]\n",program);
+}
+
+int main( int argc, char *argv[] )
+{
+	const char *workloads = "seqwrite,seqread,randread,churn,copy,mount";
+	const char *jsonfile = 0;
+	int verbose = 0;
+	int opt, i, ok = 1;
+
+	while((opt = getopt(argc,argv,"b:c:f:ij:lmn:r:s:S:Tvw:x")) != -1) {
+		switch(opt) {
+			case 'b':
+				iosize = atoi(optarg);
+				break;
+			case 'c':
+				cacheblocks = atoi(optarg);
+				break;
+			case 'f':
+				smallsize = atoi(optarg);
+				break;
+			case 'i':
+				features |= FS_FEATURE_INLINE;
+				break;
+			case 'j':
+				jsonfile = optarg;
+				break;
+			case 'l':
+				features |= FS_FEATURE_LARGEFILE;
+				break;
+			case 'm':
+				backend = DISK_BACKEND_MMAP;
+				break;
+			case 'n':
+				nops = atoi(optarg);
+				break;
+			case 'r':
+				mounts = atoi(optarg);
+				break;
+			case 's':
+				filemb = atoi(optarg);
+				break;
+			case 'S':
+				seed = strtoul(optarg,0,10);
+				break;
+			case 'T':
+				stats_enable(1);
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			case 'w':
+				workloads = optarg;
+				break;
+			case 'x':
+				features |= FS_FEATURE_EXTENTS;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(argc-optind < 2 || iosize < 1 || smallsize < 1 || filemb < 1 || nops < 1 || mounts < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	diskfile = argv[optind];
+	nblocks = atoi(argv[optind+1]);
+
+	// the filesystem reports on stdout as it goes; keep the table apart
+	fflush(stdout);
+	report = fdopen(dup(STDOUT_FILENO),"w");
+	if(!report) {
+		printf("couldn't set up the report: %s\n",strerror(errno));
+		return 1;
+	}
+	if(!verbose && !freopen("/dev/null","w",stdout)) {
+		fprintf(report,"couldn't silence the filesystem: %s\n",strerror(errno));
+		return 1;
+	}
+
+	if(!bench_open(diskfile,nblocks)) {
+		fprintf(report,"couldn't initialize %s: %s\n",diskfile,strerror(errno));
+		return 1;
+	}
+
+	cache = cache_open(disk,cacheblocks);
+	fs = cache ? fs_attach(cache) : 0;
+	if(!fs || !fs_format_with_r(fs,features)) {
+		fprintf(report,"couldn't format %s\n",diskfile);
+		return 1;
+	}
+	fs_close(fs);
+	cache_close_r(cache);
+
+	if(ok && selected(workloads,"seqwrite")) ok = run_seqwrite();
+	if(ok && selected(workloads,"seqread")) ok = run_seqread();
+	if(ok && selected(workloads,"randread")) ok = run_randread();
+	if(ok && selected(workloads,"churn")) ok = run_churn();
+	if(ok && selected(workloads,"copy")) ok = run_copy();
+	if(ok && selected(workloads,"mount")) ok = time_mounts("mount");
+	bench_close();
+
+	if(ok && selected(workloads,"mount")) {
+		for(i = optind+2; ok && i < argc; i++) {
+			ok = run_mount_image(argv[i]);
+		}
+	}
+
+	if(jsonfile && !strcmp(jsonfile,"-")) {
+		print_json(report);
+	} else {
+		print_text();
+	}
+	if(jsonfile && strcmp(jsonfile,"-")) {
+		FILE *file = fopen(jsonfile,"w");
+		if(file) {
+			print_json(file);
+			fclose(file);
+		} else {
+			fprintf(report,"couldn't write %s: %s\n",jsonfile,strerror(errno));
+			ok = 0;
+		}
+	}
+
+	fprintf(report,"%s\n",ok ? "benchmark finished" : "benchmark FAILED");
+	fclose(report);
+	free(latency);
+	return ok ? 0 : 1;
+}
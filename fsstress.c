@@ -0,0 +1,332 @@
+
+#include "fs.h"
+#include "disk.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+// Multithreaded stress test for the filesystem. It formats the disk and
+// runs two phases:
+//
+//   mixed  every thread creates, writes, reads back, overwrites and deletes
+//          files of its own at the same time as the others, checking that
+//          every byte read is the byte written
+//   read   one file per thread is written up front, then 1, 2, 4, ... up
+//          to the thread limit read their own file over and over, and the
+//          combined throughput shows how reads on distinct inodes scale
+//
+// Files are block-mapped with double and triple indirect blocks, as
+// fs_format lays them out; -x formats with extent-mapped inodes instead
+// and -i with inline ones. Everything on the disk is destroyed.
+
+#define STRESS_CHUNK 65536
+
+static int nthreads = 4;
+static int filekb = 4096;
+static int rounds = 20;
+static int seconds = 2;
+static int features = FS_FEATURE_LARGEFILE;
+
+static int nfailures = 0;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// the byte at offset in a file filled for (inumber,seed)
+static char pattern( int inumber, int seed, int offset )
+{
+	return (char)((offset/7) ^ (inumber*31) ^ (seed*131) ^ (offset*13));
+}
+
+static void fill( char *buffer, int inumber, int seed, int offset, int length )
+{
+	int i;
+	for(i = 0; i < length; i++){
+		buffer[i] = pattern(inumber,seed,offset+i);
+	}
+}
+
+static int check( const char *buffer, int inumber, int seed, int offset, int length )
+{
+	int i;
+	for(i = 0; i < length; i++){
+		if(buffer[i] != pattern(inumber,seed,offset+i)) {
+			printf("ERROR: inode %d byte %d is %d, expected %d\n",inumber,offset+i,buffer[i],pattern(inumber,seed,offset+i));
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void fail()
+{
+	__sync_fetch_and_add(&nfailures,1);
+}
+
+// writes size bytes of (inumber,seed) data in chunks of varying length
+static int write_file( int inumber, int seed, int size, char *buffer, unsigned *rng )
+{
+	int offset = 0;
+	while(offset < size) {
+		int length = 1 + rand_r(rng) % STRESS_CHUNK;
+		if(length > size-offset) length = size-offset;
+		fill(buffer,inumber,seed,offset,length);
+		int actual = fs_write(inumber,buffer,length,offset);
+		if(actual != length) {
+			printf("ERROR: fs_write to inode %d wrote %d bytes, not %d\n",inumber,actual,length);
+			return 0;
+		}
+		offset += length;
+	}
+	return 1;
+}
+
+// checks that bytes offset..end-1 hold (inumber,seed) data
+static int read_file( int inumber, int seed, int offset, int end, char *buffer, unsigned *rng )
+{
+	while(offset < end) {
+		int length = 1 + rand_r(rng) % STRESS_CHUNK;
+		if(length > end-offset) length = end-offset;
+		int actual = fs_read(inumber,buffer,length,offset);
+		if(actual != length) {
+			printf("ERROR: fs_read from inode %d read %d bytes, not %d\n",inumber,actual,length);
+			return 0;
+		}
+		if(!check(buffer,inumber,seed,offset,actual)) return 0;
+		offset += actual;
+	}
+	return 1;
+}
+
+static void *mixed_worker( void *arg )
+{
+	unsigned rng = (unsigned)(size_t)arg * 2654435761u;
+	char *buffer = malloc(STRESS_CHUNK);
+	int round;
+
+	if(!buffer) {
+		fail();
+		return 0;
+	}
+
+	for(round = 0; round < rounds; round++) {
+		int inumber = fs_create();
+		if(inumber <= 0) {
+			printf("ERROR: fs_create failed\n");
+			fail();
+			break;
+		}
+
+		int size = 1 + rand_r(&rng) % (filekb*1024/4);
+		if(!write_file(inumber,round,size,buffer,&rng) || !read_file(inumber,round,0,size,buffer,&rng)) {
+			fail();
+			break;
+		}
+
+		// overwrite the front with a different pattern while keeping the size
+		int front = size/2;
+		if(!write_file(inumber,round+1,front,buffer,&rng) || !read_file(inumber,round+1,0,front,buffer,&rng)
+		   || !read_file(inumber,round,front,size,buffer,&rng)) {
+			fail();
+			break;
+		}
+		if(fs_getsize(inumber) != size) {
+			printf("ERROR: inode %d has size %lld, expected %d\n",inumber,(long long)fs_getsize(inumber),size);
+			fail();
+			break;
+		}
+
+		if(!fs_delete(inumber)) {
+			printf("ERROR: fs_delete of inode %d failed\n",inumber);
+			fail();
+			break;
+		}
+	}
+
+	free(buffer);
+	return 0;
+}
+
+struct reader {
+	pthread_t thread;
+	int inumber;
+	double deadline;
+	long long bytes;
+};
+
+static void *read_worker( void *arg )
+{
+	struct reader *r = arg;
+	char *buffer = malloc(STRESS_CHUNK);
+	int size = fs_getsize(r->inumber);
+	int offset = 0;
+
+	if(!buffer) {
+		fail();
+		return 0;
+	}
+
+	while(now() < r->deadline) {
+		int actual = fs_read(r->inumber,buffer,STRESS_CHUNK,offset);
+		if(actual <= 0) {
+			printf("ERROR: fs_read from inode %d at %d returned %d\n",r->inumber,offset,actual);
+			fail();
+			break;
+		}
+		r->bytes += actual;
+		offset += actual;
+		if(offset >= size) offset = 0;
+	}
+
+	free(buffer);
+	return 0;
+}
+
+static int run_mixed()
+{
+	pthread_t *threads = malloc(sizeof(pthread_t)*nthreads);
+	int t;
+
+	if(!threads) return 0;
+
+	double start = now();
+	for(t = 0; t < nthreads; t++) {
+		pthread_create(&threads[t],0,mixed_worker,(void *)(size_t)(t+1));
+	}
+	for(t = 0; t < nthreads; t++) {
+		pthread_join(threads[t],0);
+	}
+
+	printf("mixed: %d threads x %d rounds in %.2f s, %d failures\n",nthreads,rounds,now()-start,nfailures);
+	free(threads);
+	return nfailures == 0;
+}
+
+static int run_reads()
+{
+	struct reader *readers = calloc(nthreads,sizeof(struct reader));
+	char *buffer = malloc(STRESS_CHUNK);
+	unsigned rng = 1;
+	double base = 0;
+	int t, n;
+
+	if(!readers || !buffer) {
+		free(readers);
+		free(buffer);
+		return 0;
+	}
+
+	for(t = 0; t < nthreads; t++) {
+		readers[t].inumber = fs_create();
+		if(readers[t].inumber <= 0 || !write_file(readers[t].inumber,0,filekb*1024,buffer,&rng)) {
+			printf("ERROR: couldn't set up a %d KB file for reader %d\n",filekb,t);
+			free(readers);
+			free(buffer);
+			return 0;
+		}
+	}
+
+	printf("read: %d KB per file, %d s per step\n",filekb,seconds);
+	for(n = 1; n <= nthreads; n = (n*2 <= nthreads || n == nthreads) ? n*2 : nthreads) {
+		double start = now();
+		long long total = 0;
+		for(t = 0; t < n; t++) {
+			readers[t].bytes = 0;
+			readers[t].deadline = start + seconds;
+			pthread_create(&readers[t].thread,0,read_worker,&readers[t]);
+		}
+		for(t = 0; t < n; t++) {
+			pthread_join(readers[t].thread,0);
+			total += readers[t].bytes;
+		}
+		double rate = total / (now()-start) / (1024*1024);
+		if(n == 1) base = rate;
+		printf("    %3d threads %10.1f MB/s %6.2fx\n",n,rate,base > 0 ? rate/base : 0);
+	}
+
+	for(t = 0; t < nthreads; t++) {
+		fs_delete(readers[t].inumber);
+	}
+	free(readers);
+	free(buffer);
+	return nfailures == 0;
+}
+
+int main( int argc, char *argv[] )
+{
+	int opt;
+	int cacheblocks = CACHE_DEFAULT_BLOCKS;
+
+	while((opt = getopt(argc,argv,"c:in:r:s:t:x")) != -1) {
+		switch(opt) {
+			case 'c':
+				cacheblocks = atoi(optarg);
+				break;
+			case 'i':
+				features |= FS_FEATURE_INLINE;
+				break;
+			case 'n':
+				rounds = atoi(optarg);
+				break;
+			case 'r':
+				seconds = atoi(optarg);
+				break;
+			case 's':
+				filekb = atoi(optarg);
+				break;
+			case 't':
+				nthreads = atoi(optarg);
+				break;
+			case 'x':
+				features |= FS_FEATURE_EXTENTS;
+				break;
+			default:
+				printf("use: %s [-c cacheblocks] [-n rounds] [-r seconds] [-s filekb] [-t threads] [-x] [-i] <diskfile> <nblocks>\n",argv[0]);
+				return 1;
+		}
+	}
+
+	if(argc-optind!=2 || nthreads<1 || filekb<1 || rounds<1 || seconds<1) {
+		printf("use: %s [-c cacheblocks] [-n rounds] [-r seconds] [-s filekb] [-t threads] [-x] [-i] <diskfile> <nblocks>\n",argv[0]);
+		return 1;
+	}
+
+	if(!disk_init(argv[optind],atoi(argv[optind+1]))) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
+
+	if(!disk_async_init(DISK_DEFAULT_QUEUE_DEPTH,DISK_ASYNC_AUTO)) {
+		printf("couldn't start asynchronous disk access\n");
+		return 1;
+	}
+
+	if(!cache_init(cacheblocks)) {
+		printf("couldn't allocate a %d block cache\n",cacheblocks);
+		return 1;
+	}
+
+	if(!fs_format_with(features) || !fs_mount()) {
+		printf("couldn't format and mount %s\n",argv[optind]);
+		return 1;
+	}
+
+	int ok = run_mixed() && run_reads();
+
+	fs_unmount();
+	cache_close();
+	disk_close();
+
+	printf("%s\n",ok ? "stress test passed" : "stress test FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,533 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include "journal.h"
+#include "cache.h"
+#include "disk.h"
+
+#define JOURNAL_MAGIC_DESC   0x6a726e64 // opens a transaction
+#define JOURNAL_MAGIC_COMMIT 0x6a726e63 // closes it
+#define JOURNAL_MAX_BLOCKS   1020       // home block numbers one descriptor holds
+#define JOURNAL_BUCKETS      2048
+
+// The region is split in two halves and transaction n is written to half
+// n%2: a descriptor listing where its blocks belong, the blocks, and a
+// commit block with a checksum over all of it. Before a transaction is
+// written the previous one and any file data are flushed to their home
+// blocks. One sync makes those durable along with the descriptor and the
+// logged blocks, and only then is the commit block written and synced, so
+// a commit on disk never refers to data that isn't. The half being
+// overwritten always holds a transaction that is already safe in place,
+// and the other half the newest one that may not be.
+//
+// Replay writes old copies of blocks, so a block that was logged must not
+// be reused for data while either half may still hold a copy of it: that
+// takes two more commits after the one that frees it. The filesystem waits
+// that long before reusing freed metadata blocks.
+
+struct journal_descriptor {
+	uint32_t magic;
+	uint32_t count;
+	uint64_t sequence;
+	int blocknums[JOURNAL_MAX_BLOCKS];
+};
+
+struct journal_commit {
+	uint32_t magic;
+	uint32_t count;
+	uint64_t sequence;
+	uint32_t checksum;
+};
+
+_Static_assert(sizeof(struct journal_descriptor) == DISK_BLOCK_SIZE,"a descriptor must fill a block exactly");
+
+// the blocks logged since the last commit, newest copy of each
+struct transaction {
+	int count;
+	int *blocknums;
+	char *data;      // count blocks, in the order of blocknums
+	int *next;       // hash chain, index+1 of the next entry in the bucket
+	int buckets[JOURNAL_BUCKETS];
+};
+
+struct journal {
+	cache_t *cache;
+	disk_t *disk;
+	int start;        // first block of the region
+	int half;         // blocks in each half
+	int capacity;     // blocks one transaction may hold
+	int reserve;      // of those, kept back for the prepare hook
+
+	void (*prepare)( void *arg );
+	void (*done)( void *arg );
+	void *arg;
+
+	struct transaction txn[2];
+	struct transaction *running;    // taking new blocks
+	struct transaction *committing; // being written, still looked up until installed
+
+	uint64_t sequence;  // the running transaction's
+	uint64_t durable;   // last sequence that is safely in the journal
+	int updates;        // operations between journal_begin and journal_end
+	int credits;        // blocks those operations may still log
+	bool closing;       // a commit is waiting for the updates to drain
+	bool busy;          // a commit is in progress
+
+	struct journal_stats stats;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	bool stop;
+};
+
+static int bucket( int blocknum )
+{
+	return (unsigned)blocknum * 2654435761u % JOURNAL_BUCKETS;
+}
+
+static int txn_find( struct transaction *t, int blocknum )
+{
+	int i = t->buckets[bucket(blocknum)];
+	while(i > 0 && t->blocknums[i-1] != blocknum){
+		i = t->next[i-1];
+	}
+	return i-1;
+}
+
+static void txn_reset( struct transaction *t )
+{
+	t->count = 0;
+	memset(t->buckets,0,sizeof(t->buckets));
+}
+
+// FNV-1a, over the descriptor and every block it lists
+static uint32_t checksum( uint32_t h, const char *data, int length )
+{
+	int i;
+	for(i = 0; i < length; i++){
+		h ^= (unsigned char)data[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+int journal_size( int reserve )
+{
+	int payload = reserve + 16*JOURNAL_OP_BLOCKS;
+	if(payload > JOURNAL_MAX_BLOCKS){
+		return 0;
+	}
+	return 2*(payload+2);
+}
+
+void journal_format( cache_t *c, int start, int nblocks )
+{
+	char zeros[DISK_BLOCK_SIZE];
+	memset(zeros,0,DISK_BLOCK_SIZE);
+	cache_write_r(c,start,zeros);
+	cache_write_r(c,start+nblocks/2,zeros);
+}
+
+// Commits the running transaction, if it has anything in it. Called and
+// returns with the lock held, drops it while writing.
+static void commit_locked( journal_t *j )
+{
+	while(j->busy){
+		pthread_cond_wait(&j->cond,&j->lock);
+	}
+	if(j->running->count == 0){
+		return;
+	}
+
+	// wait for the operations already started, and hold off new ones, so
+	// the transaction never contains half of an operation
+	j->busy = true;
+	j->closing = true;
+	while(j->updates > 0){
+		pthread_cond_wait(&j->cond,&j->lock);
+	}
+	pthread_mutex_unlock(&j->lock);
+	if(j->prepare) j->prepare(j->arg);
+	pthread_mutex_lock(&j->lock);
+
+	struct transaction *t = j->running;
+	uint64_t sequence = j->sequence++;
+	j->running = j->committing;
+	j->committing = t;
+	j->closing = false;
+	pthread_cond_broadcast(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+
+	// data and the previous transaction go to their home blocks first, and
+	// are made durable by the same sync as the body of this transaction
+	cache_flush_r(j->cache);
+
+	struct journal_descriptor desc;
+	struct journal_commit commit;
+	memset(&desc,0,sizeof(desc));
+	memset(&commit,0,sizeof(commit));
+	const char **blocks = malloc(sizeof(char *)*(t->count+2));
+	char *commitblock = calloc(1,DISK_BLOCK_SIZE);
+	if(!blocks || !commitblock){
+		printf("ERROR: couldn't allocate memory to commit the journal\n");
+		abort();
+	}
+
+	int i, n = t->count;
+	desc.magic = JOURNAL_MAGIC_DESC;
+	desc.count = n;
+	desc.sequence = sequence;
+	memcpy(desc.blocknums,t->blocknums,sizeof(int)*n);
+
+	uint32_t sum = checksum(2166136261u,(const char *)&desc,DISK_BLOCK_SIZE);
+	blocks[0] = (const char *)&desc;
+	for(i = 0; i < n; i++){
+		blocks[i+1] = t->data + (size_t)i*DISK_BLOCK_SIZE;
+		sum = checksum(sum,blocks[i+1],DISK_BLOCK_SIZE);
+	}
+	commit.magic = JOURNAL_MAGIC_COMMIT;
+	commit.count = n;
+	commit.sequence = sequence;
+	commit.checksum = sum;
+	memcpy(commitblock,&commit,sizeof(commit));
+	blocks[n+1] = commitblock;
+
+	// ordered: the commit block goes out only once everything before it is durable
+	int at = j->start + (int)(sequence%2)*j->half;
+	disk_write_range_r(j->disk,at,n+1,blocks);
+	disk_sync_r(j->disk);
+	disk_write_r(j->disk,at+n+1,commitblock);
+	disk_sync_r(j->disk);
+	free(blocks);
+	free(commitblock);
+
+	if(j->done) j->done(j->arg);
+
+	// durable now, so the blocks may go home whenever the cache likes
+	for(i = 0; i < n; i++){
+		cache_write_r(j->cache,t->blocknums[i],t->data + (size_t)i*DISK_BLOCK_SIZE);
+	}
+
+	pthread_mutex_lock(&j->lock);
+	j->stats.commits++;
+	j->stats.blocks += n;
+	txn_reset(t);
+	j->durable = sequence;
+	j->busy = false;
+	pthread_cond_broadcast(&j->cond);
+}
+
+// commits every JOURNAL_COMMIT_INTERVAL seconds, whatever else happens
+static void *commit_thread( void *arg )
+{
+	journal_t *j = arg;
+	struct timespec until;
+
+	pthread_mutex_lock(&j->lock);
+	clock_gettime(CLOCK_REALTIME,&until);
+	until.tv_sec += JOURNAL_COMMIT_INTERVAL;
+	while(!j->stop){
+		if(pthread_cond_timedwait(&j->cond,&j->lock,&until) == ETIMEDOUT){
+			commit_locked(j);
+			clock_gettime(CLOCK_REALTIME,&until);
+			until.tv_sec += JOURNAL_COMMIT_INTERVAL;
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+
+	return 0;
+}
+
+journal_t *journal_open( cache_t *c, int start, int nblocks, int reserve,
+	void (*prepare)( void *arg ), void (*done)( void *arg ), void *arg )
+{
+	journal_t *j = calloc(1,sizeof(journal_t));
+	if(!j) return 0;
+
+	j->cache = c;
+	j->disk = cache_disk(c);
+	j->start = start;
+	j->half = nblocks/2;
+	j->capacity = j->half-2;
+	if(j->capacity > JOURNAL_MAX_BLOCKS){
+		j->capacity = JOURNAL_MAX_BLOCKS;
+	}
+	j->reserve = reserve;
+	j->prepare = prepare;
+	j->done = done;
+	j->arg = arg;
+	j->sequence = 1;
+
+	if(j->capacity - j->reserve < JOURNAL_OP_BLOCKS){
+		printf("Error: journal too small\n");
+		free(j);
+		return 0;
+	}
+
+	int i;
+	for(i = 0; i < 2; i++){
+		struct transaction *t = &j->txn[i];
+		t->blocknums = malloc(sizeof(int)*j->capacity);
+		t->next = malloc(sizeof(int)*j->capacity);
+		t->data = malloc((size_t)j->capacity*DISK_BLOCK_SIZE);
+		if(!t->blocknums || !t->next || !t->data){
+			free(j->txn[0].blocknums); free(j->txn[0].next); free(j->txn[0].data);
+			free(j->txn[1].blocknums); free(j->txn[1].next); free(j->txn[1].data);
+			free(j);
+			return 0;
+		}
+		txn_reset(t);
+	}
+	j->running = &j->txn[0];
+	j->committing = &j->txn[1];
+
+	pthread_mutex_init(&j->lock,0);
+	pthread_cond_init(&j->cond,0);
+	pthread_create(&j->thread,0,commit_thread,j);
+
+	return j;
+}
+
+// a transaction as found in one half of the journal
+struct record {
+	struct journal_descriptor desc;
+	char *data;
+	bool valid;
+};
+
+// reads the transaction in half h, valid only if it was committed whole
+static void read_record( journal_t *j, int h, struct record *r )
+{
+	struct journal_descriptor *d = &r->desc;
+	char *blocks[JOURNAL_MAX_BLOCKS+1];
+	int i;
+
+	r->valid = false;
+	disk_read_r(j->disk,j->start + h*j->half,(char *)d);
+	if(d->magic != JOURNAL_MAGIC_DESC || d->count > (uint32_t)j->capacity){
+		return;
+	}
+
+	for(i = 0; i <= (int)d->count; i++){
+		blocks[i] = r->data + (size_t)i*DISK_BLOCK_SIZE;
+	}
+	disk_read_range_r(j->disk,j->start + h*j->half + 1,d->count+1,blocks);
+
+	struct journal_commit *commit = (struct journal_commit *)blocks[d->count];
+	uint32_t sum = checksum(2166136261u,(const char *)d,DISK_BLOCK_SIZE);
+	for(i = 0; i < (int)d->count; i++){
+		sum = checksum(sum,blocks[i],DISK_BLOCK_SIZE);
+	}
+	r->valid = commit->magic == JOURNAL_MAGIC_COMMIT && commit->sequence == d->sequence
+		&& commit->count == d->count && commit->checksum == sum;
+}
+
+// Replays whatever transactions made it into the journal, oldest first, so
+// the home blocks end up as of the last commit, and then empties it.
+// Replaying one that was already installed does no harm, each holds whole
+// blocks. Without replay (after a clean unmount everything is in place
+// already) the journal is only emptied. Returns how many were replayed.
+int journal_recover( journal_t *j, int replay )
+{
+	struct record *rec = calloc(2,sizeof(struct record));
+	int h, i, replayed = 0;
+	bool used = false;
+
+	// the region itself may still be dirty in the cache from fs_format
+	cache_flush_r(j->cache);
+
+	for(h = 0; rec && h < 2; h++){
+		rec[h].data = malloc((size_t)(j->capacity+1)*DISK_BLOCK_SIZE);
+		if(!rec[h].data){
+			break;
+		}
+		read_record(j,h,&rec[h]);
+		used = used || rec[h].desc.magic == JOURNAL_MAGIC_DESC;
+	}
+	if(!rec || h < 2){
+		printf("Error: not enough memory to recover the journal\n");
+		if(rec){
+			free(rec[0].data);
+			free(rec[1].data);
+		}
+		free(rec);
+		return -1;
+	}
+
+	struct record *older = &rec[0], *newer = &rec[1];
+	if(older->valid && newer->valid && newer->desc.sequence < older->desc.sequence){
+		older = &rec[1];
+		newer = &rec[0];
+	}
+
+	struct record *r;
+	for(r = older; replay && r; r = (r == older) ? newer : 0){
+		if(!r->valid){
+			continue; // torn, never committed
+		}
+		for(i = 0; i < (int)r->desc.count; i++){
+			cache_write_r(j->cache,r->desc.blocknums[i],r->data + (size_t)i*DISK_BLOCK_SIZE);
+		}
+		replayed++;
+	}
+	free(rec[0].data);
+	free(rec[1].data);
+	free(rec);
+
+	// the replayed blocks have to be in place before the journal forgets
+	// them, and the journal has to be empty before any block it mentions
+	// can be given out again
+	if(replayed > 0){
+		cache_flush_r(j->cache);
+		disk_sync_r(j->disk);
+	}
+	if(used){
+		char zeros[DISK_BLOCK_SIZE];
+		memset(zeros,0,DISK_BLOCK_SIZE);
+		disk_write_r(j->disk,j->start,zeros);
+		disk_write_r(j->disk,j->start+j->half,zeros);
+		disk_sync_r(j->disk);
+	}
+
+	pthread_mutex_lock(&j->lock);
+	j->stats.replayed += replayed;
+	pthread_mutex_unlock(&j->lock);
+
+	return replayed;
+}
+
+// Starts an operation that will log at most credits blocks, committing
+// first if the running transaction can't take that many more.
+void journal_begin( journal_t *j, int credits )
+{
+	if(credits > j->capacity - j->reserve){
+		printf("ERROR: operation too big for the journal\n");
+		abort();
+	}
+
+	pthread_mutex_lock(&j->lock);
+	for(;;){
+		int room = j->capacity - j->reserve - j->running->count - j->credits;
+		if(!j->closing && room >= credits){
+			break;
+		}
+		if(j->closing || j->running->count == 0){
+			pthread_cond_wait(&j->cond,&j->lock); // the ones in progress have it all
+		} else{
+			commit_locked(j);
+		}
+	}
+	j->updates++;
+	j->credits += credits;
+	pthread_mutex_unlock(&j->lock);
+}
+
+void journal_end( journal_t *j, int credits )
+{
+	pthread_mutex_lock(&j->lock);
+	j->updates--;
+	j->credits -= credits;
+	pthread_cond_broadcast(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+}
+
+// records the new contents of a metadata block in the running transaction
+void journal_log( journal_t *j, int blocknum, const char *data )
+{
+	pthread_mutex_lock(&j->lock);
+	struct transaction *t = j->running;
+	int i = txn_find(t,blocknum);
+	if(i < 0){
+		if(t->count >= j->capacity){
+			printf("ERROR: journal transaction overflow\n");
+			abort();
+		}
+		i = t->count++;
+		t->blocknums[i] = blocknum;
+		t->next[i] = t->buckets[bucket(blocknum)];
+		t->buckets[bucket(blocknum)] = i+1;
+	}
+	memcpy(t->data + (size_t)i*DISK_BLOCK_SIZE,data,DISK_BLOCK_SIZE);
+	pthread_mutex_unlock(&j->lock);
+}
+
+// Copies out the newest logged version of a block that hasn't reached the
+// cache yet. Returns 0 if there is none and the cache has the latest.
+int journal_lookup( journal_t *j, int blocknum, char *data )
+{
+	int found = 0;
+	pthread_mutex_lock(&j->lock);
+	struct transaction *t = j->running;
+	int i = txn_find(t,blocknum);
+	if(i < 0){
+		t = j->committing;
+		i = txn_find(t,blocknum);
+	}
+	if(i >= 0){
+		memcpy(data,t->data + (size_t)i*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+		found = 1;
+	}
+	pthread_mutex_unlock(&j->lock);
+	return found;
+}
+
+// Makes every operation finished before the call durable. Callers that
+// arrive while a commit is running get carried by the next one together.
+int journal_commit( journal_t *j )
+{
+	pthread_mutex_lock(&j->lock);
+	uint64_t target = j->sequence;
+	while(j->durable < target){
+		if(j->busy){
+			pthread_cond_wait(&j->cond,&j->lock);
+		} else if(j->sequence == target && j->running->count == 0){
+			break; // nothing was logged
+		} else{
+			commit_locked(j);
+		}
+	}
+	pthread_mutex_unlock(&j->lock);
+	return 1;
+}
+
+void journal_stats( journal_t *j, struct journal_stats *s )
+{
+	pthread_mutex_lock(&j->lock);
+	*s = j->stats;
+	pthread_mutex_unlock(&j->lock);
+}
+
+// commits what is left and lets go of the journal
+void journal_close( journal_t *j )
+{
+	journal_commit(j);
+
+	pthread_mutex_lock(&j->lock);
+	j->stop = true;
+	pthread_cond_broadcast(&j->cond);
+	pthread_mutex_unlock(&j->lock);
+	pthread_join(j->thread,0);
+
+	if(j->stats.commits > 0 || j->stats.replayed > 0){
+		printf("%d journal commits\n",j->stats.commits);
+		printf("%d blocks journaled\n",j->stats.blocks);
+		printf("%d transactions replayed\n",j->stats.replayed);
+	}
+
+	int i;
+	for(i = 0; i < 2; i++){
+		free(j->txn[i].blocknums);
+		free(j->txn[i].next);
+		free(j->txn[i].data);
+	}
+	pthread_mutex_destroy(&j->lock);
+	pthread_cond_destroy(&j->cond);
+	free(j);
+}
@@ -0,0 +1,53 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_COMMIT_INTERVAL 5  // seconds a change may wait before it is committed
+#define JOURNAL_OP_BLOCKS       4  // credits for an operation that logs a few blocks
+
+struct cache;
+
+// per-journal counters, as printed by journal_close
+struct journal_stats {
+	int commits;   // transactions written, each costing one disk_sync
+	int blocks;    // metadata blocks written to the journal
+	int replayed;  // transactions replayed by journal_recover
+};
+
+typedef struct journal journal_t;
+
+// Write-ahead log for metadata blocks. Between journal_begin and
+// journal_end an operation hands every metadata block it changes to
+// journal_log instead of writing it in place, up to as many blocks as it
+// asked credits for. All the operations logged
+// since the last commit make up one transaction, which is written to the
+// journal region as a whole, made durable with a single disk_sync and only
+// then let out to its home blocks. Commits happen every
+// JOURNAL_COMMIT_INTERVAL seconds, when a transaction fills up, or on
+// journal_commit, so many operations share the cost of one sync.
+//
+// The prepare hook runs just before a transaction is closed, with no
+// operation in progress, and may log up to reserve more blocks of its own
+// (the filesystem logs its bitmaps there). The done hook runs once the
+// transaction is durable.
+//
+// journal_recover has to be called once after journal_open, before
+// anything is logged; it replays what a crash left behind and starts the
+// journal over.
+
+// blocks to set aside for a journal whose prepare hook logs up to reserve
+// blocks, or 0 if such a journal can't be made
+int journal_size( int reserve );
+void journal_format( struct cache *c, int start, int nblocks );
+
+journal_t *journal_open( struct cache *c, int start, int nblocks, int reserve,
+	void (*prepare)( void *arg ), void (*done)( void *arg ), void *arg );
+int  journal_recover( journal_t *j, int replay );
+void journal_begin( journal_t *j, int credits );
+void journal_end( journal_t *j, int credits );
+void journal_log( journal_t *j, int blocknum, const char *data );
+int  journal_lookup( journal_t *j, int blocknum, char *data );
+int  journal_commit( journal_t *j );
+void journal_stats( journal_t *j, struct journal_stats *s );
+void journal_close( journal_t *j );
+
+#endif
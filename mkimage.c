@@ -0,0 +1,290 @@
+
+#include "fs.h"
+#include "disk.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Builds a disk image from host files in one pass with fs_build_r, instead
+// of a format, a mount and a create and copyin per file. The files are
+// every regular file under <directory>, in sorted order, each named by its
+// path below the directory, or with -f the ones a list file names (- for
+// standard input), one per line as
+//
+//   <host path> [name]
+//
+// where the name defaults to the last part of the path. Lines that are
+// empty or start with # are skipped. File i of the list becomes inode i+1.
+// The inodes are laid out as fs_format does, with double and triple
+// indirect blocks (-l, the default); -x maps them with extents instead and
+// -i keeps small files inline. -n leaves the names out, so the files are
+// only known by their inode numbers.
+//
+// Everything on <diskfile> is destroyed.
+
+#define LIST_LINE 4096
+
+struct source {
+	char *path;
+	char *name;
+	int64_t size;
+};
+
+static struct source *sources = 0;
+static int nsources = 0;
+static int maxsources = 0;
+
+// the file fill is reading, kept open while it goes through it
+static int current = -1;
+static int currentfd = -1;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static int add_source( const char *path, const char *name )
+{
+	struct stat info;
+
+	if(stat(path,&info) < 0) {
+		printf("couldn't stat %s: %s\n",path,strerror(errno));
+		return 0;
+	}
+	if(!S_ISREG(info.st_mode)) {
+		printf("%s is not a regular file\n",path);
+		return 0;
+	}
+	if(name && strlen(name) > FS_NAME_MAX) {
+		printf("name %s is longer than %d bytes\n",name,FS_NAME_MAX);
+		return 0;
+	}
+
+	if(nsources == maxsources) {
+		int more = maxsources ? maxsources*2 : 256;
+		struct source *grown = realloc(sources,sizeof(*sources)*more);
+		if(!grown) {
+			printf("out of memory\n");
+			return 0;
+		}
+		sources = grown;
+		maxsources = more;
+	}
+	sources[nsources].path = strdup(path);
+	sources[nsources].name = name ? strdup(name) : 0;
+	sources[nsources].size = info.st_size;
+	nsources++;
+	return 1;
+}
+
+static int compare_names( const struct dirent **a, const struct dirent **b )
+{
+	return strcmp((*a)->d_name,(*b)->d_name);
+}
+
+// adds every regular file under dir, named prefix followed by its path below dir
+static int add_directory( const char *dir, const char *prefix, int named )
+{
+	struct dirent **entries;
+	char path[LIST_LINE], name[LIST_LINE];
+	struct stat info;
+	int n, i, ok = 1;
+
+	n = scandir(dir,&entries,0,compare_names);
+	if(n < 0) {
+		printf("couldn't read %s: %s\n",dir,strerror(errno));
+		return 0;
+	}
+
+	for(i = 0; i < n; i++) {
+		const char *entry = entries[i]->d_name;
+		if(ok && strcmp(entry,".") && strcmp(entry,"..")) {
+			snprintf(path,sizeof(path),"%s/%s",dir,entry);
+			snprintf(name,sizeof(name),"%s%s",prefix,entry);
+			if(lstat(path,&info) < 0) {
+				printf("couldn't stat %s: %s\n",path,strerror(errno));
+				ok = 0;
+			} else if(S_ISDIR(info.st_mode)) {
+				strcat(name,"/");
+				ok = add_directory(path,name,named);
+			} else if(S_ISREG(info.st_mode)) {
+				ok = add_source(path,named ? name : 0);
+			}
+		}
+		free(entries[i]);
+	}
+	free(entries);
+	return ok;
+}
+
+static int add_list( const char *listfile, int named )
+{
+	char line[LIST_LINE], path[LIST_LINE], name[LIST_LINE];
+	FILE *list;
+	int ok = 1, args;
+
+	list = strcmp(listfile,"-") ? fopen(listfile,"r") : stdin;
+	if(!list) {
+		printf("couldn't open %s: %s\n",listfile,strerror(errno));
+		return 0;
+	}
+
+	while(ok && fgets(line,sizeof(line),list)) {
+		args = sscanf(line,"%s %s",path,name);
+		if(args <= 0 || path[0] == '#') continue;
+		if(args == 1) {
+			const char *slash = strrchr(path,'/');
+			strcpy(name,slash ? slash+1 : path);
+		}
+		ok = add_source(path,named ? name : 0);
+	}
+
+	if(list != stdin) fclose(list);
+	return ok;
+}
+
+// hands fs_build_r length bytes of file index at offset
+static int fill( int index, char *data, int length, int64_t offset, void *arg )
+{
+	int done = 0, result;
+
+	if(index != current) {
+		if(currentfd >= 0) close(currentfd);
+		current = index;
+		currentfd = open(sources[index].path,O_RDONLY);
+		if(currentfd < 0) {
+			printf("couldn't open %s: %s\n",sources[index].path,strerror(errno));
+			return -1;
+		}
+	}
+	if(currentfd < 0) return -1;
+
+	while(done < length) {
+		result = pread(currentfd,data+done,length-done,offset+done);
+		if(result < 0 && errno == EINTR) continue;
+		if(result <= 0) {
+			printf("%s is shorter than it was\n",sources[index].path);
+			break;
+		}
+		done += result;
+	}
+	return done;
+}
+
+static void usage( const char *program )
+{
+	printf("use: %s [-c cacheblocks] [-i] [-l] [-m] [-n] [-x] <diskfile> <nblocks> <directory>\n"
+	       "       %s [-c cacheblocks] [-i] [-l] [-m] [-n] [-x] -f <listfile> <diskfile> <nblocks>\n",program,program);
+}
+
+int main( int argc, char *argv[] )
+{
+	struct fs_build_file *files;
+	struct disk_stats ds;
+	const char *listfile = 0;
+	int cacheblocks = CACHE_DEFAULT_BLOCKS;
+	int backend = DISK_BACKEND_PREAD;
+	int features = FS_FEATURE_LARGEFILE;
+	int named = 1;
+	int opt, i, ok;
+	int64_t bytes = 0;
+	disk_t *disk;
+	cache_t *cache;
+	fs_t *fs;
+	double started;
+
+	while((opt = getopt(argc,argv,"c:f:ilmnx")) != -1) {
+		switch(opt) {
+			case 'c':
+				cacheblocks = atoi(optarg);
+				break;
+			case 'f':
+				listfile = optarg;
+				break;
+			case 'i':
+				features |= FS_FEATURE_INLINE;
+				break;
+			case 'l':
+				features |= FS_FEATURE_LARGEFILE;
+				break;
+			case 'm':
+				backend = DISK_BACKEND_MMAP;
+				break;
+			case 'n':
+				named = 0;
+				break;
+			case 'x':
+				features |= FS_FEATURE_EXTENTS;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(argc-optind != (listfile ? 2 : 3)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	ok = listfile ? add_list(listfile,named) : add_directory(argv[optind+2],"",named);
+	if(!ok) return 1;
+
+	files = malloc(sizeof(*files)*(nsources ? nsources : 1));
+	if(!files) {
+		printf("out of memory\n");
+		return 1;
+	}
+	for(i = 0; i < nsources; i++) {
+		files[i].name = sources[i].name;
+		files[i].size = sources[i].size;
+		bytes += sources[i].size;
+	}
+
+	disk = disk_open(argv[optind],atoi(argv[optind+1]),backend);
+	if(!disk) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
+	cache = cache_open(disk,cacheblocks);
+	fs = cache ? fs_attach(cache) : 0;
+	if(!fs) {
+		printf("couldn't allocate a %d block cache\n",cacheblocks);
+		return 1;
+	}
+
+	started = now();
+	ok = fs_build_r(fs,features,files,nsources,fill,0);
+	if(currentfd >= 0) close(currentfd);
+	fs_close(fs);
+	cache_close_r(cache);
+	disk_sync_r(disk);
+
+	if(ok) {
+		disk_stats_r(disk,&ds);
+		printf("built %s: %d files, %.1f MB in %.3f s, %lld blocks written in %lld calls\n",
+			argv[optind],nsources,bytes/(1024.0*1024.0),now()-started,
+			(long long)ds.writes,(long long)ds.writecalls);
+	} else {
+		printf("couldn't build %s\n",argv[optind]);
+	}
+	disk_close_r(disk);
+
+	for(i = 0; i < nsources; i++) {
+		free(sources[i].path);
+		free(sources[i].name);
+	}
+	free(sources);
+	free(files);
+	return ok ? 0 : 1;
+}
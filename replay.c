@@ -0,0 +1,426 @@
+
+#include "fs.h"
+#include "disk.h"
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+// Replays a block trace taken with disk_trace_start (the shell's trace
+// command) against a scratch image, once for every cache size given with
+// -c, and reports what each cache would have done with the same requests:
+// hits, misses, blocks and calls that reached the disk, and the time all
+// that would have taken on a device with the given costs:
+//
+//   -l  microseconds per read or write call    (default 100)
+//   -t  microseconds per block moved           (default 10)
+//   -s  microseconds per sync                  (default 2000)
+//
+// Requests the filesystem made of the cache are fed to the new cache, so
+// its misses and write-backs are its own; transfers the traced cache made
+// are left out, and everything else (the journal, fs_debug) is replayed on
+// the disk as it was. The first line shows what the traced configuration
+// actually did, costed the same way. Whatever is still dirty at the end is
+// flushed and counted. -o breaks the cache traffic down by the filesystem
+// call that caused it, and -j prints JSON instead of the table.
+//
+// Everything on <scratch image> is destroyed.
+
+#define DEFAULT_SIZES "64,256,1024,4096"
+#define MAX_SIZES     32
+#define ORIGINS       128
+
+struct origin_counts {
+	long long requests;
+	long long blocks;
+	long long hits;
+	long long misses;
+};
+
+struct outcome {
+	char name[32];
+	long long hits, misses;
+	long long reads, writes;        // blocks
+	long long readcalls, writecalls;
+	long long syncs;
+	double simulated;               // seconds
+	double wall;
+	struct origin_counts origins[ORIGINS];
+};
+
+static double call_us = 100;
+static double block_us = 10;
+static double sync_us = 2000;
+static int backend = DISK_BACKEND_PREAD;
+static int asyncmode = DISK_ASYNC_AUTO;
+
+static struct disk_trace_header header;
+static struct disk_trace_record *records;
+static long long nrecords;
+
+static FILE *report;
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static int load_trace( const char *filename )
+{
+	FILE *file = fopen(filename,"r");
+	long size;
+
+	if(!file) {
+		fprintf(report,"couldn't open %s: %s\n",filename,strerror(errno));
+		return 0;
+	}
+	if(fread(&header,sizeof(header),1,file) != 1 || header.magic != DISK_TRACE_MAGIC
+	   || header.version != DISK_TRACE_VERSION || header.blocksize != DISK_BLOCK_SIZE || header.nblocks <= 0) {
+		fprintf(report,"%s is not a disk trace this program can read\n",filename);
+		fclose(file);
+		return 0;
+	}
+
+	fseek(file,0,SEEK_END);
+	size = ftell(file) - (long)sizeof(header);
+	fseek(file,sizeof(header),SEEK_SET);
+
+	nrecords = size / (long)sizeof(struct disk_trace_record);
+	records = malloc(sizeof(struct disk_trace_record)*(nrecords > 0 ? nrecords : 1));
+	if(!records || (long long)fread(records,sizeof(struct disk_trace_record),nrecords,file) != nrecords) {
+		fprintf(report,"couldn't read %s\n",filename);
+		fclose(file);
+		return 0;
+	}
+	fclose(file);
+	return 1;
+}
+
+static void cost( struct outcome *o )
+{
+	o->simulated = ((o->readcalls+o->writecalls)*call_us + (o->reads+o->writes)*block_us + o->syncs*sync_us) / 1e6;
+}
+
+// what the traced disk did, from its own transfers
+static void recorded( struct outcome *o )
+{
+	long long i;
+
+	memset(o,0,sizeof(*o));
+	snprintf(o->name,sizeof(o->name),"recorded");
+	for(i = 0; i < nrecords; i++) {
+		struct disk_trace_record *r = &records[i];
+		if(r->op == DISK_TRACE_READ) {
+			o->readcalls++;
+			o->reads += r->count;
+		} else if(r->op == DISK_TRACE_WRITE) {
+			o->writecalls++;
+			o->writes += r->count;
+		} else if(r->op == DISK_TRACE_SYNC) {
+			o->syncs++;
+		}
+	}
+	cost(o);
+	if(nrecords > 0) o->wall = records[nrecords-1].time/1e9;
+}
+
+static int replay( const char *image, int cacheblocks, struct outcome *o )
+{
+	char *pool = 0;
+	char **blocks = 0;
+	int *blocknums = 0;
+	int room = 0;
+	long long i, syncs = 0;
+	struct disk_stats ds;
+
+	memset(o,0,sizeof(*o));
+	snprintf(o->name,sizeof(o->name),"cache %d",cacheblocks);
+
+	disk_t *d = disk_open(image,header.nblocks,backend);
+	if(!d) {
+		fprintf(report,"couldn't open %s: %s\n",image,strerror(errno));
+		return 0;
+	}
+	cache_t *c = (disk_async_init_r(d,DISK_DEFAULT_QUEUE_DEPTH,asyncmode)) ? cache_open(d,cacheblocks) : 0;
+	if(!c) {
+		fprintf(report,"couldn't set up a %d block cache on %s\n",cacheblocks,image);
+		disk_close_r(d);
+		return 0;
+	}
+
+	double start = now();
+	for(i = 0; i < nrecords; i++) {
+		struct disk_trace_record *r = &records[i];
+		int cached = r->origin & DISK_TRACE_CACHED;
+		struct origin_counts *oc = &o->origins[r->origin & (ORIGINS-1)];
+		struct cache_stats before, after;
+		int k;
+
+		if(r->blocknum < 0 || r->blocknum+r->count > header.nblocks) continue;
+
+		if(r->count > room) {
+			room = r->count;
+			free(pool);
+			free(blocks);
+			free(blocknums);
+			pool = malloc((size_t)room*DISK_BLOCK_SIZE);
+			blocks = malloc(sizeof(char *)*room);
+			blocknums = malloc(sizeof(int)*room);
+			if(!pool || !blocks || !blocknums) {
+				fprintf(report,"ERROR: out of memory for a %d block request\n",room);
+				abort();
+			}
+			memset(pool,0,(size_t)room*DISK_BLOCK_SIZE);
+			for(k = 0; k < room; k++) {
+				blocks[k] = pool + (size_t)k*DISK_BLOCK_SIZE;
+			}
+		}
+
+		if(r->op >= DISK_TRACE_CACHE_READ) cache_stats_r(c,&before);
+
+		switch(r->op) {
+			case DISK_TRACE_READ:
+				if(!cached) disk_read_range_r(d,r->blocknum,r->count,blocks);
+				break;
+			case DISK_TRACE_WRITE:
+				if(!cached) disk_write_range_r(d,r->blocknum,r->count,(const char **)blocks);
+				break;
+			case DISK_TRACE_DISCARD:
+				if(cached) {
+					cache_discard_r(c,r->blocknum,r->count);
+				} else {
+					disk_discard_r(d,r->blocknum,r->count);
+				}
+				break;
+			case DISK_TRACE_SYNC:
+				disk_sync_r(d);
+				syncs++;
+				break;
+			case DISK_TRACE_CACHE_READ:
+				cache_read_r(c,r->blocknum,pool);
+				break;
+			case DISK_TRACE_CACHE_WRITE:
+				cache_write_r(c,r->blocknum,pool);
+				break;
+			case DISK_TRACE_CACHE_READ_RANGE:
+				cache_read_range_r(c,r->blocknum,r->count,blocks);
+				break;
+			case DISK_TRACE_CACHE_WRITE_RANGE:
+				cache_write_range_r(c,r->blocknum,r->count,(const char **)blocks);
+				break;
+			case DISK_TRACE_CACHE_PREFETCH:
+				for(k = 0; k < r->count; k++) {
+					blocknums[k] = r->blocknum+k;
+				}
+				cache_prefetch_r(c,blocknums,r->count);
+				break;
+			case DISK_TRACE_CACHE_FLUSH:
+				cache_flush_r(c);
+				break;
+		}
+
+		if(r->op >= DISK_TRACE_CACHE_READ && r->op != DISK_TRACE_CACHE_FLUSH) {
+			cache_stats_r(c,&after);
+			oc->requests++;
+			oc->blocks += r->count;
+			oc->hits += after.hits - before.hits;
+			oc->misses += after.misses - before.misses;
+		}
+	}
+	cache_flush_r(c);
+	o->wall = now() - start;
+
+	for(i = 0; i < ORIGINS; i++) {
+		o->hits += o->origins[i].hits;
+		o->misses += o->origins[i].misses;
+	}
+	disk_stats_r(d,&ds);
+	o->reads = ds.reads;
+	o->writes = ds.writes;
+	o->readcalls = ds.readcalls;
+	o->writecalls = ds.writecalls;
+	o->syncs = syncs;
+	cost(o);
+
+	cache_close_r(c);
+	disk_close_r(d);
+	free(pool);
+	free(blocks);
+	free(blocknums);
+	return 1;
+}
+
+static void print_text( struct outcome *outcomes, int n, int byorigin )
+{
+	int i, k;
+
+	fprintf(report,"%lld records over %.3f s on a %d block disk\n",
+		nrecords,nrecords > 0 ? records[nrecords-1].time/1e9 : 0,header.nblocks);
+	fprintf(report,"%-12s %10s %10s %6s %10s %10s %9s %9s %7s %10s %9s\n",
+		"config","hits","misses","hit%","reads","writes","rcalls","wcalls","syncs","sim ms","wall ms");
+	for(i = 0; i < n; i++) {
+		struct outcome *o = &outcomes[i];
+		long long asked = o->hits + o->misses;
+		if(i == 0) {
+			fprintf(report,"%-12s %10s %10s %6s",o->name,"-","-","-");
+		} else {
+			fprintf(report,"%-12s %10lld %10lld %6.1f",o->name,o->hits,o->misses,asked > 0 ? 100.0*o->hits/asked : 0);
+		}
+		fprintf(report," %10lld %10lld %9lld %9lld %7lld %10.1f %9.1f\n",
+			o->reads,o->writes,o->readcalls,o->writecalls,o->syncs,o->simulated*1e3,o->wall*1e3);
+	}
+
+	if(!byorigin) return;
+	for(i = 1; i < n; i++) {
+		fprintf(report,"\n%s by call:\n",outcomes[i].name);
+		fprintf(report,"    %-12s %10s %10s %10s %10s %6s\n","call","requests","blocks","hits","misses","hit%");
+		for(k = 0; k < ORIGINS; k++) {
+			struct origin_counts *oc = &outcomes[i].origins[k];
+			long long asked = oc->hits + oc->misses;
+			if(oc->requests == 0) continue;
+			fprintf(report,"    %-12s %10lld %10lld %10lld %10lld %6.1f\n",fs_call_name(k),
+				oc->requests,oc->blocks,oc->hits,oc->misses,asked > 0 ? 100.0*oc->hits/asked : 0);
+		}
+	}
+}
+
+static void print_json( struct outcome *outcomes, int n )
+{
+	int i, k, first;
+
+	fprintf(report,"{\n  \"records\": %lld, \"seconds\": %.6f, \"nblocks\": %d,\n",
+		nrecords,nrecords > 0 ? records[nrecords-1].time/1e9 : 0,header.nblocks);
+	fprintf(report,"  \"costs\": {\"call_us\": %g, \"block_us\": %g, \"sync_us\": %g},\n",call_us,block_us,sync_us);
+	fprintf(report,"  \"results\": [\n");
+	for(i = 0; i < n; i++) {
+		struct outcome *o = &outcomes[i];
+		fprintf(report,"    {\"config\": \"%s\", \"hits\": %lld, \"misses\": %lld, \"reads\": %lld, \"writes\": %lld, "
+			"\"readcalls\": %lld, \"writecalls\": %lld, \"syncs\": %lld, \"simulated_ms\": %.3f, \"wall_ms\": %.3f, \"calls\": {",
+			o->name,o->hits,o->misses,o->reads,o->writes,o->readcalls,o->writecalls,o->syncs,o->simulated*1e3,o->wall*1e3);
+		first = 1;
+		for(k = 0; k < ORIGINS; k++) {
+			struct origin_counts *oc = &o->origins[k];
+			if(oc->requests == 0) continue;
+			fprintf(report,"%s\"%s\": {\"requests\": %lld, \"blocks\": %lld, \"hits\": %lld, \"misses\": %lld}",
+				first ? "" : ", ",fs_call_name(k),oc->requests,oc->blocks,oc->hits,oc->misses);
+			first = 0;
+		}
+		fprintf(report,"}}%s\n",i+1 < n ? "," : "");
+	}
+	fprintf(report,"  ]\n}\n");
+}
+
+static void usage( const char *program )
+{
+	printf("use: %s [-a auto|threads|off] [-b pread|mmap] [-c size,size,...] [-j] [-l call_us] [-o]\n"
+	       "       [-s sync_us] [-t block_us] [-v] <trace> <scratch image>\n",program);
+}
+
+int main( int argc, char *argv[] )
+{
+	const char *sizes = DEFAULT_SIZES;
+	struct outcome *outcomes;
+	int json = 0, byorigin = 0, verbose = 0;
+	int opt, n = 0, ok = 1;
+
+	while((opt = getopt(argc,argv,"a:b:c:jl:os:t:v")) != -1) {
+		switch(opt) {
+			case 'a':
+				if(!strcmp(optarg,"auto")) {
+					asyncmode = DISK_ASYNC_AUTO;
+				} else if(!strcmp(optarg,"threads")) {
+					asyncmode = DISK_ASYNC_THREADS;
+				} else if(!strcmp(optarg,"off")) {
+					asyncmode = DISK_ASYNC_OFF;
+				} else {
+					printf("unknown async mode %s, use auto, threads or off\n",optarg);
+					return 1;
+				}
+				break;
+			case 'b':
+				if(!strcmp(optarg,"mmap")) {
+					backend = DISK_BACKEND_MMAP;
+				} else if(!strcmp(optarg,"pread")) {
+					backend = DISK_BACKEND_PREAD;
+				} else {
+					printf("unknown backend %s, use pread or mmap\n",optarg);
+					return 1;
+				}
+				break;
+			case 'c':
+				sizes = optarg;
+				break;
+			case 'j':
+				json = 1;
+				break;
+			case 'l':
+				call_us = atof(optarg);
+				break;
+			case 'o':
+				byorigin = 1;
+				break;
+			case 's':
+				sync_us = atof(optarg);
+				break;
+			case 't':
+				block_us = atof(optarg);
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(argc-optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	// the disk and cache report on stdout as they close; keep the table apart
+	fflush(stdout);
+	report = fdopen(dup(STDOUT_FILENO),"w");
+	if(!report) {
+		printf("couldn't set up the report: %s\n",strerror(errno));
+		return 1;
+	}
+	if(!verbose && !freopen("/dev/null","w",stdout)) {
+		fprintf(report,"couldn't silence the disk: %s\n",strerror(errno));
+		return 1;
+	}
+
+	if(!load_trace(argv[optind])) return 1;
+
+	outcomes = calloc(MAX_SIZES+1,sizeof(struct outcome));
+	if(!outcomes) {
+		fprintf(report,"ERROR: out of memory\n");
+		return 1;
+	}
+	recorded(&outcomes[n++]);
+
+	const char *p = sizes;
+	while(ok && p && *p && n <= MAX_SIZES) {
+		ok = replay(argv[optind+1],atoi(p),&outcomes[n++]);
+		p = strchr(p,',');
+		if(p) p++;
+	}
+
+	if(json) {
+		print_json(outcomes,n);
+	} else {
+		print_text(outcomes,n,byorigin);
+	}
+
+	fclose(report);
+	free(outcomes);
+	free(records);
+	return ok ? 0 : 1;
+}
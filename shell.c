@@ -1,36 +1,122 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "cache.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
-static int do_copyin( const char *filename, int inumber );
-static int do_copyout( int inumber, const char *filename );
+static int run_command( const char *line, FILE *out );
+static int run_batch( FILE *script, int nworkers );
+static int do_copyin( const char *filename, int inumber, FILE *out );
+static int do_copyout( int inumber, const char *filename, FILE *out );
+static int find_inode( const char *arg, int create, FILE *out );
+static int is_new_name( const char *arg );
+static void drop_name( const char *name, int inumber );
+static void print_name( const char *name, int inumber, void *arg );
+static int do_stats( const char *filename, int json, FILE *out );
+static void do_stats_reset();
 
 int main( int argc, char *argv[] )
 {
 	char line[1024];
-	char cmd[1024];
-	char arg1[1024];
-	char arg2[1024];
-	int inumber, result, args;
+	int opt;
+	const char *scriptfile = 0;
+	FILE *script;
+	int status = 0;
+	int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	int cacheblocks = CACHE_DEFAULT_BLOCKS;
+	int backend = DISK_BACKEND_PREAD;
+	int queuedepth = DISK_DEFAULT_QUEUE_DEPTH;
+	int asyncmode = DISK_ASYNC_AUTO;
+
+	while((opt = getopt(argc,argv,"a:b:c:f:j:q:st:")) != -1) {
+		switch(opt) {
+			case 'a':
+				if(!strcmp(optarg,"auto")) {
+					asyncmode = DISK_ASYNC_AUTO;
+				} else if(!strcmp(optarg,"threads")) {
+					asyncmode = DISK_ASYNC_THREADS;
+				} else if(!strcmp(optarg,"off")) {
+					asyncmode = DISK_ASYNC_OFF;
+				} else {
+					printf("unknown async mode %s, use auto, threads or off\n",optarg);
+					return 1;
+				}
+				break;
+			case 'b':
+				if(!strcmp(optarg,"mmap")) {
+					backend = DISK_BACKEND_MMAP;
+				} else if(!strcmp(optarg,"pread")) {
+					backend = DISK_BACKEND_PREAD;
+				} else {
+					printf("unknown backend %s, use pread or mmap\n",optarg);
+					return 1;
+				}
+				break;
+			case 'c':
+				cacheblocks = atoi(optarg);
+				break;
+			case 'f':
+				scriptfile = optarg;
+				break;
+			case 'j':
+				nworkers = atoi(optarg);
+				break;
+			case 'q':
+				queuedepth = atoi(optarg);
+				break;
+			case 's':
+				stats_enable(1);
+				break;
+			case 't':
+				fs_set_scan_threads(atoi(optarg));
+				break;
+			default:
+				printf("use: %s [-a auto|threads|off] [-b pread|mmap] [-c cacheblocks] [-f script] [-j workers] [-q queuedepth] [-s] [-t scanthreads] <diskfile> <nblocks>\n",argv[0]);
+				return 1;
+		}
+	}
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	if(argc-optind!=2) {
+		printf("use: %s [-a auto|threads|off] [-b pread|mmap] [-c cacheblocks] [-f script] [-j workers] [-q queuedepth] [-s] [-t scanthreads] <diskfile> <nblocks>\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
-		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
+	if(!disk_init_backend(argv[optind],atoi(argv[optind+1]),backend)) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	if(!disk_async_init(queuedepth,asyncmode)) {
+		printf("couldn't start asynchronous disk access\n");
+		return 1;
+	}
 
-	while(1) {
+	if(!cache_init(cacheblocks)) {
+		printf("couldn't allocate a %d block cache\n",cacheblocks);
+		return 1;
+	}
+
+	printf("opened emulated disk image %s with %d blocks%s\n",argv[optind],disk_size(),disk_backend()==DISK_BACKEND_MMAP ? " (mmap)" : "");
+
+	if(scriptfile) {
+		script = strcmp(scriptfile,"-") ? fopen(scriptfile,"r") : stdin;
+		if(!script) {
+			printf("couldn't open %s: %s\n",scriptfile,strerror(errno));
+			status = 1;
+		} else {
+			status = run_batch(script,nworkers>0 ? nworkers : 1)>0;
+			if(script!=stdin) fclose(script);
+		}
+	}
+
+	while(!scriptfile) {
 		printf(" simplefs> ");
 		fflush(stdout);
 
@@ -39,143 +125,584 @@ int main( int argc, char *argv[] )
 		if(line[0]=='\n') continue;
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
-		if(args==0) continue;
+		if(run_command(line,stdout)<0) break;
+	}
 
-		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
-					printf("disk formatted.\n");
-				} else {
-					printf("format failed!\n");
-				}
+	if(fs_ismounted()) fs_unmount(); // leaves the disk marked clean for the next mount
+
+	printf("closing emulated disk.\n");
+	cache_close();
+	disk_close();
+
+	return status;
+}
+
+// Carries out one command line, printing what it has to say to out.
+// Returns 1 if it worked, 0 if it failed and -1 for quit.
+static int run_command( const char *line, FILE *out )
+{
+	char cmd[1024];
+	char arg1[1024];
+	char arg2[1024];
+	int inumber, args;
+	int64_t result;
+	int ok = 1;
+
+	args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
+	if(args<=0) return 1;
+
+	if(!strcmp(cmd,"format")) {
+		int features = FS_FEATURE_LARGEFILE, bad = 0, i;
+		for(i = 1; i < args; i++) {
+			const char *opt = (i==1) ? arg1 : arg2;
+			if(!strcmp(opt,"extents")) {
+				features |= FS_FEATURE_EXTENTS;
+			} else if(!strcmp(opt,"inline")) {
+				features |= FS_FEATURE_INLINE;
 			} else {
-				printf("use: format\n");
+				bad = 1;
 			}
-		} else if(!strcmp(cmd,"mount")) {
-			if(args==1) {
-				if(fs_mount()) {
-					printf("disk mounted.\n");
-				} else {
-					printf("mount failed!\n");
-				}
+		}
+		if(!bad) {
+			if(fs_format_with(features)) {
+				fprintf(out,"disk formatted.\n");
 			} else {
-				printf("use: mount\n");
+				fprintf(out,"format failed!\n");
+				ok = 0;
 			}
-		} else if(!strcmp(cmd,"debug")) {
-			if(args==1) {
-				fs_debug();
+		} else {
+			fprintf(out,"use: format [extents] [inline]\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"mount")) {
+		if(args==1) {
+			if(fs_mount()) {
+				fprintf(out,"disk mounted.\n");
 			} else {
-				printf("use: debug\n");
-			}
-		} else if(!strcmp(cmd,"getsize")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
-				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
-				} else {
-					printf("getsize failed!\n");
-				}
+				fprintf(out,"mount failed!\n");
+				ok = 0;
+			}
+		} else {
+			fprintf(out,"use: mount\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"unmount")) {
+		if(args==1) {
+			if(fs_unmount()) {
+				fprintf(out,"disk unmounted.\n");
 			} else {
-				printf("use: getsize <inumber>\n");
-			}
-			
-		} else if(!strcmp(cmd,"create")) {
-			if(args==1) {
-				inumber = fs_create();
-				if(inumber>0) {
-					printf("created inode %d\n",inumber);
-				} else {
-					printf("create failed!\n");
-				}
+				fprintf(out,"unmount failed!\n");
+				ok = 0;
+			}
+		} else {
+			fprintf(out,"use: unmount\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"sync")) {
+		if(args==1) {
+			if(fs_sync()) {
+				fprintf(out,"disk synced.\n");
 			} else {
-				printf("use: create\n");
+				fprintf(out,"sync failed!\n");
+				ok = 0;
 			}
-		} else if(!strcmp(cmd,"delete")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(fs_delete(inumber)) {
-					printf("inode %d deleted.\n",inumber);
-				} else {
-					printf("delete failed!\n");	
-				}
+		} else {
+			fprintf(out,"use: sync\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"debug")) {
+		if(args==1) {
+			fs_debug();
+		} else {
+			fprintf(out,"use: debug\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"getsize")) {
+		if(args==2) {
+			inumber = find_inode(arg1,0,out);
+			result = (inumber>=0) ? fs_getsize(inumber) : 0;
+			if(inumber<0) {
+				ok = 0;
+			} else if(result>=0) {
+				fprintf(out,"inode %d has size %lld\n",inumber,(long long)result);
 			} else {
-				printf("use: delete <inumber>\n");
+				fprintf(out,"getsize failed!\n");
+				ok = 0;
 			}
-		} else if(!strcmp(cmd,"cat")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(!do_copyout(inumber,"/dev/stdout")) {
-					printf("cat failed!\n");
-				}
+		} else {
+			fprintf(out,"use: getsize <inumber|name>\n");
+			ok = 0;
+		}
+		
+	} else if(!strcmp(cmd,"create")) {
+		if(args==1) {
+			inumber = fs_create();
+			if(inumber>0) {
+				fprintf(out,"created inode %d\n",inumber);
+			} else {
+				fprintf(out,"create failed!\n");
+				ok = 0;
+			}
+		} else {
+			fprintf(out,"use: create\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"delete")) {
+		if(args==2) {
+			inumber = find_inode(arg1,0,out);
+			// unlinking the name first spares fs_delete looking for it
+			if(inumber>0 && arg1[strspn(arg1,"0123456789")]) fs_unlink(arg1);
+			if(inumber<0) {
+				ok = 0;
+			} else if(fs_delete(inumber)) {
+				fprintf(out,"inode %d deleted.\n",inumber);
+			} else {
+				fprintf(out,"delete failed!\n");	
+				ok = 0;
+			}
+		} else {
+			fprintf(out,"use: delete <inumber|name>\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"link")) {
+		if(args==3) {
+			inumber = atoi(arg2);
+			if(fs_link(arg1,inumber)) {
+				fprintf(out,"%s linked to inode %d\n",arg1,inumber);
+			} else {
+				fprintf(out,"link failed!\n");
+				ok = 0;
+			}
+		} else {
+			fprintf(out,"use: link <name> <inumber>\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"unlink")) {
+		if(args==2) {
+			if(fs_unlink(arg1)) {
+				fprintf(out,"%s unlinked.\n",arg1);
 			} else {
-				printf("use: cat <inumber>\n");
+				fprintf(out,"unlink failed!\n");
+				ok = 0;
 			}
+		} else {
+			fprintf(out,"use: unlink <name>\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"ls")) {
+		if(args==1) {
+			fprintf(out,"%d names\n",fs_list(print_name,out));
+		} else {
+			fprintf(out,"use: ls\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"truncate")) {
+		if(args==3) {
+			inumber = find_inode(arg1,0,out);
+			if(inumber<0) {
+				ok = 0;
+			} else if(fs_truncate(inumber,atoll(arg2))) {
+				fprintf(out,"inode %d truncated to %lld bytes.\n",inumber,atoll(arg2));
+			} else {
+				fprintf(out,"truncate failed!\n");
+				ok = 0;
+			}
+		} else {
+			fprintf(out,"use: truncate <inumber|name> <size>\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"cat")) {
+		if(args==2) {
+			inumber = find_inode(arg1,0,out);
+			if(inumber<0) {
+				ok = 0;
+			} else if(!do_copyout(inumber,0,out)) {
+				fprintf(out,"cat failed!\n");
+				ok = 0;
+			}
+		} else {
+			fprintf(out,"use: cat <inumber|name>\n");
+			ok = 0;
+		}
 
-		} else if(!strcmp(cmd,"copyin")) {
-			if(args==3) {
-				inumber = atoi(arg2);
-				if(do_copyin(arg1,inumber)) {
-					printf("copied file %s to inode %d\n",arg1,inumber);
-				} else {
-					printf("copy failed!\n");
-				}
+	} else if(!strcmp(cmd,"copyin")) {
+		if(args==3) {
+			// a file that can't be read mustn't leave an empty name behind,
+			// and neither may a copy that fails
+			int created = is_new_name(arg2);
+			if(access(arg1,R_OK)<0) {
+				fprintf(out,"couldn't open %s: %s\n",arg1,strerror(errno));
+				ok = 0;
+			} else if((inumber = find_inode(arg2,1,out))<0) {
+				ok = 0;
+			} else if(do_copyin(arg1,inumber,out)) {
+				fprintf(out,"copied file %s to inode %d\n",arg1,inumber);
 			} else {
-				printf("use: copyin <filename> <inumber>\n");
+				fprintf(out,"copy failed!\n");
+				if(created) drop_name(arg2,inumber);
+				ok = 0;
 			}
+		} else {
+			fprintf(out,"use: copyin <filename> <inumber|name>\n");
+			ok = 0;
+		}
 
-		} else if(!strcmp(cmd,"copyout")) {
-			if(args==3) {
-				inumber = atoi(arg1);
-				if(do_copyout(inumber,arg2)) {
-					printf("copied inode %d to file %s\n",inumber,arg2);
-				} else {
-					printf("copy failed!\n");
-				}
+	} else if(!strcmp(cmd,"copyout")) {
+		if(args==3) {
+			inumber = find_inode(arg1,0,out);
+			if(inumber<0) {
+				ok = 0;
+			} else if(do_copyout(inumber,arg2,out)) {
+				fprintf(out,"copied inode %d to file %s\n",inumber,arg2);
 			} else {
-				printf("use: copyout <inumber> <filename>\n");
-			}
-
-		} else if(!strcmp(cmd,"help")) {
-			printf("Commands are:\n");
-			printf("    format\n");
-			printf("    mount\n");
-			printf("    debug\n");
-			printf("    create\n");
-			printf("    delete  <inode>\n");
-			printf("    cat     <inode>\n");
-			printf("    copyin  <file> <inode>\n");
-			printf("    copyout <inode> <file>\n");
-			printf("    help\n");
-			printf("    quit\n");
-			printf("    exit\n");
-		} else if(!strcmp(cmd,"quit")) {
-			break;
-		} else if(!strcmp(cmd,"exit")) {
-			break;
+				fprintf(out,"copy failed!\n");
+				ok = 0;
+			}
 		} else {
-			printf("unknown command: %s\n",cmd);
-			printf("type 'help' for a list of commands.\n");
-			result = 1;
+			fprintf(out,"use: copyout <inumber|name> <filename>\n");
+			ok = 0;
 		}
+
+	} else if(!strcmp(cmd,"stats")) {
+		if(args==1) {
+			do_stats(0,0,out);
+		} else if(!strcmp(arg1,"json")) {
+			if(!do_stats(args==3 ? arg2 : 0,1,out)) {
+				fprintf(out,"stats failed!\n");
+				ok = 0;
+			}
+		} else if(args==2 && !strcmp(arg1,"reset")) {
+			do_stats_reset();
+			fprintf(out,"statistics reset.\n");
+		} else if(args==2 && (!strcmp(arg1,"on") || !strcmp(arg1,"off"))) {
+			stats_enable(!strcmp(arg1,"on"));
+			fprintf(out,"timing turned %s.\n",arg1);
+		} else {
+			fprintf(out,"use: stats [on|off|reset|json [file]]\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"trace")) {
+		if(args==2 && !strcmp(arg1,"off")) {
+			disk_trace_stop();
+			fprintf(out,"tracing stopped.\n");
+		} else if(args==2) {
+			if(disk_trace_start(arg1)) {
+				fprintf(out,"tracing disk accesses to %s\n",arg1);
+			} else {
+				fprintf(out,"couldn't trace to %s: %s\n",arg1,strerror(errno));
+				ok = 0;
+			}
+		} else {
+			fprintf(out,"use: trace <file>|off\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"help")) {
+		fprintf(out,"Commands are:\n");
+		fprintf(out,"    format  [extents] [inline]\n");
+		fprintf(out,"    mount\n");
+		fprintf(out,"    unmount\n");
+		fprintf(out,"    sync\n");
+		fprintf(out,"    debug\n");
+		fprintf(out,"    create\n");
+		fprintf(out,"    delete  <inode|name>\n");
+		fprintf(out,"    truncate <inode|name> <size>\n");
+		fprintf(out,"    cat     <inode|name>\n");
+		fprintf(out,"    copyin  <file> <inode|name>\n");
+		fprintf(out,"    copyout <inode|name> <file>\n");
+		fprintf(out,"    link    <name> <inode>\n");
+		fprintf(out,"    unlink  <name>\n");
+		fprintf(out,"    ls\n");
+		fprintf(out,"    stats   [on|off|reset|json [file]]\n");
+		fprintf(out,"    trace   <file>|off\n");
+		fprintf(out,"    help\n");
+		fprintf(out,"    quit\n");
+		fprintf(out,"    exit\n");
+	} else if(!strcmp(cmd,"quit") || !strcmp(cmd,"exit")) {
+		return -1;
+	} else {
+		fprintf(out,"unknown command: %s\n",cmd);
+		fprintf(out,"type 'help' for a list of commands.\n");
+		ok = 0;
 	}
 
-	printf("closing emulated disk.\n");
-	disk_close();
+	return ok;
+}
+
+#define BATCH_WINDOW 256   // commands running or waiting to be printed
+#define BATCH_KINDS  16    // command names timed separately in the summary
+
+struct batch_job {
+	char line[1024];
+	int lineno;
+	int inumber;           // the inode it works on, 0 if it has to run alone
+	const char *hostfile;  // the file it reads or writes outside the image, if any
+	char arg[1024];
+	char created[1024];    // the name batch_inode made for a copyin, if it did
+	int status;            // what run_command returned
+	int done;
+	uint64_t elapsed;
+	char *text;            // what it printed, to go out in script order
+	size_t textlen;
+};
+
+struct batch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct batch_job *jobs[BATCH_WINDOW];  // in script order, oldest at head
+	int head;
+	int count;
+	int started;           // how many of them the workers have picked up
+	int stopping;
+
+	long long commands;
+	long long failed;
+	uint64_t busy;
+	int nkinds;
+	char kinds[BATCH_KINDS][32];
+	struct histogram times[BATCH_KINDS];
+};
+
+// Works out which inode a command touches, so that commands on different
+// inodes can run side by side. A name given to copyin is created here, in
+// script order, so the inode numbers come out as they would one at a time,
+// and goes again in batch_run if the copy fails. Anything that isn't about
+// one file gets 0 and runs with nothing else.
+static int batch_inode( struct batch_job *job )
+{
+	char cmd[1024], arg1[1024], arg2[1024];
+	int args = sscanf(job->line,"%s %s %s",cmd,arg1,arg2);
+
+	job->hostfile = 0;
+	if(args==3 && !strcmp(cmd,"copyin")) {
+		strcpy(job->arg,arg1);
+		job->hostfile = job->arg;
+		// one that can't be read yet fails alone, or waits for what writes it
+		if(access(arg1,R_OK)<0) return 0;
+		if(is_new_name(arg2)) strcpy(job->created,arg2);
+		return find_inode(arg2,1,0);
+	}
+	if(args==3 && !strcmp(cmd,"copyout")) {
+		strcpy(job->arg,arg2);
+		job->hostfile = job->arg;
+		return find_inode(arg1,0,0);
+	}
+	if(args==2 && (!strcmp(cmd,"cat") || !strcmp(cmd,"getsize"))) return find_inode(arg1,0,0);
+	if(args==3 && !strcmp(cmd,"truncate")) return find_inode(arg1,0,0);
+	return 0;
+}
+
+// true if a job still running works on the same inode or host file
+static int batch_busy( struct batch *b, const struct batch_job *job )
+{
+	int i;
+
+	for(i = 0; i < b->count; i++) {
+		const struct batch_job *other = b->jobs[(b->head+i)%BATCH_WINDOW];
+		if(other->done) continue;
+		if(other->inumber==job->inumber) return 1;
+		if(other->hostfile && job->hostfile && !strcmp(other->hostfile,job->hostfile)) return 1;
+	}
+	return 0;
+}
+
+static void batch_run( struct batch_job *job )
+{
+	FILE *out = open_memstream(&job->text,&job->textlen);
+	uint64_t start = stats_clock();
+
+	job->status = run_command(job->line,out ? out : stdout);
+	if(!job->status && job->created[0] && job->inumber>0) drop_name(job->created,job->inumber);
+	job->elapsed = stats_clock()-start;
+	if(out) fclose(out);
+}
+
+// Prints what a finished job had to say with its timing and adds it to the
+// summary. Only the main thread does this.
+static void batch_report( struct batch *b, struct batch_job *job )
+{
+	char cmd[24] = "";
+	int i;
+
+	if(job->text) fwrite(job->text,1,job->textlen,stdout);
+	printf("# line %d, %.3f ms: %s\n",job->lineno,job->elapsed/1000000.0,job->line);
+
+	b->commands++;
+	if(job->status==0) b->failed++;
+	b->busy += job->elapsed;
 
+	sscanf(job->line,"%23s",cmd);
+	for(i = 0; i < b->nkinds; i++) {
+		if(!strcmp(b->kinds[i]+6,cmd)) break;
+	}
+	if(i==b->nkinds && i<BATCH_KINDS) {
+		snprintf(b->kinds[i],sizeof(b->kinds[i]),"shell.%s",cmd);
+		b->nkinds++;
+	}
+	if(i<BATCH_KINDS) histogram_add(&b->times[i],job->elapsed,0);
+
+	free(job->text);
+	free(job);
+}
+
+// Prints the finished jobs at the head of the window and waits until job
+// may go ahead: when nothing else it conflicts with is running, or when the
+// window is empty if it has to run alone. Called with the lock held.
+static void batch_wait( struct batch *b, const struct batch_job *job )
+{
+	struct batch_job *first;
+
+	while(1) {
+		if(b->count>0 && b->jobs[b->head]->done) {
+			first = b->jobs[b->head];
+			b->head = (b->head+1)%BATCH_WINDOW;
+			b->count--;
+			b->started--;
+			pthread_mutex_unlock(&b->lock);
+			batch_report(b,first);
+			pthread_mutex_lock(&b->lock);
+			continue;
+		}
+		if(!job || job->inumber<=0) {
+			if(b->count==0) return;
+		} else if(b->count<BATCH_WINDOW && !batch_busy(b,job)) {
+			return;
+		}
+		pthread_cond_wait(&b->cond,&b->lock);
+	}
+}
+
+static void *batch_worker( void *arg )
+{
+	struct batch *b = arg;
+	struct batch_job *job;
+
+	pthread_mutex_lock(&b->lock);
+	while(1) {
+		while(!b->stopping && b->started==b->count) {
+			pthread_cond_wait(&b->cond,&b->lock);
+		}
+		if(b->started==b->count) break;
+
+		job = b->jobs[(b->head+b->started)%BATCH_WINDOW];
+		b->started++;
+		pthread_mutex_unlock(&b->lock);
+
+		batch_run(job);
+
+		pthread_mutex_lock(&b->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&b->cond);
+	}
+	pthread_mutex_unlock(&b->lock);
 	return 0;
 }
 
-static int do_copyin( const char *filename, int inumber )
+// Runs a script of shell commands, one per line. Commands on different
+// inodes go to a pool of nworkers threads and overlap; the rest wait for
+// everything before them and run alone. Output still comes out in script
+// order, each command followed by how long it took, and a summary at the
+// end. Blank lines and lines starting with # are skipped. Returns the
+// number of commands that failed.
+static int run_batch( FILE *script, int nworkers )
+{
+	struct batch *b;
+	struct batch_job *job;
+	struct stats_entry entries[BATCH_KINDS];
+	struct stats_counter counters[5];
+	pthread_t *threads;
+	char line[1024];
+	char cmd[1024];
+	uint64_t start;
+	int lineno = 0, nthreads = 0, failed, i;
+
+	b = calloc(1,sizeof(*b));
+	threads = calloc(nworkers,sizeof(*threads));
+	if(!b || !threads) {
+		printf("couldn't allocate a batch of %d workers\n",nworkers);
+		free(b);
+		free(threads);
+		return 1;
+	}
+	pthread_mutex_init(&b->lock,0);
+	pthread_cond_init(&b->cond,0);
+
+	for(i = 0; i < nworkers; i++) {
+		if(pthread_create(&threads[nthreads],0,batch_worker,b)==0) nthreads++;
+	}
+
+	start = stats_clock();
+
+	while(fgets(line,sizeof(line),script)) {
+		lineno++;
+		line[strcspn(line,"\r\n")] = 0;
+		if(sscanf(line,"%s",cmd)!=1 || cmd[0]=='#') continue;
+		if(!strcmp(cmd,"quit") || !strcmp(cmd,"exit")) break;
+
+		job = calloc(1,sizeof(*job));
+		if(!job) {
+			printf("couldn't allocate a job for line %d\n",lineno);
+			break;
+		}
+		strcpy(job->line,line);
+		job->lineno = lineno;
+
+		job->inumber = nthreads ? batch_inode(job) : 0;
+
+		pthread_mutex_lock(&b->lock);
+		batch_wait(b,job);
+		if(job->inumber>0) {
+			b->jobs[(b->head+b->count)%BATCH_WINDOW] = job;
+			b->count++;
+			pthread_cond_broadcast(&b->cond);
+			pthread_mutex_unlock(&b->lock);
+		} else {
+			pthread_mutex_unlock(&b->lock);
+			fflush(stdout);
+			batch_run(job);
+			batch_report(b,job);
+		}
+	}
+
+	pthread_mutex_lock(&b->lock);
+	batch_wait(b,0);
+	b->stopping = 1;
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->lock);
+	for(i = 0; i < nthreads; i++) {
+		pthread_join(threads[i],0);
+	}
+
+	counters[0] = (struct stats_counter){"batch.commands",b->commands};
+	counters[1] = (struct stats_counter){"batch.failed",b->failed};
+	counters[2] = (struct stats_counter){"batch.workers",nthreads};
+	counters[3] = (struct stats_counter){"batch.wall_us",(long long)((stats_clock()-start)/1000)};
+	counters[4] = (struct stats_counter){"batch.busy_us",(long long)(b->busy/1000)};
+	for(i = 0; i < b->nkinds; i++) {
+		entries[i] = (struct stats_entry){b->kinds[i],"ns",&b->times[i]};
+	}
+	printf("batch summary:\n");
+	stats_print(stdout,0,counters,5,entries,b->nkinds);
+
+	failed = b->failed;
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->cond);
+	free(threads);
+	free(b);
+	return failed;
+}
+
+static int do_copyin( const char *filename, int inumber, FILE *out )
 {
 	FILE *file;
-	int offset=0, result, actual;
+	int64_t offset=0;
+	int result, actual, ok = 1;
 	char buffer[16384];
 
 	file = fopen(filename,"r");
 	if(!file) {
-		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fprintf(out,"couldn't open %s: %s\n",filename,strerror(errno));
 		return 0;
 	}
 
@@ -185,32 +712,44 @@ static int do_copyin( const char *filename, int inumber )
 		if(result>0) {
 			actual = fs_write(inumber,buffer,result,offset);
 			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
+				fprintf(out,"ERROR: fs_write return invalid result %d\n",actual);
+				ok = 0;
 				break;
 			}
 			offset += actual;
 			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+				fprintf(out,"WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+				ok = 0;
 				break;
 			}
 		}
 	}
 
-	printf("%d bytes copied\n",offset);
+	if(ferror(file)) {
+		fprintf(out,"couldn't read %s: %s\n",filename,strerror(errno));
+		ok = 0;
+	}
+
+	fprintf(out,"%lld bytes copied\n",(long long)offset);
 
 	fclose(file);
-	return 1;
+	return ok;
 }
 
-static int do_copyout( int inumber, const char *filename )
+// copies an inode to a file, or straight onto out if filename is 0
+static int do_copyout( int inumber, const char *filename, FILE *out )
 {
 	FILE *file;
-	int offset=0, result;
+	int64_t offset=0;
+	int result;
 	char buffer[16384];
 
-	file = fopen(filename,"w");
+	// an inode that isn't there leaves no empty file behind
+	if(fs_getsize(inumber)<0) return 0;
+
+	file = filename ? fopen(filename,"w") : out;
 	if(!file) {
-		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fprintf(out,"couldn't open %s: %s\n",filename,strerror(errno));
 		return 0;
 	}
 
@@ -221,9 +760,99 @@ static int do_copyout( int inumber, const char *filename )
 		offset += result;
 	}
 
-	printf("%d bytes copied\n",offset);
+	fprintf(out,"%lld bytes copied\n",(long long)offset);
 
-	fclose(file);
+	if(filename) fclose(file);
 	return 1;
 }
 
+// Turns a command argument into an inode: a number is taken as it is,
+// anything else is looked up as a name. With create set a name that isn't
+// there yet gets a new inode of its own. Returns -1 if there is no such
+// name (or it couldn't be made), after saying so on out unless that is 0.
+static int find_inode( const char *arg, int create, FILE *out )
+{
+	int inumber;
+
+	if(arg[strspn(arg,"0123456789")]==0) return atoi(arg);
+
+	inumber = fs_lookup(arg);
+	if(inumber>0) return inumber;
+
+	if(!create) {
+		if(out) fprintf(out,"no such name: %s\n",arg);
+		return -1;
+	}
+
+	inumber = fs_create();
+	if(inumber>0 && !fs_link(arg,inumber)) {
+		fs_delete(inumber);
+		inumber = 0;
+	}
+	if(inumber<=0) {
+		if(out) fprintf(out,"couldn't create %s\n",arg);
+		return -1;
+	}
+	return inumber;
+}
+
+// whether arg is a name that doesn't stand for an inode yet
+static int is_new_name( const char *arg )
+{
+	return arg[strspn(arg,"0123456789")]!=0 && fs_lookup(arg)==0;
+}
+
+// takes back a name made for a copyin that failed, and its inode with it
+static void drop_name( const char *name, int inumber )
+{
+	fs_unlink(name);
+	fs_delete(inumber);
+}
+
+static void print_name( const char *name, int inumber, void *arg )
+{
+	fprintf(arg,"%-24s inode %-8d %lld bytes\n",name,inumber,(long long)fs_getsize(inumber));
+}
+
+// Prints the disk and cache counters and every histogram with something in
+// it. The histograms only fill up while timing is on (stats on, or -s).
+static int do_stats( const char *filename, int json, FILE *out )
+{
+	struct stats_entry entries[32];
+	struct stats_counter counters[9];
+	struct disk_stats ds;
+	struct cache_stats cs;
+	int n = 0;
+	FILE *file;
+
+	disk_stats_r(disk_default(),&ds);
+	cache_stats_r(cache_default(),&cs);
+	counters[0] = (struct stats_counter){"disk.block_reads",ds.reads};
+	counters[1] = (struct stats_counter){"disk.block_writes",ds.writes};
+	counters[2] = (struct stats_counter){"disk.read_calls",ds.readcalls};
+	counters[3] = (struct stats_counter){"disk.write_calls",ds.writecalls};
+	counters[4] = (struct stats_counter){"disk.discards",ds.discards};
+	counters[5] = (struct stats_counter){"cache.hits",cs.hits};
+	counters[6] = (struct stats_counter){"cache.misses",cs.misses};
+	counters[7] = (struct stats_counter){"cache.writebacks",cs.writebacks};
+	counters[8] = (struct stats_counter){"cache.prefetched",cs.prefetched};
+
+	n += fs_histograms_r(fs_default(),entries+n,32-n);
+	n += disk_histograms_r(disk_default(),entries+n,32-n);
+
+	file = filename ? fopen(filename,"w") : out;
+	if(!file) {
+		fprintf(out,"couldn't open %s: %s\n",filename,strerror(errno));
+		return 0;
+	}
+	stats_print(file,json,counters,9,entries,n);
+	if(filename) fclose(file);
+	return 1;
+}
+
+static void do_stats_reset()
+{
+	fs_stats_reset_r(fs_default());
+	disk_stats_reset_r(disk_default());
+	cache_stats_reset_r(cache_default());
+}
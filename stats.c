@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define SUB_STEPS (1 << STATS_SUB_BITS)
+
+int stats_on = 0;
+
+void stats_enable( int on )
+{
+	__atomic_store_n(&stats_on,on ? 1 : 0,__ATOMIC_RELAXED);
+}
+
+// nanoseconds on the monotonic clock, never 0
+uint64_t stats_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec + 1;
+}
+
+// Values below SUB_STEPS get a bucket each. Above that the bucket is picked
+// by the position of the top bit and the STATS_SUB_BITS bits under it.
+static int bucket_of( uint64_t value )
+{
+	if(value < SUB_STEPS) return (int)value;
+
+	int top = 63 - __builtin_clzll(value);
+	int sub = (int)(value >> (top-STATS_SUB_BITS)) & (SUB_STEPS-1);
+	return (top-STATS_SUB_BITS+1)*SUB_STEPS + sub;
+}
+
+// smallest value that lands in bucket
+static uint64_t bucket_low( int bucket )
+{
+	if(bucket < SUB_STEPS) return bucket;
+
+	int top = bucket/SUB_STEPS + STATS_SUB_BITS - 1;
+	return (uint64_t)(SUB_STEPS + bucket%SUB_STEPS) << (top-STATS_SUB_BITS);
+}
+
+static uint64_t bucket_high( int bucket )
+{
+	return bucket+1 < STATS_BUCKETS ? bucket_low(bucket+1)-1 : UINT64_MAX;
+}
+
+void histogram_add( struct histogram *h, uint64_t value, uint64_t bytes )
+{
+	__atomic_fetch_add(&h->buckets[bucket_of(value)],1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count,1,__ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->total,value,__ATOMIC_RELAXED);
+	if(bytes) __atomic_fetch_add(&h->bytes,bytes,__ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&h->max,__ATOMIC_RELAXED);
+	while(value > max && !__atomic_compare_exchange_n(&h->max,&max,value,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+// A reset racing with histogram_add may leave that one value half counted,
+// which is good enough for numbers that are only ever looked at.
+void histogram_reset( struct histogram *h )
+{
+	int i;
+
+	__atomic_store_n(&h->count,0,__ATOMIC_RELAXED);
+	__atomic_store_n(&h->total,0,__ATOMIC_RELAXED);
+	__atomic_store_n(&h->max,0,__ATOMIC_RELAXED);
+	__atomic_store_n(&h->bytes,0,__ATOMIC_RELAXED);
+	for(i = 0; i < STATS_BUCKETS; i++){
+		__atomic_store_n(&h->buckets[i],0,__ATOMIC_RELAXED);
+	}
+}
+
+// the value percent% of the recorded ones are at or below, rounded up to
+// the top of its bucket
+uint64_t histogram_percentile( const struct histogram *h, double percent )
+{
+	uint64_t count = __atomic_load_n(&h->count,__ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&h->max,__ATOMIC_RELAXED);
+	uint64_t want = (uint64_t)(count*percent/100.0 + 0.5);
+	uint64_t seen = 0;
+	int i;
+
+	if(count == 0) return 0;
+	if(want < 1) want = 1;
+
+	for(i = 0; i < STATS_BUCKETS; i++){
+		seen += __atomic_load_n(&h->buckets[i],__ATOMIC_RELAXED);
+		if(seen >= want) {
+			uint64_t high = bucket_high(i);
+			return high < max ? high : max;
+		}
+	}
+	return max;
+}
+
+static int is_time( const struct stats_entry *e )
+{
+	return !strcmp(e->unit,"ns");
+}
+
+static void print_table( FILE *out, const struct stats_counter *counters, int ncounters,
+	const struct stats_entry *entries, int nentries )
+{
+	int i;
+
+	for(i = 0; i < ncounters; i++){
+		fprintf(out,"%-24s %12lld\n",counters[i].name,counters[i].value);
+	}
+
+	fprintf(out,"%-24s %5s %10s %10s %10s %10s %10s %10s %10s\n",
+		"operation","unit","count","mean","p50","p90","p99","max","MB");
+	for(i = 0; i < nentries; i++){
+		const struct histogram *h = entries[i].h;
+		if(h->count == 0) continue;
+
+		// latencies in microseconds, anything else as it is
+		double scale = is_time(&entries[i]) ? 1000.0 : 1.0;
+		fprintf(out,"%-24s %5s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			entries[i].name,is_time(&entries[i]) ? "us" : entries[i].unit,
+			(unsigned long long)h->count,
+			(double)h->total/h->count/scale,
+			histogram_percentile(h,50)/scale,
+			histogram_percentile(h,90)/scale,
+			histogram_percentile(h,99)/scale,
+			h->max/scale,
+			h->bytes/(1024.0*1024.0));
+	}
+}
+
+static void print_json( FILE *out, const struct stats_counter *counters, int ncounters,
+	const struct stats_entry *entries, int nentries )
+{
+	int i, j, first;
+
+	fprintf(out,"{\"enabled\": %s, \"counters\": {",__atomic_load_n(&stats_on,__ATOMIC_RELAXED) ? "true" : "false");
+	for(i = 0; i < ncounters; i++){
+		fprintf(out,"%s\"%s\": %lld",i ? ", " : "",counters[i].name,counters[i].value);
+	}
+	fprintf(out,"}, \"histograms\": {");
+	for(i = 0; i < nentries; i++){
+		const struct histogram *h = entries[i].h;
+		fprintf(out,"%s\n  \"%s\": {\"unit\": \"%s\", \"count\": %llu, \"total\": %llu, \"max\": %llu, \"bytes\": %llu, "
+			"\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"buckets\": [",
+			i ? "," : "",entries[i].name,entries[i].unit,
+			(unsigned long long)h->count,(unsigned long long)h->total,
+			(unsigned long long)h->max,(unsigned long long)h->bytes,
+			(unsigned long long)histogram_percentile(h,50),
+			(unsigned long long)histogram_percentile(h,90),
+			(unsigned long long)histogram_percentile(h,99),
+			(unsigned long long)histogram_percentile(h,99.9));
+
+		// only the buckets in use, as [lowest value, count]
+		first = 1;
+		for(j = 0; j < STATS_BUCKETS; j++){
+			if(!h->buckets[j]) continue;
+			fprintf(out,"%s[%llu, %llu]",first ? "" : ", ",
+				(unsigned long long)bucket_low(j),(unsigned long long)h->buckets[j]);
+			first = 0;
+		}
+		fprintf(out,"]}");
+	}
+	fprintf(out,"\n}}\n");
+}
+
+void stats_print( FILE *out, int json, const struct stats_counter *counters, int ncounters,
+	const struct stats_entry *entries, int nentries )
+{
+	if(json) {
+		print_json(out,counters,ncounters,entries,nentries);
+	} else {
+		print_table(out,counters,ncounters,entries,nentries);
+	}
+}
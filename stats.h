@@ -0,0 +1,64 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define STATS_SUB_BITS 2                             // linear steps per power of two, as a power of two
+#define STATS_BUCKETS  (64 << STATS_SUB_BITS)
+
+// Log-linear histogram in the style of HdrHistogram: values are sorted
+// into buckets a power of two wide, each split into 1<<STATS_SUB_BITS equal
+// steps, so any value is known to within 25% over the whole 64-bit range
+// in a fixed 2 KB. Recording is a handful of atomic adds and takes no lock,
+// so any number of threads can share one histogram.
+struct histogram {
+	uint64_t count;
+	uint64_t total;   // sum of the values recorded
+	uint64_t max;
+	uint64_t bytes;   // data moved by the operations recorded, if any
+	uint64_t buckets[STATS_BUCKETS];
+};
+
+// one histogram to report, with what its values count
+struct stats_entry {
+	const char *name;
+	const char *unit;  // "ns" for latencies, printed in microseconds
+	const struct histogram *h;
+};
+
+// one plain counter to report beside them
+struct stats_counter {
+	const char *name;
+	long long value;
+};
+
+// Timing is off until stats_enable turns it on. While it is off
+// stats_start is a single load and branch and stats_end does nothing, so
+// the calls can stay on every path.
+extern int stats_on;
+
+void     stats_enable( int on );
+uint64_t stats_clock();
+
+static inline uint64_t stats_start()
+{
+	return __builtin_expect(__atomic_load_n(&stats_on,__ATOMIC_RELAXED),0) ? stats_clock() : 0;
+}
+
+void histogram_add( struct histogram *h, uint64_t value, uint64_t bytes );
+void histogram_reset( struct histogram *h );
+uint64_t histogram_percentile( const struct histogram *h, double percent );
+
+// records the time since start, if stats_start was timing
+static inline void stats_end( struct histogram *h, uint64_t start, uint64_t bytes )
+{
+	if(start) histogram_add(h,stats_clock()-start,bytes);
+}
+
+// prints the counters and every histogram with something in it, as a table
+// or as one JSON object
+void stats_print( FILE *out, int json, const struct stats_counter *counters, int ncounters,
+	const struct stats_entry *entries, int nentries );
+
+#endif